@@ -2,7 +2,7 @@
 //
 // Stream massive XML into JSONL / MySQL-dump / (optional) SQLite.
 // - Modes: generic | nmap
-// - Formats: jsonl | mysql-sql | (sqlite with -DWITH_SQLITE)
+// - Formats: jsonl | mysql-sql | mysql-tsv | (sqlite with -DWITH_SQLITE)
 // - Help shows when no args and no piped stdin.
 // - Graceful SIGINT: finishes current record then exits.
 //
@@ -10,23 +10,29 @@
 //   deps:
 //     sudo apt-get update
 //     sudo apt-get install -y build-essential libxml2-dev nlohmann-json3-dev
-//   g++ -O2 -std=c++17 xmlstream.cpp -o xml2stream $(pkg-config --cflags --libs libxml-2.0)
+//   g++ -O2 -std=c++17 -pthread xmlstream.cpp -o xml2stream $(pkg-config --cflags --libs libxml-2.0)
 //
 // With SQLite output:
 //   sudo apt-get install -y libsqlite3-dev
-//   g++ -O2 -std=c++17 xmlstream.cpp -o xml2stream $(pkg-config --cflags --libs libxml-2.0) -DWITH_SQLITE -lsqlite3
+//   g++ -O2 -std=c++17 -pthread xmlstream.cpp -o xml2stream $(pkg-config --cflags --libs libxml-2.0) -DWITH_SQLITE -lsqlite3
+//
+// With compressed input/output (any subset):
+//   -DWITH_ZLIB -lz  -DWITH_ZSTD -lzstd  -DWITH_LZMA -llzma
 //
 // Usage examples:
 //   ./xml2stream --mode nmap --record-tag host -i scan.xml -o out.jsonl
 //   cat big.xml | ./xml2stream --mode generic --record-tag item -o -
+//   ./xml2stream --mode nmap -i scans/ --threads 8 -o all.jsonl   (every scans/*.xml, _source/_offset added)
 //   ./xml2stream --mode nmap --record-tag host --format mysql-sql -i scan.xml -o scan.sql
 //   (sqlite) ./xml2stream --mode nmap --record-tag host --format sqlite --sqlite-db scan.db -i scan.xml
+//   ./xml2stream --gen-corpus nmap:hosts=100000 -o scan.xml && ./xml2stream --bench --record-tag host -i scan.xml
 
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <optional>
 #include <algorithm>   // std::max
 #include <cstdlib>     // atoi
@@ -34,54 +40,304 @@
 #include <getopt.h>
 #include <unistd.h>    // isatty
 #include <cstdio>      // fileno
+#include <cstring>     // strlen, strcmp
+#include <cctype>
+#include <cmath>       // ceil
+#include <cstdint>
+#include <cerrno>
+#include <memory>
+#include <memory_resource>
+#include <functional>
+#include <type_traits>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/uio.h>     // writev
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <poll.h>
+#include <climits>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XS_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define XS_NEON 1
+#endif
 
 #include <libxml/xmlreader.h>
+#include <libxml/parser.h>
+#include <libxml/SAX2.h>
+#include <libxml/parserInternals.h>  // XML_MAX_LOOKUP_LIMIT
 #include <nlohmann/json.hpp>
 
 #ifdef WITH_SQLITE
 #include <sqlite3.h>
 #endif
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZMA
+#include <lzma.h>
+#endif
+
+// ---------- Allocation counting (--stats) ----------
+// Replaces the global operator new so --stats can report allocations per
+// record; a relaxed load is all it costs when counting is off. The default
+// operator delete already frees with std::free.
+static std::atomic<bool> g_count_allocs{false};
+static std::atomic<uint64_t> g_cxx_allocs{0}, g_xml_allocs{0};
+
+void* operator new(std::size_t n) {
+    if (g_count_allocs.load(std::memory_order_relaxed)) g_cxx_allocs.fetch_add(1, std::memory_order_relaxed);
+    for (;;) {
+        if (void* p = std::malloc(n ? n : 1)) return p;
+        std::new_handler h = std::get_new_handler();
+        if (!h) throw std::bad_alloc();
+        h();
+    }
+}
+void* operator new(std::size_t n, std::align_val_t al) {
+    if (g_count_allocs.load(std::memory_order_relaxed)) g_cxx_allocs.fetch_add(1, std::memory_order_relaxed);
+    const size_t a = (size_t)al;
+    for (;;) {
+        if (void* p = std::aligned_alloc(a, (std::max<size_t>(n, 1) + a - 1) / a * a)) return p;
+        std::new_handler h = std::get_new_handler();
+        if (!h) throw std::bad_alloc();
+        h();
+    }
+}
 
 // ---------- SIGINT handling ----------
 static volatile std::sig_atomic_t g_stop_requested = 0;
 static void sigint_handler(int) { g_stop_requested = 1; }
 
 // ---------- CLI options ----------
+struct RecordQuery;
+struct RecordPaths;
+class DeltaIndex;
+struct ShardSpec;
+struct TypeNode;
+struct RecordLimits;
+
 struct Options {
     std::string input = "-";
+    std::vector<std::string> input_specs;   // every -i (and positional argument), before expansion
+    std::string input_list;                 // --input-list FILE: one input per line
+    std::vector<std::string> inputs;        // several inputs (see inputs_convert): the files; empty for one
     std::string output = "-";
     std::string mode = "generic";           // "generic" | "nmap"
-    std::string record_tag;                 // e.g., "host" for nmap
-    std::string format = "jsonl";           // "jsonl" | "mysql-sql" | "sqlite" (if compiled)
+    std::string record_tag;                 // e.g., "host" for nmap; comma-separated for several
+    std::string record_path;                // --record-path /a/b,//c (see RecordPaths)
+    const RecordPaths* records = nullptr;   // compiled from the two above
+    std::string format = "jsonl";           // "jsonl" | "bson" | "msgpack" | "cbor" | "mysql-sql" | "mysql-tsv"
+                                            // | "sqlite" (if compiled)
     bool pretty = false;
+    std::string schema = "json";            // "json" | "relational" (nmap mode, SQL formats)
+    bool dom = false;                       // build nlohmann::json trees (implied by --pretty)
+    std::string parser = "reader";          // "reader" (xmlTextReader) | "sax" (generic mode only)
+    int threads = 1;                        // conversion workers; 1 = convert on the reader thread
+    bool unordered = false;                 // with --threads: write results as they finish
+    int queue_depth = 0;                    // records in flight with --threads (0 = 16 per worker)
+    bool chunked = false;                   // -i FILE only: parse record-aligned chunks in parallel
+    size_t chunk_size = 16u << 20;
+
+    // record filters (JSON output; see RecordQuery)
+    std::string fields;                     // --fields a.b,c: keep only these paths
+    std::string where;                      // --where a.b=v,...: keep only matching records
+    const RecordQuery* query = nullptr;     // compiled from the two above (null: no filter)
+
+    // mysql-sql
+    size_t mysql_rows_per_insert = 1;       // rows per extended INSERT
+    size_t mysql_max_packet = 1u << 20;     // byte cap per INSERT (keep below max_allowed_packet)
+    size_t mysql_commit_every = 0;          // wrap every K statements in a transaction (0 = off)
+    std::string mysql_table = "records";    // may contain {tag} (a table per record type)
+
+    // compression (input codec is detected from its magic bytes)
+    std::string compress;                   // --compress zstd|gzip for jsonl / mysql-sql output
+    int compress_level = -1;                // -1 = codec default (zstd 3, gzip 6)
+    int compress_threads = 0;               // zstd worker threads (0 = compress on the writing thread)
+
+    // output buffering (jsonl / mysql-sql / mysql-tsv)
+    size_t out_buffer = 8u << 20;           // bytes collected before each write()
+    bool out_direct = false;                // O_DIRECT for -o FILE
+
+    // restartable runs (see Checkpoints)
+    std::string checkpoint;                 // --checkpoint FILE
+    int checkpoint_interval = 30;           // seconds between checkpoints
+    bool resume = false;                    // continue from the checkpoint
+
+    // incremental nmap runs (see DeltaIndex)
+    std::string delta;                      // --delta INDEX: last run's address -> hash index
+    std::string tombstones;                 // hosts gone since then (default: INDEX.removed.jsonl)
+    const DeltaIndex* delta_index = nullptr;    // loaded from `delta`
+
+    // output partitioning (see ShardSpec)
+    std::string shard_by;                   // --shard-by PATH[/BITS]
+    size_t shards = 0;                      // --shards N: hash into N outputs (0: one per value)
+    size_t max_shards = 256;                // --max-shards N: cap on the outputs of a shard per value
+    const ShardSpec* shard = nullptr;       // compiled from the two above
+
+    // typed output (see TypeNode)
+    size_t infer_sample = 0;                // --infer-schema N: records sampled in a pre-pass
+    std::string schema_file;                // --schema-file FILE: save the inferred schema / load it
+    const TypeNode* types = nullptr;        // the schema records are rewritten to (null: strings)
+
+    // oversized records (see RecordLimits)
+    size_t max_record_bytes = 0;            // --max-record-bytes N: text/attribute bytes kept per record
+    size_t max_children = 0;                // --max-children N: output children kept per element
+    std::string spill;                      // --spill FILE: values over the byte limit (default: OUTPUT.spill)
+    RecordLimits* limits = nullptr;         // set up from the three above
+
+    // instrumentation
+    std::string stats_file;                 // --stats FILE: JSON run report at exit
+    bool progress = false;                  // --progress: status line on stderr
+
+
+    // conversion server (see run_serve)
+    std::string serve;                      // --serve ADDR: Unix socket path or HOST:PORT
+    std::string serve_root;                 // --serve-root DIR: path= may name files under DIR (off without)
+    size_t serve_max_body = 256u << 20;     // --serve-max-body N: larger request bodies get 413 (at most INT_MAX)
+
+    // benchmarking
+    std::string gen_corpus;                 // --gen-corpus SPEC: write a synthetic corpus and exit
+    bool bench = false;                     // run every mode/format on -i FILE and report
+    std::string bench_json;                 // also write the results as JSON here
 
 #ifdef WITH_SQLITE
     bool use_sqlite = false;
     std::string sqlite_db;
     std::string sqlite_table = "records";
     int sqlite_batch = 500;
+    std::string sqlite_journal;             // PRAGMA journal_mode (empty = SQLite default)
+    std::string sqlite_sync;                // PRAGMA synchronous
+    long sqlite_cache_size = 0;             // PRAGMA cache_size (0 = default; <0 = KiB)
+    int sqlite_page_size = 0;               // PRAGMA page_size (new databases only)
+    bool sqlite_async = false;              // commit batches on a writer thread
 #endif
 };
 
 static void print_help(const char* prog) {
     std::cerr << "Stream massive XML into JSONL / MySQL-dump / (optional) SQLite\n\n";
     std::cerr << "Options:\n";
-    std::cerr << "  -i, --input FILE           Input XML file (default: - for stdin)\n";
+    std::cerr << "  -i, --input FILE           Input XML file (default: - for stdin). Repeat it, pass more files\n";
+    std::cerr << "                             after the options, a directory (its *.xml[.gz|.zst|.xz]) or a\n";
+    std::cerr << "                             quoted glob to convert several on --threads workers, largest\n";
+    std::cerr << "                             first; their records get _source and _offset fields\n";
+    std::cerr << "      --input-list FILE      Inputs to convert, one per line (- for stdin; # comments)\n";
     std::cerr << "  -o, --output FILE          Output file (default: - for stdout)\n";
     std::cerr << "      --mode MODE            generic | nmap (default: generic)\n";
-    std::cerr << "      --record-tag TAG       Treat TAG elements as records (e.g., 'host' for Nmap)\n";
-    std::cerr << "      --format FMT           jsonl | mysql-sql";
+    std::cerr << "      --record-tag TAG       Treat TAG elements as records (e.g., 'host' for Nmap); TAG,TAG2,...\n";
+    std::cerr << "                             for several record types in one pass\n";
+    std::cerr << "      --record-path P        Records by path: /nmaprun/host, //host (anywhere), /a/*/b; comma-\n";
+    std::cerr << "                             separated for several. {tag} in -o, --mysql-table or --sqlite-table\n";
+    std::cerr << "                             sends each record type to its own file or table\n";
+    std::cerr << "      --format FMT           jsonl | bson | msgpack | cbor | mysql-sql | mysql-tsv";
 #ifdef WITH_SQLITE
     std::cerr << " | sqlite";
 #endif
     std::cerr << "\n";
+    std::cerr << "                             (bson/msgpack/cbor: one binary document per record, back to back;\n";
+    std::cerr << "                             a bson file is a mongorestore dump)\n";
     std::cerr << "      --pretty               Pretty-print JSON (slower, larger)\n";
+    std::cerr << "      --schema S             json | relational (default: json). relational: --mode nmap with\n";
+    std::cerr << "                             mysql-sql/sqlite writes hosts/addresses/hostnames/ports/services/\n";
+    std::cerr << "                             cpes/scripts tables instead of one JSON column\n";
+    std::cerr << "      --dom                  Build a json DOM per record instead of writing JSON directly\n";
+    std::cerr << "      --parser P             reader | sax (default: reader). sax: --mode generic, compact\n";
+    std::cerr << "                             output, serial only; SAX2 callbacks build just the records\n";
+    std::cerr << "      --fields LIST          Keep only these keys of each record: dot paths through objects\n";
+    std::cerr << "                             and lists, e.g. addresses.addr,ports.portid,ports.service.name\n";
+    std::cerr << "      --where LIST           Keep only records where every path=value holds, e.g. status=up,\n";
+    std::cerr << "                             ports.state=open; a path through a list keeps the matching entries\n";
+    std::cerr << "      --threads N            Convert records on N worker threads (default: 1)\n";
+    std::cerr << "      --unordered            With --threads: write records as they finish, not in input order\n";
+    std::cerr << "      --queue N              With --threads: max records in flight (default: 16 per thread)\n";
+    std::cerr << "      --chunked              -i FILE only: split the file on record boundaries and parse\n";
+    std::cerr << "                             chunks in parallel (--threads workers; records must not nest)\n";
+    std::cerr << "      --chunk-size N         Bytes per chunk, K/M/G suffixes allowed (default: 16M)\n";
+    std::cerr << "      --compress C           Compress jsonl / bson / msgpack / cbor / mysql-sql output: zstd | gzip\n";
+    std::cerr << "      --compress-level N     Compression level (default: zstd 3, gzip 6)\n";
+    std::cerr << "      --compress-threads N   zstd worker threads (default: 0, compress inline)\n";
+    std::cerr << "                             (gzip/zstd/xz input is detected and decoded on a separate thread)\n";
+    std::cerr << "      --out-buffer N         Output buffer size, K/M/G suffixes allowed (default: 8M)\n";
+    std::cerr << "      --out-direct           With -o FILE: write with O_DIRECT, bypassing the page cache\n";
+    std::cerr << "      --checkpoint FILE      Record how far the conversion got (input position and output\n";
+    std::cerr << "                             lengths, synced with the output) every --checkpoint-interval s\n";
+    std::cerr << "      --checkpoint-interval S  Seconds between checkpoints (default: 30)\n";
+    std::cerr << "      --resume               With --checkpoint: cut the outputs back to the checkpoint and\n";
+    std::cerr << "                             continue after the records it covers (same options as before)\n";
+    std::cerr << "      --delta INDEX          --mode nmap: write only hosts that are new or changed since the run\n";
+    std::cerr << "                             that wrote INDEX (address -> content hash), then update INDEX\n";
+    std::cerr << "      --tombstones FILE      With --delta: JSON lines for hosts that disappeared\n";
+    std::cerr << "                             (default: INDEX.removed.jsonl)\n";
+    std::cerr << "      --shard-by PATH[/BITS] Split the output by a record value (a --fields path such as\n";
+    std::cerr << "                             addresses.addr or _tag; /BITS: its IPv4 network): one output\n";
+    std::cerr << "                             per value, named via {shard} in -o / --sqlite-db (default:\n";
+    std::cerr << "                             before the extension); with --threads, up to N writer threads\n";
+    std::cerr << "      --shards N             With --shard-by: N outputs, picked by a hash of the value\n";
+    std::cerr << "      --max-shards N         With --shard-by but no --shards: fail past N distinct values\n";
+    std::cerr << "                             (default 256; also capped by the open file limit)\n";
+    std::cerr << "      --infer-schema N       Sample the first N records of -i FILE for value types and list/\n";
+    std::cerr << "                             object shapes; write numbers/booleans natively, shapes stable\n";
+    std::cerr << "      --schema-file FILE     Save the inferred schema there, or (without --infer-schema) use it\n";
+    std::cerr << "      --max-record-bytes N   Keep at most N bytes of text/attribute values per record (K/M/G);\n";
+    std::cerr << "                             values past it go to --spill, replaced by $spill:OFFSET:LENGTH\n";
+    std::cerr << "                             (values starting with $spill: are always moved; short ones are kept)\n";
+    std::cerr << "      --max-children N       Keep the first N child elements of each element, drop the rest\n";
+    std::cerr << "      --spill FILE           Where --max-record-bytes moves values (default: OUTPUT.spill)\n";
+    std::cerr << "                             (limits need the streaming paths: --mode nmap serial / --parser sax)\n";
+    std::cerr << "      --serve ADDR           Stay up and convert per HTTP request on a Unix socket (a path) or\n";
+    std::cerr << "                             HOST:PORT: POST /convert?mode=..&record-tag=.. with the XML (or\n";
+    std::cerr << "                             path=FILE) streams the records back (sqlite: into --sqlite-db);\n";
+    std::cerr << "                             --threads workers, GET /stats for totals\n";
+    std::cerr << "      --serve-root DIR       Allow path=FILE, for files under DIR only (off by default)\n";
+    std::cerr << "      --serve-max-body N     Largest request body, K/M/G allowed (default: 256M, at most 2G);\n";
+    std::cerr << "                             larger ones are answered with 413\n";
+    std::cerr << "      --progress             Show records/s, bytes read and ETA on stderr\n";
+    std::cerr << "      --stats FILE           Write a JSON report at exit: per-stage times, record sizes,\n";
+    std::cerr << "                             peak RSS, allocations per record, SQLite commit latency percentiles\n";
     std::cerr << "  -h, --help                 Show this help\n";
+    std::cerr << "\nMySQL options:\n";
+    std::cerr << "      --mysql-rows-per-insert N  Rows per extended INSERT (default: 1)\n";
+    std::cerr << "      --mysql-max-packet N   Byte cap per INSERT statement, K/M/G allowed (default: 1M)\n";
+    std::cerr << "      --mysql-commit-every K Wrap every K INSERTs in START TRANSACTION/COMMIT (default: off)\n";
+    std::cerr << "      --mysql-table NAME     Table for mysql-sql / mysql-tsv rows (default: records)\n";
+    std::cerr << "      (mysql-tsv writes LOAD DATA rows to -o FILE plus a loader script FILE.load.sql)\n";
+    std::cerr << "\nBenchmarking:\n";
+    std::cerr << "      --gen-corpus SPEC      Write synthetic XML to -o and exit. SPEC is\n";
+    std::cerr << "                             nmap[:hosts=N,ports=P,script-bytes=B,seed=S] or\n";
+    std::cerr << "                             generic[:records=N,depth=D,width=W,text-bytes=T,seed=S]\n";
+    std::cerr << "      --bench                Convert -i FILE with every mode/format (one process each) and\n";
+    std::cerr << "                             print records/s, MB/s, peak RSS and parse/convert/write time;\n";
+    std::cerr << "                             generic runs are repeated with --parser sax where it applies\n";
+    std::cerr << "                             (--threads/--chunked/--dom are passed through)\n";
+    std::cerr << "      --bench-json FILE      With --bench: also write the results as JSON\n";
 #ifdef WITH_SQLITE
     std::cerr << "\nSQLite options (only when compiled with -DWITH_SQLITE):\n";
     std::cerr << "      --sqlite-db PATH       SQLite DB path (required if --format=sqlite)\n";
     std::cerr << "      --sqlite-table NAME    Table name (default: records)\n";
     std::cerr << "      --batch N              SQLite batch insert size (default: 500)\n";
+    std::cerr << "      --sqlite-journal MODE  PRAGMA journal_mode, e.g. WAL | DELETE | MEMORY | OFF\n";
+    std::cerr << "      --sqlite-sync MODE     PRAGMA synchronous: OFF | NORMAL | FULL\n";
+    std::cerr << "      --sqlite-cache-size N  PRAGMA cache_size (pages, or -KiB)\n";
+    std::cerr << "      --sqlite-page-size N   PRAGMA page_size (takes effect on new databases)\n";
+    std::cerr << "      --sqlite-async         Commit batches on a background thread while parsing continues\n";
 #endif
     std::cerr << "\nExamples:\n";
     std::cerr << "  # Nmap -> JSONL\n  " << prog << " --mode nmap --record-tag host -i scan.xml -o out.jsonl\n\n";
@@ -89,8 +345,165 @@ static void print_help(const char* prog) {
     std::cerr << "  # Nmap -> MySQL dump\n  " << prog << " --mode nmap --record-tag host --format mysql-sql -i scan.xml -o scan.sql\n";
 }
 
+// "64", "512K", "16M", "2G" -> bytes; 0 on garbage
+static size_t parse_size(const char* s) {
+    char* end = nullptr;
+    unsigned long long v = std::strtoull(s, &end, 10);
+    switch (end && *end ? *end : 0) {
+        case 0: break;
+        case 'k': case 'K': v <<= 10; break;
+        case 'm': case 'M': v <<= 20; break;
+        case 'g': case 'G': v <<= 30; break;
+        default: return 0;
+    }
+    return (size_t)v;
+}
+
+static const int k_parse_options = XML_PARSE_RECOVER | XML_PARSE_NOBLANKS | XML_PARSE_NOENT
+#ifdef XML_PARSE_NONET
+    | XML_PARSE_NONET
+#endif
+    ;
+
+// XML from --serve clients: entities are left as references (internal ones
+// still come out as their text), so an external entity is never loaded and
+// a request can't pull in a file the server can read
+static const int k_request_parse_options = (k_parse_options & ~(XML_PARSE_NOENT | XML_PARSE_DTDLOAD | XML_PARSE_DTDATTR))
+#if LIBXML_VERSION >= 21400
+    | XML_PARSE_NO_XXE
+#endif
+    ;
+
+// ---------- Per-record scratch arena ----------
+// Scratch that only lives while one record is converted (the generic
+// emitter's attribute/child lists, element_to_json's child groups) comes
+// from a per-thread monotonic arena that the record converter rewinds after each
+// record. When a record overflows the arena's block, the block is regrown
+// (up to k_max_block) at the next rewind, so in steady state scratch costs
+// no malloc at all.
+class RecordArena {
+public:
+    static constexpr size_t k_first_block = 64u << 10;
+    static constexpr size_t k_max_block = 16u << 20;
+
+    static RecordArena& local() {
+        thread_local RecordArena a;
+        return a;
+    }
+
+    std::pmr::memory_resource* resource() { return &*mono_; }
+
+    // drop everything handed out since the last rewind
+    void rewind() {
+        mono_.reset();
+        if (spill_.bytes > 0 && cap_ < k_max_block) {
+            cap_ = std::min(k_max_block, std::max(cap_ * 2, cap_ + spill_.bytes));
+            block_.reset(new char[cap_]);
+        }
+        spill_.bytes = 0;
+        mono_.emplace(block_.get(), cap_, &spill_);
+    }
+
+    // rewinds the thread's arena when the record is done
+    struct Scope {
+        Scope() = default;
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope() { local().rewind(); }
+    };
+
+private:
+    // the heap behind the block; counts what overflowed it
+    struct Spill : std::pmr::memory_resource {
+        size_t bytes = 0;
+        void* do_allocate(size_t n, size_t align) override {
+            bytes += n;
+            return std::pmr::new_delete_resource()->allocate(n, align);
+        }
+        void do_deallocate(void* p, size_t n, size_t align) override {
+            std::pmr::new_delete_resource()->deallocate(p, n, align);
+        }
+        bool do_is_equal(const std::pmr::memory_resource& o) const noexcept override { return this == &o; }
+    };
+
+    RecordArena() : cap_(k_first_block), block_(new char[cap_]) { mono_.emplace(block_.get(), cap_, &spill_); }
+
+    size_t cap_;
+    std::unique_ptr<char[]> block_;
+    Spill spill_;
+    std::optional<std::pmr::monotonic_buffer_resource> mono_;
+};
+
+// ---------- Record text spans ----------
+// The generic converters write each element's descendant text (trimmed) as
+// "#text". Taking xmlNodeGetContent() level by level rereads the whole
+// subtree below every element, which is quadratic on deep documents, so the
+// text of a record is gathered once, in document order: element i (the
+// record itself is 0, the rest numbered in document order) owns the slice
+// [begin, end) of `text`. Its first child element is i + 1, and the element
+// after child c is spans[c].next.
+struct TextSpans {
+    struct Span {
+        size_t begin, end, next;
+    };
+    std::string text;
+    std::vector<Span> spans;
+
+    void clear() { text.clear(); spans.clear(); }
+    size_t open() {
+        spans.push_back({text.size(), 0, 0});
+        return spans.size() - 1;
+    }
+    void close(size_t i) {
+        spans[i].end = text.size();
+        spans[i].next = spans.size();
+    }
+    std::string_view of(size_t i) const {
+        return std::string_view(text).substr(spans[i].begin, spans[i].end - spans[i].begin);
+    }
+
+    // the record's spans, reusing this thread's buffers
+    static TextSpans& local() {
+        thread_local TextSpans ts;
+        ts.clear();
+        return ts;
+    }
+};
+
+// spans of `node` and its descendant elements: text and CDATA as
+// xmlNodeGetContent() collects it (entity references through libxml2;
+// XML_PARSE_NOENT normally expands them)
+static void text_spans_add(xmlNodePtr node, TextSpans& ts) {
+    const size_t i = ts.open();
+    for (xmlNodePtr c = node->children; c; c = c->next) {
+        switch (c->type) {
+        case XML_TEXT_NODE:
+        case XML_CDATA_SECTION_NODE:
+            if (c->content) ts.text += reinterpret_cast<const char*>(c->content);
+            break;
+        case XML_ELEMENT_NODE:
+            text_spans_add(c, ts);
+            break;
+        case XML_ENTITY_REF_NODE:
+            if (xmlChar* e = xmlNodeGetContent(c)) {
+                ts.text += reinterpret_cast<const char*>(e);
+                xmlFree(e);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    ts.close(i);
+}
+
+static std::string_view trim_ws(std::string_view s) {
+    const size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string_view::npos) return {};
+    return s.substr(b, s.find_last_not_of(" \t\r\n") - b + 1);
+}
+
 // ---------- XML -> JSON helpers ----------
-static nlohmann::json node_to_json(xmlNodePtr node);
 
 // attributes -> "@key"
 static void add_attributes(nlohmann::json& obj, xmlNodePtr node) {
@@ -104,478 +517,8153 @@ static void add_attributes(nlohmann::json& obj, xmlNodePtr node) {
     }
 }
 
-// group element children by name; merge text under "#text"
-static nlohmann::json children_to_json(xmlNodePtr node) {
-    std::map<std::string, std::vector<nlohmann::json>> groups;
+// Value of element `node` (span `ti` of `ts`): attributes as "@key",
+// children grouped by name, trimmed text under "#text" (a bare string for a
+// leaf). Groups are kept in a flat list in the record arena, found by the
+// name pointer (names are interned in the parser's dictionary; strcmp
+// catches the rest), and their values are moved into the result.
+static nlohmann::json element_to_json(xmlNodePtr node, const TextSpans& ts, size_t ti) {
+    struct Group {
+        const xmlChar* name;
+        nlohmann::json value;
+        bool list;
+    };
+    std::pmr::vector<Group> groups(RecordArena::local().resource());
+    size_t k = ti + 1;
     for (xmlNodePtr cur = node->children; cur; cur = cur->next) {
-        if (cur->type == XML_ELEMENT_NODE) {
-            nlohmann::json cj = node_to_json(cur);
-            groups[std::string(reinterpret_cast<const char*>(cur->name))].push_back(std::move(cj));
-        }
-    }
-    nlohmann::json obj = nlohmann::json::object();
-    // merge element children
-    for (auto& kv : groups) {
-        if (kv.second.size() == 1) {
-            const nlohmann::json& single = kv.second.front(); // {"tag": {...}}
-            obj[kv.first] = single.at(kv.first);
-        } else {
+        if (cur->type != XML_ELEMENT_NODE) continue;
+        nlohmann::json v = element_to_json(cur, ts, k);
+        k = ts.spans[k].next;
+        Group* g = nullptr;
+        for (Group& x : groups)
+            if (x.name == cur->name || xmlStrEqual(x.name, cur->name)) { g = &x; break; }
+        if (!g) {
+            groups.push_back({cur->name, std::move(v), false});
+        } else if (!g->list) {
             nlohmann::json arr = nlohmann::json::array();
-            for (auto& el : kv.second) arr.push_back(el.at(kv.first));
-            obj[kv.first] = std::move(arr);
+            arr.push_back(std::move(g->value));
+            arr.push_back(std::move(v));
+            g->value = std::move(arr);
+            g->list = true;
+        } else {
+            g->value.push_back(std::move(v));
         }
     }
-    // add text content
-    xmlChar* content = xmlNodeGetContent(node);
-    if (content) {
-        std::string txt = std::string(reinterpret_cast<const char*>(content));
-        xmlFree(content);
-        // trim
-        auto start = txt.find_first_not_of(" \t\r\n");
-        auto end   = txt.find_last_not_of(" \t\r\n");
-        if (start != std::string::npos && end != std::string::npos) {
-            std::string trimmed = txt.substr(start, end - start + 1);
-            if (!trimmed.empty()) {
-                if (!obj.empty()) obj["#text"] = trimmed;
-                else obj = trimmed; // leaf
-            }
-        }
+
+    nlohmann::json obj = nlohmann::json::object();
+    add_attributes(obj, node);
+    for (Group& g : groups) obj[reinterpret_cast<const char*>(g.name)] = std::move(g.value);
+    const std::string_view txt = trim_ws(ts.of(ti));
+    if (!txt.empty()) {
+        if (!obj.empty()) obj["#text"] = std::string(txt);
+        else obj = std::string(txt); // leaf
     }
     return obj;
 }
 
+// {"name": value of element `node`}
 static nlohmann::json node_to_json(xmlNodePtr node) {
-    std::string name = std::string(reinterpret_cast<const char*>(node->name));
-    nlohmann::json inner = nlohmann::json::object();
-    add_attributes(inner, node);
-    nlohmann::json kids = children_to_json(node);
-
-    if (kids.is_object()) {
-        for (auto it = kids.begin(); it != kids.end(); ++it) inner[it.key()] = it.value();
-    } else if (!kids.is_null()) {
-        if (inner.empty()) inner = kids; else inner["#text"] = kids;
-    }
+    TextSpans& ts = TextSpans::local();
+    text_spans_add(node, ts);
     nlohmann::json out = nlohmann::json::object();
-    out[name] = inner.is_null() ? nlohmann::json::object() : inner;
+    out[reinterpret_cast<const char*>(node->name)] = element_to_json(node, ts, 0);
     return out;
 }
 
-// ---------- Nmap <host> normalization ----------
-static nlohmann::json nmap_host_to_obj(xmlNodePtr host) {
-    nlohmann::json out = nlohmann::json::object();
+// ---------- Nmap element/attribute lookup ----------
+// The Nmap extractors walk each element's children once. Element names are
+// dispatched by nmap_tag (switch on length, one strcmp to confirm) instead of
+// building a std::string per node, and read_props collects all wanted
+// attributes in one pass over the attribute list instead of one
+// xmlGetProp() lookup-and-copy per key.
 
-    if (xmlChar* st = xmlGetProp(host, BAD_CAST "starttime")) {
-        out["starttime"] = std::string((char*)st); xmlFree(st);
+// Attribute value as xmlGetProp() would return it, but borrowed from the tree
+// when the attribute is a plain text node (the common case), so no copy.
+struct PropValue {
+    const xmlChar* value = nullptr;
+    xmlChar* owned = nullptr;
+    PropValue() = default;
+    PropValue(const PropValue&) = delete;
+    PropValue& operator=(const PropValue&) = delete;
+    PropValue& operator=(PropValue&& o) noexcept {
+        if (this != &o) {
+            if (owned) xmlFree(owned);
+            value = o.value; owned = o.owned;
+            o.value = nullptr; o.owned = nullptr;
+        }
+        return *this;
     }
+    ~PropValue() { if (owned) xmlFree(owned); }
+    explicit operator bool() const { return value != nullptr; }
+};
 
-    // status
-    for (xmlNodePtr n = host->children; n; n = n->next) {
-        if (n->type != XML_ELEMENT_NODE) continue;
-        if (std::string((char*)n->name) == "status") {
-            if (xmlChar* s = xmlGetProp(n, BAD_CAST "state")) {
-                out["status"] = std::string((char*)s); xmlFree(s);
+static const xmlChar k_empty_prop[] = "";
+
+static void prop_from_attr(xmlNodePtr node, xmlAttrPtr attr, PropValue& pv) {
+    xmlNodePtr ch = attr->children;
+    if (!ch) {
+        pv.value = k_empty_prop;
+    } else if (!ch->next && (ch->type == XML_TEXT_NODE || ch->type == XML_CDATA_SECTION_NODE)) {
+        pv.value = ch->content ? ch->content : k_empty_prop;
+    } else {
+        pv.owned = xmlNodeListGetString(node->doc, ch, 1);
+        pv.value = pv.owned ? pv.owned : k_empty_prop;
+    }
+}
+
+static bool get_prop(xmlNodePtr node, const char* name, PropValue& pv) {
+    xmlAttrPtr attr = xmlHasProp(node, BAD_CAST name);
+    if (!attr) return false;
+    if (attr->type == XML_ATTRIBUTE_NODE) {
+        prop_from_attr(node, attr, pv);
+    } else {
+        // DTD default (XML_ATTRIBUTE_DECL): let libxml2 resolve it
+        pv.owned = xmlGetProp(node, BAD_CAST name);
+        if (!pv.owned) return false;
+        pv.value = pv.owned;
+    }
+    return true;
+}
+
+static bool doc_declares_attributes(xmlDocPtr doc) {
+    return doc && ((doc->intSubset && doc->intSubset->attributes) || (doc->extSubset && doc->extSubset->attributes));
+}
+
+// out[i] = get_prop(node, keys[i]) for every key, in one walk over the
+// attribute list. A missing attribute can only have a value when the
+// document's DTD declares attributes, so only then are the misses looked up
+// again (`<!DOCTYPE nmaprun>` alone declares none).
+static void read_props(xmlNodePtr node, const char* const* keys, size_t nkeys, PropValue* out) {
+    for (xmlAttrPtr a = node->properties; a; a = a->next) {
+        const char* an = reinterpret_cast<const char*>(a->name);
+        for (size_t i = 0; i < nkeys; ++i) {
+            if (an[0] == keys[i][0] && std::strcmp(an, keys[i]) == 0) {
+                if (!out[i]) prop_from_attr(node, a, out[i]);
+                break;
             }
         }
     }
+    if (doc_declares_attributes(node->doc))
+        for (size_t i = 0; i < nkeys; ++i)
+            if (!out[i]) get_prop(node, keys[i], out[i]);
+}
+
+// xmlNodeGetContent(), borrowed when the element holds a single text node
+static void get_text(xmlNodePtr node, PropValue& pv) {
+    xmlNodePtr ch = node->children;
+    if (ch && !ch->next && (ch->type == XML_TEXT_NODE || ch->type == XML_CDATA_SECTION_NODE) && ch->content) {
+        pv.value = ch->content;
+        return;
+    }
+    pv.owned = xmlNodeGetContent(node);
+    pv.value = pv.owned;
+}
 
-    // addresses
-    {
-        nlohmann::json arr = nlohmann::json::array();
-        for (xmlNodePtr n = host->children; n; n = n->next) {
-            if (n->type != XML_ELEMENT_NODE) continue;
-            if (std::string((char*)n->name) == "address") {
-                nlohmann::json a;
-                if (xmlChar* v = xmlGetProp(n, BAD_CAST "addr"))     { a["addr"]     = std::string((char*)v); xmlFree(v); }
-                if (xmlChar* v = xmlGetProp(n, BAD_CAST "addrtype")) { a["addrtype"] = std::string((char*)v); xmlFree(v); }
-                if (xmlChar* v = xmlGetProp(n, BAD_CAST "vendor"))   { a["vendor"]   = std::string((char*)v); xmlFree(v); }
-                arr.push_back(a);
+enum class NmapTag { other, status, address, hostnames, hostname, ports, port, state, service, cpe, script, hostscript, uptime };
+
+static NmapTag nmap_tag_name(const char* s) {
+    NmapTag t;
+    const char* want;
+    switch (std::strlen(s)) {
+        case 3:  t = NmapTag::cpe;  want = "cpe";  break;
+        case 4:  t = NmapTag::port; want = "port"; break;
+        case 5:
+            if (s[0] == 'p') { t = NmapTag::ports; want = "ports"; }
+            else             { t = NmapTag::state; want = "state"; }
+            break;
+        case 6:
+            if (s[0] == 'u')      { t = NmapTag::uptime; want = "uptime"; }
+            else if (s[1] == 't') { t = NmapTag::status; want = "status"; }
+            else                  { t = NmapTag::script; want = "script"; }
+            break;
+        case 7:
+            if (s[0] == 'a') { t = NmapTag::address; want = "address"; }
+            else             { t = NmapTag::service; want = "service"; }
+            break;
+        case 8:  t = NmapTag::hostname;   want = "hostname";   break;
+        case 9:  t = NmapTag::hostnames;  want = "hostnames";  break;
+        case 10: t = NmapTag::hostscript; want = "hostscript"; break;
+        default: return NmapTag::other;
+    }
+    return std::strcmp(s, want) == 0 ? t : NmapTag::other;
+}
+
+static NmapTag nmap_tag(xmlNodePtr n) {
+    if (n->type != XML_ELEMENT_NODE) return NmapTag::other;
+    return nmap_tag_name(reinterpret_cast<const char*>(n->name));
+}
+
+static const char* const k_nmap_addr_keys[]     = {"addr","addrtype","vendor"};
+static const char* const k_nmap_hostname_keys[] = {"name","type"};
+static const char* const k_nmap_script_keys[]   = {"id","output"};
+static const char* const k_nmap_svc_keys[]      = {"conf","extrainfo","method","name","product","tunnel","version"};
+static const char* const k_nmap_uptime_keys[]   = {"lastboot","seconds"};
+static const char* const k_nmap_port_keys[]     = {"portid","protocol"};
+static const char* const k_nmap_state_keys[]    = {"reason","state"};
+static const char* const k_nmap_host_keys[]     = {"starttime"};
+
+// ---------- Nmap <host> normalization ----------
+static void json_set_props(nlohmann::json& obj, xmlNodePtr node, const char* const* keys, size_t nkeys) {
+    PropValue v[8];
+    read_props(node, keys, nkeys, v);
+    for (size_t i = 0; i < nkeys; ++i)
+        if (v[i]) obj[keys[i]] = std::string(reinterpret_cast<const char*>(v[i].value));
+}
+
+static nlohmann::json nmap_port_to_obj(xmlNodePtr p) {
+    nlohmann::json pj;
+    json_set_props(pj, p, k_nmap_port_keys, 2);
+    for (xmlNodePtr c = p->children; c; c = c->next) {
+        switch (nmap_tag(c)) {
+        case NmapTag::state:
+            json_set_props(pj, c, k_nmap_state_keys, 2);
+            break;
+        case NmapTag::service: {
+            nlohmann::json svc;
+            json_set_props(svc, c, k_nmap_svc_keys, 7);
+            nlohmann::json cpes = nlohmann::json::array();
+            for (xmlNodePtr ce = c->children; ce; ce = ce->next) {
+                if (nmap_tag(ce) != NmapTag::cpe) continue;
+                PropValue t;
+                get_text(ce, t);
+                if (t) cpes.push_back(std::string(reinterpret_cast<const char*>(t.value)));
             }
+            if (!cpes.empty()) svc["cpe"] = cpes;
+            if (!svc.empty()) pj["service"] = svc;
+            break;
+        }
+        case NmapTag::script: {
+            if (!pj.contains("scripts")) pj["scripts"] = nlohmann::json::array();
+            nlohmann::json sc;
+            json_set_props(sc, c, k_nmap_script_keys, 2);
+            pj["scripts"].push_back(sc);
+            break;
+        }
+        default:
+            break;
         }
-        if (!arr.empty()) out["addresses"] = arr;
     }
+    return pj;
+}
+
+static nlohmann::json nmap_host_to_obj(xmlNodePtr host) {
+    nlohmann::json out = nlohmann::json::object();
+    json_set_props(out, host, k_nmap_host_keys, 1);
 
-    // hostnames
+    nlohmann::json addresses = nlohmann::json::array();
     for (xmlNodePtr n = host->children; n; n = n->next) {
-        if (n->type != XML_ELEMENT_NODE) continue;
-        if (std::string((char*)n->name) == "hostnames") {
+        switch (nmap_tag(n)) {
+        case NmapTag::status: {
+            PropValue v;
+            read_props(n, k_nmap_state_keys + 1, 1, &v);
+            if (v) out["status"] = std::string(reinterpret_cast<const char*>(v.value));
+            break;
+        }
+        case NmapTag::address: {
+            nlohmann::json a;
+            json_set_props(a, n, k_nmap_addr_keys, 3);
+            addresses.push_back(a);
+            break;
+        }
+        case NmapTag::hostnames: {
             nlohmann::json names = nlohmann::json::array();
             for (xmlNodePtr h = n->children; h; h = h->next) {
-                if (h->type != XML_ELEMENT_NODE) continue;
-                if (std::string((char*)h->name) == "hostname") {
-                    nlohmann::json hn;
-                    if (xmlChar* v = xmlGetProp(h, BAD_CAST "name")) { hn["name"] = std::string((char*)v); xmlFree(v); }
-                    if (xmlChar* v = xmlGetProp(h, BAD_CAST "type")) { hn["type"] = std::string((char*)v); xmlFree(v); }
-                    names.push_back(hn);
-                }
+                if (nmap_tag(h) != NmapTag::hostname) continue;
+                nlohmann::json hn;
+                json_set_props(hn, h, k_nmap_hostname_keys, 2);
+                names.push_back(hn);
             }
             if (!names.empty()) out["hostnames"] = names;
+            break;
         }
-    }
-
-    // ports
-    for (xmlNodePtr n = host->children; n; n = n->next) {
-        if (n->type != XML_ELEMENT_NODE) continue;
-        if (std::string((char*)n->name) == "ports") {
+        case NmapTag::ports: {
             nlohmann::json arr = nlohmann::json::array();
-            for (xmlNodePtr p = n->children; p; p = p->next) {
-                if (p->type != XML_ELEMENT_NODE) continue;
-                if (std::string((char*)p->name) == "port") {
-                    nlohmann::json pj;
-                    if (xmlChar* v = xmlGetProp(p, BAD_CAST "protocol")) pj["protocol"] = std::string((char*)v), xmlFree(v);
-                    if (xmlChar* v = xmlGetProp(p, BAD_CAST "portid"))   pj["portid"]   = std::string((char*)v), xmlFree(v);
-
-                    for (xmlNodePtr c = p->children; c; c = c->next) {
-                        if (c->type != XML_ELEMENT_NODE) continue;
-                        std::string ct((char*)c->name);
-                        if (ct == "state") {
-                            if (xmlChar* v = xmlGetProp(c, BAD_CAST "state"))  pj["state"]  = std::string((char*)v), xmlFree(v);
-                            if (xmlChar* v = xmlGetProp(c, BAD_CAST "reason")) pj["reason"] = std::string((char*)v), xmlFree(v);
-                        } else if (ct == "service") {
-                            nlohmann::json svc;
-                            const char* keys[] = {"name","product","version","extrainfo","tunnel","method","conf"};
-                            for (const char* k : keys) {
-                                if (xmlChar* v = xmlGetProp(c, BAD_CAST k)) { svc[k] = std::string((char*)v); xmlFree(v); }
-                            }
-                            nlohmann::json cpes = nlohmann::json::array();
-                            for (xmlNodePtr ce = c->children; ce; ce = ce->next) {
-                                if (ce->type == XML_ELEMENT_NODE && std::string((char*)ce->name)=="cpe") {
-                                    if (xmlChar* t = xmlNodeGetContent(ce)) { cpes.push_back(std::string((char*)t)); xmlFree(t); }
-                                }
-                            }
-                            if (!cpes.empty()) svc["cpe"] = cpes;
-                            if (!svc.empty()) pj["service"] = svc;
-                        } else if (ct == "script") {
-                            if (!pj.contains("scripts")) pj["scripts"] = nlohmann::json::array();
-                            nlohmann::json sc;
-                            if (xmlChar* v = xmlGetProp(c, BAD_CAST "id"))     sc["id"] = std::string((char*)v), xmlFree(v);
-                            if (xmlChar* v = xmlGetProp(c, BAD_CAST "output")) sc["output"] = std::string((char*)v), xmlFree(v);
-                            pj["scripts"].push_back(sc);
-                        }
-                    }
-                    arr.push_back(pj);
-                }
-            }
+            for (xmlNodePtr p = n->children; p; p = p->next)
+                if (nmap_tag(p) == NmapTag::port) arr.push_back(nmap_port_to_obj(p));
             if (!arr.empty()) out["ports"] = arr;
+            break;
         }
-    }
-
-    // host-level scripts
-    for (xmlNodePtr n = host->children; n; n = n->next) {
-        if (n->type != XML_ELEMENT_NODE) continue;
-        if (std::string((char*)n->name) == "hostscript") {
+        case NmapTag::hostscript: {
             nlohmann::json hs = nlohmann::json::array();
             for (xmlNodePtr s = n->children; s; s = s->next) {
-                if (s->type != XML_ELEMENT_NODE || std::string((char*)s->name)!="script") continue;
+                if (nmap_tag(s) != NmapTag::script) continue;
                 nlohmann::json sc;
-                if (xmlChar* v = xmlGetProp(s, BAD_CAST "id"))     sc["id"] = std::string((char*)v), xmlFree(v);
-                if (xmlChar* v = xmlGetProp(s, BAD_CAST "output")) sc["output"] = std::string((char*)v), xmlFree(v);
+                json_set_props(sc, s, k_nmap_script_keys, 2);
                 hs.push_back(sc);
             }
             if (!hs.empty()) out["hostscripts"] = hs;
+            break;
         }
-    }
-
-    // uptime
-    for (xmlNodePtr n = host->children; n; n = n->next) {
-        if (n->type != XML_ELEMENT_NODE) continue;
-        if (std::string((char*)n->name) == "uptime") {
+        case NmapTag::uptime: {
             nlohmann::json up;
-            if (xmlChar* v = xmlGetProp(n, BAD_CAST "seconds"))  up["seconds"]  = std::string((char*)v), xmlFree(v);
-            if (xmlChar* v = xmlGetProp(n, BAD_CAST "lastboot")) up["lastboot"] = std::string((char*)v), xmlFree(v);
+            json_set_props(up, n, k_nmap_uptime_keys, 2);
             if (!up.empty()) out["uptime"] = up;
+            break;
+        }
+        default:
+            break;
         }
     }
+    if (!addresses.empty()) out["addresses"] = addresses;
 
     out["_tag"] = "host";
     return out;
 }
 
-// ---------- MySQL dump helpers ----------
-static std::string sql_escape(const std::string& s) {
-    std::string out;
-    out.reserve(s.size() + 16);
-    for (char c : s) {
-        switch (c) {
-            case '\\': out += "\\\\"; break;
-            case '\'': out += "\\\'"; break;
-            case '\n': out += "\\n";  break;
-            case '\r': out += "\\r";  break;
-            case '\t': out += "\\t";  break;
-            case '\0': out += "\\0";  break;
-            default:   out += c;      break;
-        }
-    }
-    return out;
+// ---------- String escaping (SIMD) ----------
+// Escapers copy clean spans in bulk and only stop on bytes that need an
+// escape. Finding the next such byte is the hot part, so it has vector
+// kernels (AVX2 32 bytes/step, SSE4.2 PCMPESTRI 16 bytes/step, NEON 16
+// bytes/step) picked once at runtime from what the CPU supports; the
+// x86 kernels use target attributes, so no special build flags are needed.
+
+// offset of the first byte in [s, s+n) that needs escaping, or n
+using SpanScanFn = size_t (*)(const char* s, size_t n);
+
+static inline bool json_needs_escape(unsigned char c) { return c < 0x20 || c == '"' || c == '\\'; }
+static inline bool sql_needs_escape(unsigned char c) {
+    return c == '\\' || c == '\'' || c == '\n' || c == '\r' || c == '\t' || c == '\0';
 }
 
-static void mysql_write_preamble(std::ostream& os, const std::string& table) {
-    os << "-- MySQL dump generated by xml2stream\n"
-          "SET NAMES utf8mb4; SET FOREIGN_KEY_CHECKS=0;\n"
-       << "CREATE TABLE IF NOT EXISTS `" << table << R"(` (
-  `id` BIGINT NOT NULL AUTO_INCREMENT,
-  `tag` VARCHAR(128) NULL,
-  `json` JSON NOT NULL,
-  `added_at` TIMESTAMP NULL DEFAULT CURRENT_TIMESTAMP,
-  PRIMARY KEY (`id`)
-) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
-)";
+static size_t scan_json_scalar(const char* s, size_t n) {
+    size_t i = 0;
+    while (i < n && !json_needs_escape(static_cast<unsigned char>(s[i]))) ++i;
+    return i;
 }
 
-static void mysql_write_insert(std::ostream& os, const std::string& table,
-                               const std::string& tag, const std::string& json_str) {
-    os << "INSERT INTO `" << table << "`(`tag`,`json`) VALUES('"
-       << sql_escape(tag) << "', CAST('"
-       << sql_escape(json_str) << "' AS JSON));\n";
+static size_t scan_sql_scalar(const char* s, size_t n) {
+    size_t i = 0;
+    while (i < n && !sql_needs_escape(static_cast<unsigned char>(s[i]))) ++i;
+    return i;
 }
 
-static void mysql_write_postamble(std::ostream& os) {
-    os << "SET FOREIGN_KEY_CHECKS=1;\n";
+#ifdef XS_X86
+__attribute__((target("sse4.2")))
+static size_t scan_json_sse42(const char* s, size_t n) {
+    // byte ranges: [0x00,0x1f] ['"','"'] ['\\','\\']
+    const __m128i ranges = _mm_setr_epi8(0x00, 0x1f, '"', '"', '\\', '\\', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        const int idx = _mm_cmpestri(ranges, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx < 16) return i + (size_t)idx;
+    }
+    return i + scan_json_scalar(s + i, n - i);
 }
 
-// ---------- SQLite helpers ----------
-#ifdef WITH_SQLITE
-static void sqlite_ensure_schema(sqlite3* db, const std::string& table) {
-    char* errmsg = nullptr;
-    std::string create = "CREATE TABLE IF NOT EXISTS " + table + R"( (
-        id INTEGER PRIMARY KEY AUTOINCREMENT,
-        tag TEXT,
-        json TEXT NOT NULL,
-        added_at TEXT DEFAULT (datetime('now'))
-    );)";
-    if (sqlite3_exec(db, create.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
-        std::string e = errmsg ? errmsg : "unknown";
-        sqlite3_free(errmsg);
-        throw std::runtime_error("SQLite create failed: " + e);
+__attribute__((target("sse4.2")))
+static size_t scan_sql_sse42(const char* s, size_t n) {
+    // explicit-length compare, so NUL is a member of the set
+    const __m128i set = _mm_setr_epi8('\\', '\'', '\n', '\r', '\t', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        const int idx = _mm_cmpestri(set, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (idx < 16) return i + (size_t)idx;
     }
+    return i + scan_sql_scalar(s + i, n - i);
 }
 
-static void sqlite_batch_insert(sqlite3* db, const std::string& table,
-                                const std::vector<std::pair<std::string,std::string>>& rows) {
-    sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
-    std::string sql = "INSERT INTO " + table + "(tag,json) VALUES(?,?);";
-    sqlite3_stmt* stmt = nullptr;
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
-        throw std::runtime_error("SQLite prepare failed");
+__attribute__((target("avx2")))
+static size_t scan_json_avx2(const char* s, size_t n) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i bslash = _mm256_set1_epi8('\\');
+    const __m256i ctl = _mm256_set1_epi8(0x1f);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        const __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctl), ctl));        // v <= 0x1f
+        const unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
     }
-    for (auto& r : rows) {
-        sqlite3_bind_text(stmt, 1, r.first.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 2, r.second.c_str(), -1, SQLITE_TRANSIENT);
-        if (sqlite3_step(stmt) != SQLITE_DONE) {
-            sqlite3_finalize(stmt);
-            throw std::runtime_error("SQLite step failed");
-        }
-        sqlite3_reset(stmt);
-        sqlite3_clear_bindings(stmt);
+    return i + scan_json_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_sql_avx2(const char* s, size_t n) {
+    const __m256i c0 = _mm256_set1_epi8('\\'), c1 = _mm256_set1_epi8('\'');
+    const __m256i c2 = _mm256_set1_epi8('\n'), c3 = _mm256_set1_epi8('\r');
+    const __m256i c4 = _mm256_set1_epi8('\t'), c5 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+        const __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c0), _mm256_cmpeq_epi8(v, c1)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(v, c2), _mm256_cmpeq_epi8(v, c3))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, c4), _mm256_cmpeq_epi8(v, c5)));
+        const unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+        if (mask) return i + (size_t)__builtin_ctz(mask);
     }
-    sqlite3_finalize(stmt);
-    sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr);
+    return i + scan_sql_scalar(s + i, n - i);
 }
-#endif
+#endif // XS_X86
 
-// ---------- Main ----------
-int main(int argc, char** argv) {
-    std::signal(SIGINT, sigint_handler);
+#ifdef XS_NEON
+static size_t scan_json_neon(const char* s, size_t n) {
+    const uint8x16_t quote = vdupq_n_u8('"'), bslash = vdupq_n_u8('\\'), space = vdupq_n_u8(0x20);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(s + i));
+        const uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, bslash)), vcltq_u8(v, space));
+        if (vmaxvq_u8(m)) break;            // the hit is within these 16 bytes
+    }
+    return i + scan_json_scalar(s + i, n - i);
+}
 
-    // Help if no args and stdin is a TTY (no pipe)
-    if (argc == 1 && isatty(STDIN_FILENO)) {
-        print_help(argv[0]);
-        std::cerr << "\nTip: pipe XML in or use -i/--input.\n";
-        return 0;
+static size_t scan_sql_neon(const char* s, size_t n) {
+    const uint8x16_t c0 = vdupq_n_u8('\\'), c1 = vdupq_n_u8('\''), c2 = vdupq_n_u8('\n');
+    const uint8x16_t c3 = vdupq_n_u8('\r'), c4 = vdupq_n_u8('\t'), c5 = vdupq_n_u8(0);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(s + i));
+        const uint8x16_t m = vorrq_u8(vorrq_u8(vorrq_u8(vceqq_u8(v, c0), vceqq_u8(v, c1)),
+                                               vorrq_u8(vceqq_u8(v, c2), vceqq_u8(v, c3))),
+                                      vorrq_u8(vceqq_u8(v, c4), vceqq_u8(v, c5)));
+        if (vmaxvq_u8(m)) break;
     }
+    return i + scan_sql_scalar(s + i, n - i);
+}
+#endif // XS_NEON
 
-    Options opt;
+struct EscapeKernels {
+    SpanScanFn json;
+    SpanScanFn sql;
+    const char* name;
+};
 
-    static option longopts[] = {
-        {"input",       required_argument, nullptr, 'i'},
-        {"output",      required_argument, nullptr, 'o'},
-        {"mode",        required_argument, nullptr,  1 },
-        {"record-tag",  required_argument, nullptr,  2 },
-        {"format",      required_argument, nullptr,  3 },
-        {"pretty",      no_argument,       nullptr,  4 },
-#ifdef WITH_SQLITE
-        {"sqlite-db",   required_argument, nullptr,  5 },
-        {"sqlite-table",required_argument, nullptr,  6 },
-        {"batch",       required_argument, nullptr,  7 },
+static const EscapeKernels& escape_kernels() {
+    static const EscapeKernels k = [] {
+#if defined(XS_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))   return EscapeKernels{scan_json_avx2, scan_sql_avx2, "avx2"};
+        if (__builtin_cpu_supports("sse4.2")) return EscapeKernels{scan_json_sse42, scan_sql_sse42, "sse4.2"};
+#elif defined(XS_NEON)
+        return EscapeKernels{scan_json_neon, scan_sql_neon, "neon"};
 #endif
-        {"help",        no_argument,       nullptr, 'h'},
-        {0,0,0,0}
-    };
+        return EscapeKernels{scan_json_scalar, scan_sql_scalar, "scalar"};
+    }();
+    return k;
+}
 
-    while (true) {
-        int idx = 0;
-        int c = getopt_long(argc, argv, "i:o:h", longopts, &idx);
-        if (c == -1) break;
-        switch (c) {
-            case 'i': opt.input = optarg; break;
-            case 'o': opt.output = optarg; break;
-            case 'h': print_help(argv[0]); return 0;
-            case 1:   opt.mode = optarg; break;
-            case 2:   opt.record_tag = optarg; break;
-            case 3:   opt.format = optarg; break;
-            case 4:   opt.pretty = true; break;
-#ifdef WITH_SQLITE
-            case 5:   opt.use_sqlite = true; opt.sqlite_db = optarg; break;
-            case 6:   opt.sqlite_table = optarg; break;
-            case 7:   opt.sqlite_batch = std::max(1, atoi(optarg)); break;
-#endif
-            default:  print_help(argv[0]); return 1;
-        }
-    }
+// ---------- Record filters (--fields / --where) ----------
+// Both options address keys of the output JSON with dot paths ("ports",
+// "ports.service.name", "@id" / "#text" in generic mode); a path runs
+// through lists as if they weren't there. --fields keeps only the listed
+// paths (plus "_tag"). --where keeps a record only if every path=value
+// holds somewhere in it; the first list on a predicate's path is cut down
+// to the entries that satisfy it (ports.state=open keeps the open ports).
+//
+// The direct writers take the FieldTree and skip unselected keys without
+// converting them; --where is then checked by walking the rendered text
+// along each predicate's path, without parsing it. The DOM path applies
+// the same functions to its json tree.
+// Predicates on the record element's own attributes are checked on its
+// start tag, so failing records are never expanded.
 
-    // Extra guard: input is stdin but no pipe
-    if (opt.input == "-" && isatty(STDIN_FILENO)) {
-        print_help(argv[0]);
-        std::cerr << "\nTip: no input on stdin. Pipe XML or use -i/--input.\n";
-        return 0;
-    }
+// The keys of one object level to keep; `all` keeps everything below.
+struct FieldTree {
+    bool all = false;
+    std::vector<std::pair<std::string, FieldTree>> keys;
 
-    if (opt.mode != "generic" && opt.mode != "nmap") {
-        std::cerr << "[!] Invalid --mode\n";
-        return 2;
-    }
-    if (opt.mode == "nmap" && opt.record_tag.empty()) {
-        opt.record_tag = "host";
-    }
-#ifndef WITH_SQLITE
-    if (opt.format == "sqlite") {
-        std::cerr << "[!] Rebuild with -DWITH_SQLITE to enable --format sqlite\n";
-        return 3;
+    static const FieldTree& everything() {
+        static const FieldTree f{true, {}};
+        return f;
     }
-#endif
 
-    // Input reader
-    xmlTextReaderPtr reader = nullptr;
-    if (opt.input == "-") {
-        // xmlReaderForFd(fd, URL, encoding, options)
-        reader = xmlReaderForFd(
-            fileno(stdin),
-            nullptr,
-            nullptr,
-            XML_PARSE_RECOVER | XML_PARSE_NOBLANKS | XML_PARSE_NOENT
-#ifdef XML_PARSE_NONET
-            | XML_PARSE_NONET
-#endif
-        );
-    } else {
-        reader = xmlReaderForFile(
-            opt.input.c_str(),
-            nullptr,
-            XML_PARSE_RECOVER | XML_PARSE_NOBLANKS | XML_PARSE_NOENT
-#ifdef XML_PARSE_NONET
-            | XML_PARSE_NONET
-#endif
-        );
-    }
-    if (!reader) {
-        std::cerr << "[!] Failed to open input\n";
-        return 4;
+    // the tree below `key`, or null when `key` is dropped
+    const FieldTree* get(const char* key) const {
+        if (all) return this;
+        for (const auto& k : keys)
+            if (k.first == key) return &k.second;
+        return nullptr;
     }
 
-    // Output targets
-    std::ostream* pout = &std::cout;
-    std::ofstream fout;
-#ifdef WITH_SQLITE
-    sqlite3* sdb = nullptr;
-    std::vector<std::pair<std::string,std::string>> sqlite_buf;
-#endif
-    bool to_jsonl    = (opt.format == "jsonl");
-    bool to_mysql    = (opt.format == "mysql-sql");
-#ifdef WITH_SQLITE
-    bool to_sqlite   = (opt.format == "sqlite");
-#endif
-
-    if (to_jsonl || to_mysql) {
-        if (opt.output != "-") {
-            fout.open(opt.output, std::ios::out | std::ios::trunc);
-            if (!fout) { std::cerr << "[!] Failed to open output\n"; xmlFreeTextReader(reader); return 5; }
-            pout = &fout;
+    // keeps `path` (and everything below it)
+    void add(const std::vector<std::string>& path) {
+        FieldTree* f = this;
+        for (const std::string& seg : path) {
+            if (f->all) return;
+            auto it = std::find_if(f->keys.begin(), f->keys.end(), [&](const auto& k) { return k.first == seg; });
+            if (it == f->keys.end()) {
+                f->keys.emplace_back(seg, FieldTree());
+                it = f->keys.end() - 1;
+            }
+            f = &it->second;
         }
+        f->all = true;
+        f->keys.clear();
     }
-#ifdef WITH_SQLITE
-    if (to_sqlite) {
-        if (opt.sqlite_db.empty()) { std::cerr << "[!] --sqlite-db is required for --format sqlite\n"; xmlFreeTextReader(reader); return 6; }
-        if (sqlite3_open(opt.sqlite_db.c_str(), &sdb) != SQLITE_OK) { std::cerr << "[!] SQLite open failed\n"; xmlFreeTextReader(reader); return 7; }
-        try { sqlite_ensure_schema(sdb, opt.sqlite_table); }
-        catch (const std::exception& ex) { std::cerr << "[!] " << ex.what() << "\n"; sqlite3_close(sdb); xmlFreeTextReader(reader); return 8; }
-    }
-#endif
 
-    if (to_mysql) {
-        mysql_write_preamble(*pout, "records");
+    bool covers(const std::vector<std::string>& path) const {
+        const FieldTree* f = this;
+        for (const std::string& seg : path) {
+            if (f->all) return true;
+            if (!(f = f->get(seg.c_str()))) return false;
+        }
+        return f->all;
     }
+};
 
+struct WherePred {
+    std::vector<std::string> path;
+    std::string value;
+    // the same as the direct writers put them in JSON text (quoted, escaped)
+    std::vector<std::string> path_json;
+    std::string value_json;
+};
+
+struct RecordQuery {
+    FieldTree render;                       // what the writers produce: --fields plus every --where path
+    FieldTree keep;                         // what is output: --fields (everything without it)
+    std::vector<WherePred> where;
+    bool reshape = false;                   // --where reads paths that --fields drops
+    // predicates on an attribute of the record element: (attribute, value)
+    std::vector<std::pair<std::string, std::string>> start_tag;
+};
+
+static std::vector<std::string> split_list(const std::string& s, char sep) {
+    std::vector<std::string> out;
+    size_t b = 0;
+    for (;;) {
+        const size_t e = s.find(sep, b);
+        out.push_back(s.substr(b, e == std::string::npos ? std::string::npos : e - b));
+        if (e == std::string::npos) return out;
+        b = e + 1;
+    }
+}
+
+// "a.b" -> {"a", "b"}; false on an empty segment
+static bool parse_field_path(const std::string& s, std::vector<std::string>& path) {
+    path = split_list(s, '.');
+    for (const std::string& seg : path)
+        if (seg.empty()) return false;
+    return true;
+}
+
+static void json_append_escaped(std::string& out, const char* s, size_t n);
+
+// Compiles --fields / --where; false (with a message) on a malformed list.
+static bool compile_record_query(const Options& opt, RecordQuery& q) {
+    std::vector<std::string> path;
+    if (!opt.fields.empty()) {
+        q.keep.add({"_tag"});
+        for (const std::string& f : split_list(opt.fields, ',')) {
+            if (!parse_field_path(f, path)) {
+                std::cerr << "[!] Invalid --fields path '" << f << "'\n";
+                return false;
+            }
+            q.keep.add(path);
+        }
+    } else {
+        q.keep.all = true;
+    }
+    q.render = q.keep;
+    if (!opt.where.empty()) {
+        for (const std::string& w : split_list(opt.where, ',')) {
+            const size_t eq = w.find('=');
+            if (eq == std::string::npos || !parse_field_path(w.substr(0, eq), path)) {
+                std::cerr << "[!] Invalid --where predicate '" << w << "' (expected path=value)\n";
+                return false;
+            }
+            q.where.push_back({path, w.substr(eq + 1), {}, {}});
+            WherePred& wp = q.where.back();
+            for (const std::string& seg : path) {
+                wp.path_json.emplace_back();
+                json_append_escaped(wp.path_json.back(), seg.data(), seg.size());
+            }
+            json_append_escaped(wp.value_json, wp.value.data(), wp.value.size());
+            if (!q.keep.covers(path)) q.reshape = true;
+            q.render.add(path);
+            // attributes of the record element, which the start tag already has
+            if (path.size() == 1 && (opt.mode == "nmap" ? path[0] == "starttime" : path[0][0] == '@'))
+                q.start_tag.emplace_back(opt.mode == "nmap" ? path[0] : path[0].substr(1), q.where.back().value);
+        }
+    }
+    return true;
+}
+
+// does `v` hold `value` at path[i..]? lists are searched entry by entry
+static bool json_path_equals(const nlohmann::json& v, const std::vector<std::string>& path, size_t i,
+                             const std::string& value) {
+    if (v.is_array()) {
+        for (const auto& e : v)
+            if (json_path_equals(e, path, i, value)) return true;
+        return false;
+    }
+    if (i == path.size()) return v.is_string() && v.get_ref<const std::string&>() == value;
+    if (!v.is_object()) return false;
+    auto it = v.find(path[i]);
+    return it != v.end() && json_path_equals(*it, path, i + 1, value);
+}
+
+// json_path_equals, cutting the first list on the path down to the entries
+// that match; `changed` is set when that drops any
+static bool json_where_one(nlohmann::json& v, const WherePred& w, size_t i, bool& changed) {
+    if (v.is_array()) {
+        auto& list = v.get_ref<nlohmann::json::array_t&>();
+        auto end = std::stable_partition(list.begin(), list.end(), [&](const nlohmann::json& e) {
+            return json_path_equals(e, w.path, i, w.value);
+        });
+        if (end != list.end()) { list.erase(end, list.end()); changed = true; }
+        return !list.empty();
+    }
+    if (i == w.path.size()) return v.is_string() && v.get_ref<const std::string&>() == w.value;
+    if (!v.is_object()) return false;
+    auto it = v.find(w.path[i]);
+    return it != v.end() && json_where_one(*it, w, i + 1, changed);
+}
+
+// drops the keys `f` doesn't keep, at every level
+static void json_project(nlohmann::json& v, const FieldTree& f) {
+    if (f.all) return;
+    if (v.is_array()) {
+        for (auto& e : v) json_project(e, f);
+    } else if (v.is_object()) {
+        for (auto it = v.begin(); it != v.end();) {
+            const FieldTree* sub = f.get(it.key().c_str());
+            if (!sub) { it = v.erase(it); continue; }
+            json_project(it.value(), *sub);
+            ++it;
+        }
+    }
+}
+
+// --where and --fields on a record's json tree (the DOM path); false when
+// the record is filtered out
+static bool query_apply(const RecordQuery& q, nlohmann::json& rec) {
+    bool changed = false;
+    for (const WherePred& w : q.where)
+        if (!json_where_one(rec, w, 0, changed)) return false;
+    json_project(rec, q.keep);
+    return true;
+}
+
+// end of the JSON value starting at `i`
+static size_t json_value_end(const std::string& s, size_t i) {
+    int depth = 0;
+    bool in_str = false;
+    for (; i < s.size(); ++i) {
+        const char c = s[i];
+        if (in_str) {
+            if (c == '\\') ++i;
+            else if (c == '"') { in_str = false; if (!depth) return i + 1; }
+        } else if (c == '"') {
+            in_str = true;
+        } else if (c == '{' || c == '[') {
+            ++depth;
+        } else if (c == '}' || c == ']') {
+            if (!depth) return i;
+            if (--depth == 0) return i + 1;
+        } else if (c == ',' && !depth) {
+            return i;
+        }
+    }
+    return i;
+}
+
+// end of the string starting at s[i] == '"'
+static size_t json_string_end(const std::string& s, size_t i) {
+    size_t e = i + 1;
+    while (e < s.size() && s[e] != '"') e += s[e] == '\\' ? 2 : 1;
+    return e + 1;
+}
+
+// The record filters again, on the compact text the direct writers render:
+// keys and values are compared in their escaped form (the writers escape
+// canonically), so a record is walked but never parsed. Only the subtrees
+// on a predicate's path are looked into; the rest is skipped a value at a
+// time by json_value_end.
+
+// where the value of member `key_json` (quoted, escaped) of the object at
+// s[i] starts; npos when there is none
+static size_t json_text_member(const std::string& s, size_t i, const std::string& key_json) {
+    ++i;                                    // past '{'
+    while (i < s.size() && s[i] == '"') {
+        const size_t ke = json_string_end(s, i);
+        if (s.compare(i, ke - i, key_json) == 0) return ke + 1;
+        i = json_value_end(s, ke + 1);
+        if (i >= s.size() || s[i] != ',') break;
+        ++i;
+    }
+    return std::string::npos;
+}
+
+// json_path_equals on the value at s[i]
+static bool json_text_path_equals(const std::string& s, size_t i, const WherePred& w, size_t k) {
+    if (s[i] == '[') {
+        if (s[++i] == ']') return false;
+        for (;;) {
+            if (json_text_path_equals(s, i, w, k)) return true;
+            i = json_value_end(s, i);
+            if (i >= s.size() || s[i] != ',') return false;
+            ++i;
+        }
+    }
+    if (k == w.path.size()) return s.compare(i, json_value_end(s, i) - i, w.value_json) == 0;
+    if (s[i] != '{') return false;
+    const size_t v = json_text_member(s, i, w.path_json[k]);
+    return v != std::string::npos && json_text_path_equals(s, v, w, k + 1);
+}
+
+// json_where_one on the value at s[i], splicing the cut list into `s`
+static bool json_text_where_one(std::string& s, size_t i, const WherePred& w, size_t k, bool& changed) {
+    if (s[i] == '[') {
+        thread_local std::vector<std::pair<size_t, size_t>> kept;   // the matching entries
+        kept.clear();
+        size_t p = i + 1, total = 0;
+        if (s[p] != ']') {
+            for (;;) {
+                const size_t e = json_value_end(s, p);
+                ++total;
+                if (json_text_path_equals(s, p, w, k)) kept.emplace_back(p, e);
+                p = e;
+                if (p >= s.size() || s[p] != ',') break;
+                ++p;
+            }
+        }
+        if (kept.size() != total) {
+            thread_local std::string list;
+            list.assign(1, '[');
+            for (size_t j = 0; j < kept.size(); ++j) {
+                if (j) list += ',';
+                list.append(s, kept[j].first, kept[j].second - kept[j].first);
+            }
+            list += ']';
+            s.replace(i, p + 1 - i, list);
+            changed = true;
+        }
+        return !kept.empty();
+    }
+    if (k == w.path.size()) return s.compare(i, json_value_end(s, i) - i, w.value_json) == 0;
+    if (s[i] != '{') return false;
+    const size_t v = json_text_member(s, i, w.path_json[k]);
+    return v != std::string::npos && json_text_where_one(s, v, w, k + 1, changed);
+}
+
+// json_project of the value in s[i, end) into `out`
+static void json_text_project(const std::string& s, size_t i, size_t end, const FieldTree& f, std::string& out) {
+    if (f.all || (s[i] != '{' && s[i] != '[')) {
+        out.append(s, i, end - i);
+        return;
+    }
+    const char close = s[i] == '[' ? ']' : '}';
+    out += s[i++];
+    bool first = true;
+    while (i < end && s[i] != close) {
+        if (close == ']') {
+            const size_t e = json_value_end(s, i);
+            if (!first) out += ',';
+            first = false;
+            json_text_project(s, i, e, f, out);
+            i = e;
+        } else {
+            const size_t ke = json_string_end(s, i);
+            const size_t ve = json_value_end(s, ke + 1);
+            thread_local std::string key;
+            if (s.find('\\', i) < ke) key = nlohmann::json::parse(s.begin() + i, s.begin() + ke).get<std::string>();
+            else key.assign(s, i + 1, ke - i - 2);
+            if (const FieldTree* sub = f.get(key.c_str())) {
+                if (!first) out += ',';
+                first = false;
+                out.append(s, i, ke + 1 - i);          // "key":
+                json_text_project(s, ke + 1, ve, *sub, out);
+            }
+            i = ve;
+        }
+        if (i < end && s[i] == ',') ++i;
+    }
+    out += close;
+}
+
+// The same on a record the direct writers rendered (with q.render): only
+// --where needs a look inside it, and the text is rewritten only when a
+// list was cut or a path read just for --where has to go.
+static bool query_filter(const RecordQuery& q, std::string& json) {
+    if (q.where.empty()) return true;
+    bool changed = false;
+    for (const WherePred& w : q.where)
+        if (!json_text_where_one(json, 0, w, 0, changed)) return false;
+    if (q.reshape) {
+        thread_local std::string out;
+        out.clear();
+        json_text_project(json, 0, json.size(), q.keep, out);
+        json.swap(out);
+    }
+    return true;
+}
+
+// ---------- Direct JSON emitter ----------
+// Serializes records straight from the expanded libxml2 subtree into a
+// reusable string, skipping the nlohmann::json DOM. Output is byte-identical
+// to json::dump() of node_to_json / nmap_host_to_obj: keys are emitted in the
+// same (std::map) sorted order and strings are escaped the same way.
+
+static const char* const k_hex_digits = "0123456789abcdef";
+
+// same escaping as nlohmann::json::dump() with ensure_ascii=false
+static void json_append_escaped(std::string& out, const char* s, size_t n) {
+    const SpanScanFn scan = escape_kernels().json;
+    out += '"';
+    for (;;) {
+        const size_t k = scan(s, n);
+        out.append(s, k);
+        if (k == n) break;
+        const unsigned char c = static_cast<unsigned char>(s[k]);
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b";  break;
+            case '\f': out += "\\f";  break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default: {
+                char u[6] = {'\\', 'u', '0', '0', k_hex_digits[c >> 4], k_hex_digits[c & 0xF]};
+                out.append(u, 6);
+                break;
+            }
+        }
+        s += k + 1;
+        n -= k + 1;
+    }
+    out += '"';
+}
+
+static void json_append_string(std::string& out, const xmlChar* s) {
+    const char* p = reinterpret_cast<const char*>(s);
+    json_append_escaped(out, p, std::strlen(p));
+}
+
+// writes `,"key":` (comma only after the first member)
+static void json_key(std::string& out, bool& first, const char* key) {
+    if (!first) out += ',';
+    first = false;
+    json_append_escaped(out, key, std::strlen(key));
+    out += ':';
+}
+
+// `{"key":"value",...}` over the present values (keys sorted) that `f`
+// keeps; `null` when none are present
+static void json_values_object(std::string& out, const char* const* keys, const PropValue* v, size_t nkeys,
+                               const FieldTree& f = FieldTree::everything()) {
+    const size_t mark = out.size();
+    out += '{';
+    bool first = true, any = false;
+    for (size_t i = 0; i < nkeys; ++i) {
+        if (!v[i]) continue;
+        any = true;
+        if (!f.get(keys[i])) continue;
+        json_key(out, first, keys[i]);
+        json_append_string(out, v[i].value);
+    }
+    if (!any) { out.resize(mark); out += "null"; }
+    else out += '}';
+}
+
+// an object built from attributes only; `null` when none are present
+static void json_attr_object(std::string& out, xmlNodePtr node, const char* const* keys, size_t nkeys,
+                             const FieldTree& f = FieldTree::everything()) {
+    PropValue v[8];
+    read_props(node, keys, nkeys, v);
+    json_values_object(out, keys, v, nkeys, f);
+}
+
+// Appends the service object from its attributes (`v`, k_nmap_svc_keys
+// order) and the rendered cpe list, keeping what `f` keeps; returns false
+// (appending nothing) when it would be empty, which nmap_host_to_obj drops.
+static bool nmap_put_service(std::string& out, const PropValue* v, bool any_cpe, const std::string& cpes,
+                             const FieldTree& f = FieldTree::everything()) {
+    const size_t mark = out.size();
+    out += '{';
+    bool first = true, any = any_cpe;
+    auto put = [&](size_t i) {
+        if (!v[i]) return;
+        any = true;
+        if (f.get(k_nmap_svc_keys[i])) { json_key(out, first, k_nmap_svc_keys[i]); json_append_string(out, v[i].value); }
+    };
+    // "cpe" sorts between "conf" and "extrainfo"
+    put(0);
+    if (any_cpe && f.get("cpe")) {
+        json_key(out, first, "cpe");
+        out += '[';
+        out += cpes;
+        out += ']';
+    }
+    for (size_t i = 1; i < 7; ++i) put(i);
+    if (!any) { out.resize(mark); return false; }
+    out += '}';
+    return true;
+}
+
+static bool nmap_write_service(std::string& out, xmlNodePtr svc, std::string& cpes, const FieldTree& f) {
+    PropValue v[7];
+    read_props(svc, k_nmap_svc_keys, 7, v);
+    cpes.clear();
+    bool any_cpe = false;
+    for (xmlNodePtr ce = svc->children; ce; ce = ce->next) {
+        if (nmap_tag(ce) != NmapTag::cpe) continue;
+        PropValue t;
+        get_text(ce, t);
+        if (!t) continue;
+        if (any_cpe) cpes += ',';
+        any_cpe = true;
+        json_append_string(cpes, t.value);
+    }
+    return nmap_put_service(out, v, any_cpe, cpes, f);
+}
+
+struct NmapPortScratch { std::string scripts, service, cpes; };
+
+// The port object: id = {portid, protocol}, st = {reason, state}, plus the
+// rendered scripts list and service object, keeping what `f` keeps; `null`
+// when all are absent. Lists and objects `f` drops needn't be rendered.
+static void nmap_put_port(std::string& out, const PropValue* id, const PropValue* st,
+                          bool any_script, bool any_service, const NmapPortScratch& sc,
+                          const FieldTree& f = FieldTree::everything()) {
+    bool first = true;
+    out += '{';
+    auto put = [&](const char* key, const PropValue& v) {
+        if (v && f.get(key)) { json_key(out, first, key); json_append_string(out, v.value); }
+    };
+    put(k_nmap_port_keys[0], id[0]);
+    put(k_nmap_port_keys[1], id[1]);
+    put("reason", st[0]);
+    if (any_script && f.get("scripts")) {
+        json_key(out, first, "scripts");
+        out += '[';
+        out += sc.scripts;
+        out += ']';
+    }
+    if (any_service && f.get("service")) {
+        json_key(out, first, "service");
+        out += sc.service;
+    }
+    put("state", st[1]);
+    if (!(id[0] || id[1] || st[0] || st[1] || any_script || any_service)) { out.pop_back(); out += "null"; }
+    else out += '}';
+}
+
+static void nmap_write_port(std::string& out, xmlNodePtr p, NmapPortScratch& sc,
+                            const FieldTree& f = FieldTree::everything()) {
+    const FieldTree* fscripts = f.get("scripts");
+    const FieldTree* fservice = f.get("service");
+    PropValue id[2];  // portid, protocol
+    read_props(p, k_nmap_port_keys, 2, id);
+    PropValue st[2];  // reason, state: each from the last <state> carrying it
+    bool any_script = false, any_service = false;
+    sc.scripts.clear();
+    for (xmlNodePtr c = p->children; c; c = c->next) {
+        switch (nmap_tag(c)) {
+        case NmapTag::state: {
+            PropValue v[2];
+            read_props(c, k_nmap_state_keys, 2, v);
+            if (v[0]) st[0] = std::move(v[0]);
+            if (v[1]) st[1] = std::move(v[1]);
+            break;
+        }
+        case NmapTag::service: {
+            // the last non-empty <service> wins
+            const size_t mark = sc.service.size();
+            if (nmap_write_service(sc.service, c, sc.cpes, fservice ? *fservice : FieldTree::everything())) {
+                sc.service.erase(0, mark);
+                any_service = true;
+            }
+            break;
+        }
+        case NmapTag::script:
+            if (!fscripts) { any_script = true; break; }
+            if (any_script) sc.scripts += ',';
+            any_script = true;
+            json_attr_object(sc.scripts, c, k_nmap_script_keys, 2, *fscripts);
+            break;
+        default:
+            break;
+        }
+    }
+    nmap_put_port(out, id, st, any_script, any_service, sc, f);
+    sc.service.clear();
+}
+
+// Scratch buffers for the containers of one host; kept per thread so their
+// capacity is reused from record to record.
+struct NmapHostScratch {
+    std::string addresses, hostnames, hostscripts, ports, tmp;
+    bool any_address = false, any_hostnames = false, any_hostscripts = false, any_ports = false;
+    NmapPortScratch port;
+
+    void begin() {
+        addresses.clear();
+        any_address = any_hostnames = any_hostscripts = any_ports = false;
+    }
+
+    // the host object, keys in nmap_host_to_obj's (sorted) order; of the
+    // containers only those `f` keeps need to have been rendered
+    void put(std::string& out, const PropValue& starttime, const PropValue& status, const PropValue* uptime,
+             const FieldTree& f = FieldTree::everything()) const {
+        out += '{';
+        bool first = true;
+        json_key(out, first, "_tag");
+        out += "\"host\"";
+        auto put_array = [&](const char* key, bool any, const std::string& body) {
+            if (!any || !f.get(key)) return;
+            json_key(out, first, key);
+            out += '[';
+            out += body;
+            out += ']';
+        };
+        put_array("addresses", any_address, addresses);
+        put_array("hostnames", any_hostnames, hostnames);
+        put_array("hostscripts", any_hostscripts, hostscripts);
+        put_array("ports", any_ports, ports);
+        if (starttime && f.get("starttime")) { json_key(out, first, "starttime"); json_append_string(out, starttime.value); }
+        if (status && f.get("status")) { json_key(out, first, "status"); json_append_string(out, status.value); }
+        const FieldTree* fup = f.get("uptime");
+        if ((uptime[0] || uptime[1]) && fup) {
+            json_key(out, first, "uptime");
+            json_values_object(out, k_nmap_uptime_keys, uptime, 2, *fup);
+        }
+        out += '}';
+    }
+};
+
+// Same output as nmap_host_to_obj(host).dump(), appended to `out`, in a
+// single pass over the host's children. Containers are rendered into scratch
+// buffers as they are met (the last non-empty one wins, as in
+// nmap_host_to_obj) and spliced in sorted key order at the end. Those `f`
+// drops are walked past without rendering.
+static void nmap_host_write_json(xmlNodePtr host, std::string& out, const FieldTree& f = FieldTree::everything()) {
+    thread_local NmapHostScratch sc;
+    PropValue starttime, status, uptime[2];
+    read_props(host, k_nmap_host_keys, 1, &starttime);
+    sc.begin();
+    const FieldTree* faddr = f.get("addresses");
+    const FieldTree* fnames = f.get("hostnames");
+    const FieldTree* fports = f.get("ports");
+    const FieldTree* fscripts = f.get("hostscripts");
+
+    for (xmlNodePtr n = host->children; n; n = n->next) {
+        switch (nmap_tag(n)) {
+        case NmapTag::status: {
+            PropValue v;
+            read_props(n, k_nmap_state_keys + 1, 1, &v);
+            if (v) status = std::move(v);
+            break;
+        }
+        case NmapTag::address:
+            if (!faddr) break;
+            if (sc.any_address) sc.addresses += ',';
+            sc.any_address = true;
+            json_attr_object(sc.addresses, n, k_nmap_addr_keys, 3, *faddr);
+            break;
+        case NmapTag::hostnames: {
+            if (!fnames) break;
+            sc.tmp.clear();
+            bool any = false;
+            for (xmlNodePtr h = n->children; h; h = h->next) {
+                if (nmap_tag(h) != NmapTag::hostname) continue;
+                if (any) sc.tmp += ',';
+                any = true;
+                json_attr_object(sc.tmp, h, k_nmap_hostname_keys, 2, *fnames);
+            }
+            if (any) { sc.hostnames.swap(sc.tmp); sc.any_hostnames = true; }
+            break;
+        }
+        case NmapTag::ports: {
+            if (!fports) break;
+            sc.tmp.clear();
+            bool any = false;
+            for (xmlNodePtr p = n->children; p; p = p->next) {
+                if (nmap_tag(p) != NmapTag::port) continue;
+                if (any) sc.tmp += ',';
+                any = true;
+                nmap_write_port(sc.tmp, p, sc.port, *fports);
+            }
+            if (any) { sc.ports.swap(sc.tmp); sc.any_ports = true; }
+            break;
+        }
+        case NmapTag::hostscript: {
+            if (!fscripts) break;
+            sc.tmp.clear();
+            bool any = false;
+            for (xmlNodePtr s = n->children; s; s = s->next) {
+                if (nmap_tag(s) != NmapTag::script) continue;
+                if (any) sc.tmp += ',';
+                any = true;
+                json_attr_object(sc.tmp, s, k_nmap_script_keys, 2, *fscripts);
+            }
+            if (any) { sc.hostscripts.swap(sc.tmp); sc.any_hostscripts = true; }
+            break;
+        }
+        case NmapTag::uptime: {
+            PropValue v[2];
+            read_props(n, k_nmap_uptime_keys, 2, v);
+            if (v[0] || v[1]) { uptime[0] = std::move(v[0]); uptime[1] = std::move(v[1]); }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    sc.put(out, starttime, status, uptime, f);
+}
+
+static int name_cmp(const xmlChar* a, const xmlChar* b) {
+    return std::strcmp(reinterpret_cast<const char*>(a), reinterpret_cast<const char*>(b));
+}
+
+// One element as the generic emitter sees it: its attributes (name, value)
+// and element children (name, node) in document order. Gathered from
+// libxml2 nodes by generic_write_value and from SAX records by
+// sax_write_value; the kids' "node" is whatever the gatherer recurses on.
+struct GenAttr {
+    const xmlChar* name;
+    const xmlChar* value;
+};
+
+template <class Node>
+struct GenKid {
+    const xmlChar* name;
+    Node node;
+};
+
+// Value of node_to_json(node)[name], appended to `out`, from the element's
+// parts: all descendant `text` (untrimmed), attributes and children;
+// `write_kid(node, sub)` appends a child's value, keeping `sub` of it. Only
+// the keys `f` keeps are written (the children it drops aren't visited).
+// When `record_tag` is set the value is a record: it always becomes an
+// object and gains "_tag".
+//
+// Key order matches std::map: "#text" < "@attr..." < element names, because
+// '#' and '@' sort below every character that can start an XML name. "_tag"
+// is slotted in among the element names.
+//
+// Scratch comes from `mr` (the record arena). `text` is usually a slice of
+// the record's TextSpans.
+template <class Node, class WriteKid>
+static void generic_write_parts(std::string& out, std::string_view text, const GenAttr* attrs, size_t na,
+                                std::pmr::vector<GenKid<Node>>& kids, const char* record_tag, const FieldTree& f,
+                                std::pmr::memory_resource* mr, WriteKid&& write_kid) {
+    // text: all descendant text, trimmed (as in element_to_json)
+    const char* txt = text.data();
+    size_t tb = 0, te = text.size();
+    while (tb < te && std::strchr(" \t\r\n", txt[tb])) ++tb;
+    while (te > tb && std::strchr(" \t\r\n", txt[te - 1])) --te;
+    const bool has_text = te > tb;
+
+    // sort by name; on duplicate local names the later attribute wins. Both
+    // sorts are made stable by breaking ties on position, which keeps
+    // std::stable_sort's temporary buffer off the heap.
+    std::pmr::vector<size_t> aord(na, mr);
+    for (size_t i = 0; i < na; ++i) aord[i] = i;
+    std::sort(aord.begin(), aord.end(), [&](size_t x, size_t y) {
+        const int c = name_cmp(attrs[x].name, attrs[y].name);
+        return c < 0 || (c == 0 && x < y);
+    });
+    if (kids.size() > 1) {
+        std::pmr::vector<size_t> kord(kids.size(), mr);
+        for (size_t i = 0; i < kord.size(); ++i) kord[i] = i;
+        std::sort(kord.begin(), kord.end(), [&](size_t x, size_t y) {
+            const int c = name_cmp(kids[x].name, kids[y].name);
+            return c < 0 || (c == 0 && x < y);
+        });
+        std::pmr::vector<GenKid<Node>> sorted(mr);
+        sorted.reserve(kids.size());
+        for (size_t k : kord) sorted.push_back(kids[k]);
+        kids.swap(sorted);
+    }
+
+    if (kids.empty() && na == 0 && has_text && !record_tag) {
+        json_append_escaped(out, txt + tb, te - tb);
+        return;
+    }
+
+    out += '{';
+    bool first = true;
+    if (has_text && f.get("#text")) { json_key(out, first, "#text"); json_append_escaped(out, txt + tb, te - tb); }
+
+    std::pmr::string key(mr);
+    for (size_t i = 0; i < na; ++i) {
+        const GenAttr& a = attrs[aord[i]];
+        if (i + 1 < na && xmlStrEqual(a.name, attrs[aord[i + 1]].name)) continue;
+        key.assign(1, '@');
+        key += reinterpret_cast<const char*>(a.name);
+        if (!f.get(key.c_str())) continue;
+        if (!first) out += ',';
+        first = false;
+        json_append_escaped(out, key.data(), key.size());
+        out += ':';
+        json_append_string(out, a.value);
+    }
+
+    bool tag_done = (record_tag == nullptr);
+    for (size_t i = 0; i < kids.size();) {
+        const char* nm = reinterpret_cast<const char*>(kids[i].name);
+        size_t j = i + 1;
+        while (j < kids.size() && xmlStrEqual(kids[j].name, kids[i].name)) ++j;
+        if (!tag_done && std::strcmp("_tag", nm) <= 0) {
+            json_key(out, first, "_tag");
+            json_append_string(out, BAD_CAST record_tag);
+            tag_done = true;
+            if (std::strcmp("_tag", nm) == 0) { i = j; continue; } // "_tag" is overwritten
+        }
+        const FieldTree* sub = f.get(nm);
+        if (!sub) { i = j; continue; }
+        json_key(out, first, nm);
+        if (j - i == 1) {
+            write_kid(kids[i].node, *sub);
+        } else {
+            out += '[';
+            for (size_t k = i; k < j; ++k) {
+                if (k > i) out += ',';
+                write_kid(kids[k].node, *sub);
+            }
+            out += ']';
+        }
+        i = j;
+    }
+    if (!tag_done) { json_key(out, first, "_tag"); json_append_string(out, BAD_CAST record_tag); }
+    out += '}';
+}
+
+// An attribute's value as add_attributes sees it: borrowed when it is a
+// single text node; null when it has none.
+static void generic_attr_value(xmlNodePtr node, xmlAttr* a, PropValue& pv) {
+    xmlNodePtr ch = a->children;
+    if (ch && !ch->next && ch->type == XML_TEXT_NODE && ch->content) {
+        pv.value = ch->content;
+    } else {
+        pv.owned = xmlNodeListGetString(node->doc, ch, 1);
+        pv.value = pv.owned;
+    }
+}
+
+// A child element for generic_write_value: the node and its TextSpans index.
+struct DomKid {
+    xmlNodePtr node;
+    size_t ti;
+};
+
+// Value of node_to_json(node)[name], appended to `out` (see
+// generic_write_parts); `node` is span `ti` of `ts`.
+static void generic_write_value(xmlNodePtr node, const TextSpans& ts, size_t ti, std::string& out,
+                                const char* record_tag, const FieldTree& f, std::pmr::memory_resource* mr) {
+    size_t nattrs = 0;
+    for (xmlAttr* a = node->properties; a; a = a->next) ++nattrs;
+    std::pmr::vector<GenKid<DomKid>> kids(mr);
+    size_t k = ti + 1;
+    for (xmlNodePtr c = node->children; c; c = c->next) {
+        if (c->type != XML_ELEMENT_NODE) continue;
+        kids.push_back({c->name, {c, k}});
+        k = ts.spans[k].next;
+    }
+
+    // values of attributes, filtered the way add_attributes does
+    std::pmr::vector<PropValue> vals(nattrs, mr);
+    std::pmr::vector<GenAttr> attrs(mr);
+    attrs.reserve(nattrs);
+    for (xmlAttr* a = node->properties; a; a = a->next) {
+        PropValue& pv = vals[attrs.size()];
+        generic_attr_value(node, a, pv);
+        if (!pv.value) continue;
+        attrs.push_back({a->name, pv.value});
+    }
+
+    generic_write_parts(out, ts.of(ti), attrs.data(), attrs.size(), kids, record_tag, f, mr,
+                        [&](const DomKid& kid, const FieldTree& sub) {
+                            generic_write_value(kid.node, ts, kid.ti, out, nullptr, sub, mr);
+                        });
+}
+
+// Same output as the unwrapped, "_tag"-stamped node_to_json(node).dump(),
+// with the keys `f` keeps.
+static void generic_record_write_json(xmlNodePtr node, std::string& out, const FieldTree& f = FieldTree::everything()) {
+    TextSpans& ts = TextSpans::local();
+    text_spans_add(node, ts);
+    generic_write_value(node, ts, 0, out, reinterpret_cast<const char*>(node->name), f, RecordArena::local().resource());
+}
+
+// q.start_tag on the record element: false when one of its attribute
+// predicates fails (the later of two same-named attributes counts, as in
+// the output). In nmap mode they are <host> attributes.
+static bool record_start_tag_matches(xmlNodePtr node, const RecordQuery& q, bool nmap) {
+    if (nmap && !xmlStrEqual(node->name, BAD_CAST "host")) return true;
+    for (const auto& w : q.start_tag) {
+        PropValue v;
+        if (nmap) {
+            read_props(node, k_nmap_host_keys, 1, &v);
+        } else {
+            for (xmlAttr* a = node->properties; a; a = a->next) {
+                if (!xmlStrEqual(a->name, BAD_CAST w.first.c_str())) continue;
+                PropValue pv;
+                generic_attr_value(node, a, pv);
+                if (pv) v = std::move(pv);
+            }
+        }
+        if (!v || w.second != reinterpret_cast<const char*>(v.value)) return false;
+    }
+    return true;
+}
+
+// ---------- Record limits (--max-record-bytes / --max-children) ----------
+// Caps on what one record may hold, so a pathological record (tens of
+// thousands of ports, a multi-MB script output) can't take the process's
+// memory with it. They apply on the paths that never hold a whole record
+// as a tree: the Nmap streamer and the SAX record builder.
+//   --max-children N: an element keeps its first N output children; the
+//     rest are walked past without being read into memory.
+//   --max-record-bytes N: text and attribute values are kept while the
+//     record's total stays within N bytes; a value that doesn't fit is
+//     appended to the spill file instead and replaced by
+//     "$spill:OFFSET:LENGTH" (bytes in that file). A text run the parser
+//     delivers in pieces keeps the pieces before the first one that
+//     didn't fit, then one reference for the rest.
+//     The reference is an ordinary string, so a value that itself begins
+//     with "$spill:" is moved as well: with the limit on, such a string in
+//     the output is always a reference. A value no longer than its
+//     reference would be is kept even past the limit (moving it would not
+//     make the record smaller), so a record can end up over N by those.
+// Records that hit either limit are counted (and listed by number) for
+// the end-of-run summary and --stats.
+struct RecordLimits {
+    static constexpr size_t k_listed = 1000;    // record numbers kept for the report
+    static constexpr size_t k_flush = 1u << 20;
+
+    size_t max_bytes = 0;                   // 0: no byte limit
+    size_t max_children = 0;                // 0: no child limit
+    std::string spill_path;
+    int spill_fd = -1;
+    std::string spill_buf;
+    uint64_t spill_off = 0;                 // bytes handed to the spill file so far
+    bool spill_failed = false;
+
+    // totals
+    uint64_t records = 0, children_dropped = 0, values_spilled = 0, bytes_spilled = 0;
+    std::vector<uint64_t> listed;           // numbers (1-based, in input order) of the first k_listed records
+
+    ~RecordLimits() { close(); }
+
+    // appends `n` bytes to the spill file; returns their offset
+    uint64_t spill(const char* s, size_t n) {
+        const uint64_t at = spill_off;
+        spill_buf.append(s, n);
+        spill_off += n;
+        bytes_spilled += n;
+        if (spill_buf.size() >= k_flush) flush();
+        return at;
+    }
+
+    void flush() {
+        for (size_t off = 0; off < spill_buf.size() && !spill_failed;) {
+            const ssize_t w = ::write(spill_fd, spill_buf.data() + off, spill_buf.size() - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) {
+                std::cerr << "[!] Failed to write " << spill_path << "\n";
+                spill_failed = true;
+                g_stop_requested = 1;
+            } else {
+                off += (size_t)w;
+            }
+        }
+        spill_buf.clear();
+    }
+
+    // false if the spill file couldn't be written
+    bool close() {
+        if (spill_fd < 0) return !spill_failed;
+        flush();
+        if (::close(spill_fd) != 0) spill_failed = true;
+        spill_fd = -1;
+        return !spill_failed;
+    }
+};
+
+// One record's use of its RecordLimits
+class RecordBudget {
+public:
+    explicit RecordBudget(RecordLimits* lim = nullptr) : lim_(lim) {}
+
+    bool active() const { return lim_ != nullptr; }
+    bool spills() const { return lim_ && lim_->max_bytes; }
+
+    void begin() {
+        used_ = 0;
+        hit_ = false;
+    }
+
+    // record number `n` is done
+    void end(uint64_t n) {
+        if (!lim_ || !hit_) return;
+        ++lim_->records;
+        if (lim_->listed.size() < RecordLimits::k_listed) lim_->listed.push_back(n);
+    }
+
+    // another output child of an element that has `kids` already: false
+    // when it is to be dropped
+    bool child(size_t kids) {
+        if (!lim_ || !lim_->max_children || kids < lim_->max_children) return true;
+        ++lim_->children_dropped;
+        hit_ = true;
+        return false;
+    }
+
+    // whether the value of `n` bytes at `s` still fits the record (and
+    // takes the room); when it doesn't, it is moved whole with spill(). One
+    // no longer than its reference would be stays anyway, unless it reads
+    // like a reference itself.
+    bool fits(const char* s, size_t n) {
+        if (!lim_ || !lim_->max_bytes) return true;
+        if (looks_like_reference(s, n)) return false;
+        if (used_ > lim_->max_bytes || n > lim_->max_bytes - used_) {
+            if (n > 8 + std::to_string(lim_->spill_off).size() + std::to_string(n).size()) return false;
+        }
+        used_ += n;
+        return true;
+    }
+
+    // moves the `n` bytes at `s` to the spill file; `marker` gets the reference
+    void spill(const char* s, size_t n, std::string& marker) {
+        const uint64_t at = lim_->spill(s, n);
+        ++lim_->values_spilled;
+        hit_ = true;
+        marker = "$spill:" + std::to_string(at) + ":" + std::to_string(n);
+        used_ += marker.size();
+    }
+
+    static bool looks_like_reference(const char* s, size_t n) {
+        return n >= 7 && std::memcmp(s, "$spill:", 7) == 0;
+    }
+
+    // Extends a reference made by the previous spill() when this run follows
+    // it in the spill file (a text split over several callbacks).
+    bool extend(const char* s, size_t n, std::string& marker) {
+        if (marker.compare(0, 7, "$spill:") != 0) return false;
+        const size_t c = marker.find(':', 7);
+        const uint64_t at = std::strtoull(marker.c_str() + 7, nullptr, 10);
+        const uint64_t len = std::strtoull(marker.c_str() + c + 1, nullptr, 10);
+        if (at + len != lim_->spill_off) return false;
+        lim_->spill(s, n);
+        used_ -= marker.size();
+        marker = "$spill:" + std::to_string(at) + ":" + std::to_string(len + n);
+        used_ += marker.size();
+        return true;
+    }
+
+private:
+    RecordLimits* lim_;
+    size_t used_ = 0;
+    bool hit_ = false;
+};
+
+// ---------- Streaming Nmap extractor (no subtree expansion) ----------
+// The same JSON as nmap_host_write_json, produced from xmlTextReader events
+// without expanding <host>. The reader frees each child once it has moved
+// past it, so memory stays flat however many ports or script outputs a host
+// carries. A stack of roles mirrors the element path (host > ports > port >
+// service > cpe, ...): only the children nmap_host_write_json looks at are
+// picked up, everything else is walked past. Attribute values are copied
+// out as they are read, because the reader reuses its buffers once it moves.
+//
+// Attributes defaulted by a DTD are only visible in the tree, so
+// documents that declare attributes keep using the expanded path (see
+// doc_declares_attributes).
+
+// read_props() for the reader's current element
+struct StreamProps {
+    std::string s[8];
+    PropValue v[8];     // v[i] borrows s[i] when present
+    RecordBudget* budget = nullptr;     // --max-record-bytes
+
+    void read(xmlTextReaderPtr r, const char* const* keys, size_t nkeys) {
+        for (size_t i = 0; i < nkeys; ++i) v[i].value = nullptr;
+        while (xmlTextReaderMoveToNextAttribute(r) == 1) {
+            if (xmlTextReaderIsNamespaceDecl(r) == 1) continue;
+            const char* an = reinterpret_cast<const char*>(xmlTextReaderConstLocalName(r));
+            if (!an) continue;
+            for (size_t i = 0; i < nkeys; ++i) {
+                if (an[0] == keys[i][0] && std::strcmp(an, keys[i]) == 0) {
+                    if (!v[i]) keep_limited(i, xmlTextReaderConstValue(r));
+                    break;
+                }
+            }
+        }
+        xmlTextReaderMoveToElement(r);
+    }
+
+    // v[i] = a copy of `value`
+    void keep(size_t i, const xmlChar* value) {
+        s[i].assign(value ? reinterpret_cast<const char*>(value) : "");
+        v[i].value = BAD_CAST s[i].c_str();
+    }
+    void take(size_t i, const PropValue& from) { if (from) keep(i, from.value); }
+
+    // keep(), or the spill reference when the value doesn't fit the budget
+    void keep_limited(size_t i, const xmlChar* value) {
+        const char* str = value ? reinterpret_cast<const char*>(value) : "";
+        const size_t n = std::strlen(str);
+        if (!budget || budget->fits(str, n)) {
+            keep(i, value);
+            return;
+        }
+        budget->spill(str, n, s[i]);
+        v[i].value = BAD_CAST s[i].c_str();
+    }
+};
+
+class NmapHostStreamer {
+public:
+    // With the reader on a <host> start tag, appends the host's JSON to
+    // `out`. Returns the last xmlTextReaderRead() result: 1 with the reader
+    // on </host> (or still on <host/>); 0 / -1 when the document ended or
+    // broke inside the host, and the partial host should be dropped (as
+    // the expanded path drops a subtree it cannot complete). Containers `f`
+    // drops are walked past without rendering.
+    int run(xmlTextReaderPtr r, std::string& out, const FieldTree& f = FieldTree::everything()) {
+        faddr_ = f.get("addresses");
+        fnames_ = f.get("hostnames");
+        fhscripts_ = f.get("hostscripts");
+        fports_ = f.get("ports");
+        fpscripts_ = fports_ ? fports_->get("scripts") : nullptr;
+        const FieldTree* fsvc = fports_ ? fports_->get("service") : nullptr;
+        fservice_ = fsvc ? fsvc : &FieldTree::everything();
+        sc_.begin();
+        budget_.begin();
+        host_.read(r, k_nmap_host_keys, 1);
+        for (PropValue& v : last_.v) v.value = nullptr;
+        in_cpe_ = false;
+        int ret = 1;
+        if (!xmlTextReaderIsEmptyElement(r)) {
+            const int depth = xmlTextReaderDepth(r);
+            stack_.assign(1, Role::host);
+            kids_.assign(1, 0);
+            ret = xmlTextReaderRead(r);
+            while (ret == 1) {
+                const int type = xmlTextReaderNodeType(r);
+                if (type == XML_READER_TYPE_ELEMENT) {
+                    const char* nm = reinterpret_cast<const char*>(xmlTextReaderConstLocalName(r));
+                    const Role role = wanted(child_role(stack_.back(), nm ? nmap_tag_name(nm) : NmapTag::other));
+                    // --max-children: later output children are passed over unread
+                    if (role != Role::other && !budget_.child(kids_.back()++)) {
+                        ret = xmlTextReaderNext(r);
+                        continue;
+                    }
+                    open(r, role);
+                    if (xmlTextReaderIsEmptyElement(r)) {
+                        close(role);
+                    } else {
+                        stack_.push_back(role);
+                        kids_.push_back(0);
+                    }
+                } else if (type == XML_READER_TYPE_END_ELEMENT) {
+                    if (xmlTextReaderDepth(r) <= depth) break;
+                    if (stack_.size() > 1) {
+                        close(stack_.back());
+                        stack_.pop_back();
+                        kids_.pop_back();
+                    }
+                } else if (in_cpe_ && (type == XML_READER_TYPE_TEXT || type == XML_READER_TYPE_CDATA ||
+                                       type == XML_READER_TYPE_WHITESPACE ||
+                                       type == XML_READER_TYPE_SIGNIFICANT_WHITESPACE)) {
+                    if (const xmlChar* v = xmlTextReaderConstValue(r)) text_ += reinterpret_cast<const char*>(v);
+                }
+                ret = xmlTextReaderRead(r);
+            }
+        }
+        sc_.put(out, host_.v[0], last_.v[k_status], last_.v + k_uptime, f);
+        return ret;
+    }
+
+    // --max-record-bytes / --max-children for the hosts to come
+    void limit(RecordLimits* lim) {
+        budget_ = RecordBudget(lim);
+        for (StreamProps* p : {&host_, &port_, &service_, &tmp_}) p->budget = lim ? &budget_ : nullptr;
+    }
+    // the last host's use of the limits
+    RecordBudget& budget() { return budget_; }
+
+private:
+    enum class Role : uint8_t {
+        other, host, status, address, hostnames, hostname, ports, port, port_state,
+        service, cpe, port_script, hostscript, host_script, uptime
+    };
+    // slots in last_: "last one wins" values of the host and the open port
+    enum : size_t { k_status = 0, k_uptime = 1, k_reason = 4, k_state = 5 };
+
+    // the role of a child element: only the paths nmap_host_write_json reads
+    static Role child_role(Role parent, NmapTag t) {
+        switch (parent) {
+        case Role::host:
+            switch (t) {
+            case NmapTag::status:     return Role::status;
+            case NmapTag::address:    return Role::address;
+            case NmapTag::hostnames:  return Role::hostnames;
+            case NmapTag::ports:      return Role::ports;
+            case NmapTag::hostscript: return Role::hostscript;
+            case NmapTag::uptime:     return Role::uptime;
+            default:                  return Role::other;
+            }
+        case Role::hostnames:  return t == NmapTag::hostname ? Role::hostname : Role::other;
+        case Role::ports:      return t == NmapTag::port ? Role::port : Role::other;
+        case Role::port:
+            switch (t) {
+            case NmapTag::state:   return Role::port_state;
+            case NmapTag::service: return Role::service;
+            case NmapTag::script:  return Role::port_script;
+            default:               return Role::other;
+            }
+        case Role::service:    return t == NmapTag::cpe ? Role::cpe : Role::other;
+        case Role::hostscript: return t == NmapTag::script ? Role::host_script : Role::other;
+        default:               return Role::other;
+        }
+    }
+
+    // `role`, or other for a host container that isn't output
+    Role wanted(Role role) const {
+        switch (role) {
+        case Role::address:    return faddr_ ? role : Role::other;
+        case Role::hostnames:  return fnames_ ? role : Role::other;
+        case Role::hostscript: return fhscripts_ ? role : Role::other;
+        case Role::ports:      return fports_ ? role : Role::other;
+        default:               return role;
+        }
+    }
+
+    // a list item: `,` before all but the first
+    static void list_item(std::string& list, bool& any) {
+        if (any) list += ',';
+        any = true;
+    }
+
+    void open(xmlTextReaderPtr r, Role role) {
+        switch (role) {
+        case Role::status:
+            tmp_.read(r, k_nmap_state_keys + 1, 1);
+            last_.take(k_status, tmp_.v[0]);
+            break;
+        case Role::address:
+            tmp_.read(r, k_nmap_addr_keys, 3);
+            list_item(sc_.addresses, sc_.any_address);
+            json_values_object(sc_.addresses, k_nmap_addr_keys, tmp_.v, 3, *faddr_);
+            break;
+        case Role::hostnames:
+        case Role::hostscript:
+            list_.clear();
+            any_list_ = false;
+            break;
+        case Role::hostname:
+            tmp_.read(r, k_nmap_hostname_keys, 2);
+            list_item(list_, any_list_);
+            json_values_object(list_, k_nmap_hostname_keys, tmp_.v, 2, *fnames_);
+            break;
+        case Role::host_script:
+            tmp_.read(r, k_nmap_script_keys, 2);
+            list_item(list_, any_list_);
+            json_values_object(list_, k_nmap_script_keys, tmp_.v, 2, *fhscripts_);
+            break;
+        case Role::ports:
+            ports_.clear();
+            any_port_ = false;
+            break;
+        case Role::port:
+            port_.read(r, k_nmap_port_keys, 2);
+            last_.v[k_reason].value = last_.v[k_state].value = nullptr;
+            sc_.port.scripts.clear();
+            any_script_ = any_service_ = false;
+            break;
+        case Role::port_state:
+            tmp_.read(r, k_nmap_state_keys, 2);
+            last_.take(k_reason, tmp_.v[0]);
+            last_.take(k_state, tmp_.v[1]);
+            break;
+        case Role::port_script:
+            if (!fpscripts_) { any_script_ = true; break; }
+            tmp_.read(r, k_nmap_script_keys, 2);
+            list_item(sc_.port.scripts, any_script_);
+            json_values_object(sc_.port.scripts, k_nmap_script_keys, tmp_.v, 2, *fpscripts_);
+            break;
+        case Role::service:
+            service_.read(r, k_nmap_svc_keys, 7);
+            sc_.port.cpes.clear();
+            any_cpe_ = false;
+            break;
+        case Role::cpe:
+            text_.clear();
+            in_cpe_ = true;
+            break;
+        case Role::uptime:
+            tmp_.read(r, k_nmap_uptime_keys, 2);
+            if (tmp_.v[0] || tmp_.v[1]) {
+                for (size_t i = 0; i < 2; ++i) {
+                    last_.v[k_uptime + i].value = nullptr;
+                    last_.take(k_uptime + i, tmp_.v[i]);
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    void close(Role role) {
+        switch (role) {
+        case Role::hostnames:
+            if (any_list_) { sc_.hostnames.swap(list_); sc_.any_hostnames = true; }
+            break;
+        case Role::hostscript:
+            if (any_list_) { sc_.hostscripts.swap(list_); sc_.any_hostscripts = true; }
+            break;
+        case Role::ports:
+            if (any_port_) { sc_.ports.swap(ports_); sc_.any_ports = true; }
+            break;
+        case Role::port:
+            list_item(ports_, any_port_);
+            nmap_put_port(ports_, port_.v, last_.v + k_reason, any_script_, any_service_, sc_.port, *fports_);
+            break;
+        case Role::service:
+            // the last non-empty <service> wins
+            svc_json_.clear();
+            if (nmap_put_service(svc_json_, service_.v, any_cpe_, sc_.port.cpes, *fservice_)) {
+                sc_.port.service.swap(svc_json_);
+                any_service_ = true;
+            }
+            break;
+        case Role::cpe:
+            in_cpe_ = false;
+            if (!budget_.fits(text_.data(), text_.size())) {
+                std::string marker;
+                budget_.spill(text_.data(), text_.size(), marker);
+                text_.swap(marker);
+            }
+            list_item(sc_.port.cpes, any_cpe_);
+            json_append_escaped(sc_.port.cpes, text_.data(), text_.size());
+            break;
+        default:
+            break;
+        }
+    }
+
+    NmapHostScratch sc_;
+    StreamProps host_, port_, service_, tmp_;
+    StreamProps last_;          // status, uptime[2], port reason/state
+    std::vector<Role> stack_;
+    std::vector<size_t> kids_;  // output children seen, per stack_ entry
+    RecordBudget budget_;
+    std::string list_, ports_, svc_json_, text_;
+    bool any_list_ = false, any_port_ = false, any_script_ = false, any_service_ = false, any_cpe_ = false;
+    bool in_cpe_ = false;
+    // run()'s FieldTree below the containers (null: not output)
+    const FieldTree* faddr_ = nullptr;
+    const FieldTree* fnames_ = nullptr;
+    const FieldTree* fhscripts_ = nullptr;
+    const FieldTree* fports_ = nullptr;
+    const FieldTree* fpscripts_ = nullptr;
+    const FieldTree* fservice_ = nullptr;
+};
+
+// ---------- Nmap host extraction (structured) ----------
+// The fields nmap_host_to_obj pulls out, as plain structs for the relational
+// writers. Absent attributes stay std::nullopt (SQL NULL); "last one wins"
+// rules match nmap_host_to_obj.
+using OptStr = std::optional<std::string>;
+
+struct NmapAddress  { OptStr addr, addrtype, vendor; };
+struct NmapHostname { OptStr name, type; };
+struct NmapScript   { OptStr id, output; };
+struct NmapService  { OptStr name, product, version, extrainfo, tunnel, method, conf; std::vector<std::string> cpes; };
+struct NmapPort {
+    OptStr protocol, portid, state, reason;
+    std::optional<NmapService> service;
+    std::vector<NmapScript> scripts;
+};
+struct NmapHost {
+    OptStr starttime, status, uptime_seconds, uptime_lastboot;
+    std::vector<NmapAddress> addresses;
+    std::vector<NmapHostname> hostnames;
+    std::vector<NmapPort> ports;
+    std::vector<NmapScript> hostscripts;
+};
+
+static void opt_from(const PropValue& v, OptStr& dst) {
+    if (v) dst = std::string(reinterpret_cast<const char*>(v.value));
+}
+
+static NmapScript nmap_extract_script(xmlNodePtr s) {
+    PropValue v[2];
+    read_props(s, k_nmap_script_keys, 2, v);
+    NmapScript sc;
+    opt_from(v[0], sc.id);
+    opt_from(v[1], sc.output);
+    return sc;
+}
+
+static void nmap_extract_port(xmlNodePtr p, NmapPort& pt) {
+    PropValue id[2];
+    read_props(p, k_nmap_port_keys, 2, id);
+    opt_from(id[0], pt.portid);
+    opt_from(id[1], pt.protocol);
+    for (xmlNodePtr c = p->children; c; c = c->next) {
+        switch (nmap_tag(c)) {
+        case NmapTag::state: {
+            PropValue v[2];
+            read_props(c, k_nmap_state_keys, 2, v);
+            opt_from(v[0], pt.reason);
+            opt_from(v[1], pt.state);
+            break;
+        }
+        case NmapTag::service: {
+            PropValue v[7];
+            read_props(c, k_nmap_svc_keys, 7, v);
+            NmapService svc;
+            opt_from(v[0], svc.conf);
+            opt_from(v[1], svc.extrainfo);
+            opt_from(v[2], svc.method);
+            opt_from(v[3], svc.name);
+            opt_from(v[4], svc.product);
+            opt_from(v[5], svc.tunnel);
+            opt_from(v[6], svc.version);
+            for (xmlNodePtr ce = c->children; ce; ce = ce->next) {
+                if (nmap_tag(ce) != NmapTag::cpe) continue;
+                PropValue t;
+                get_text(ce, t);
+                if (t) svc.cpes.emplace_back(reinterpret_cast<const char*>(t.value));
+            }
+            if (svc.name || svc.product || svc.version || svc.extrainfo || svc.tunnel ||
+                svc.method || svc.conf || !svc.cpes.empty())
+                pt.service = std::move(svc);
+            break;
+        }
+        case NmapTag::script:
+            pt.scripts.push_back(nmap_extract_script(c));
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void nmap_host_extract(xmlNodePtr host, NmapHost& h) {
+    {
+        PropValue st;
+        read_props(host, k_nmap_host_keys, 1, &st);
+        opt_from(st, h.starttime);
+    }
+    for (xmlNodePtr n = host->children; n; n = n->next) {
+        switch (nmap_tag(n)) {
+        case NmapTag::status: {
+            PropValue v;
+            read_props(n, k_nmap_state_keys + 1, 1, &v);
+            opt_from(v, h.status);
+            break;
+        }
+        case NmapTag::address: {
+            PropValue v[3];
+            read_props(n, k_nmap_addr_keys, 3, v);
+            NmapAddress a;
+            opt_from(v[0], a.addr);
+            opt_from(v[1], a.addrtype);
+            opt_from(v[2], a.vendor);
+            h.addresses.push_back(std::move(a));
+            break;
+        }
+        case NmapTag::hostnames: {
+            // a container without entries leaves the previous one in place
+            bool any = false;
+            for (xmlNodePtr c = n->children; c; c = c->next) {
+                if (nmap_tag(c) != NmapTag::hostname) continue;
+                if (!any) { h.hostnames.clear(); any = true; }
+                PropValue v[2];
+                read_props(c, k_nmap_hostname_keys, 2, v);
+                NmapHostname hn;
+                opt_from(v[0], hn.name);
+                opt_from(v[1], hn.type);
+                h.hostnames.push_back(std::move(hn));
+            }
+            break;
+        }
+        case NmapTag::ports: {
+            bool any = false;
+            for (xmlNodePtr p = n->children; p; p = p->next) {
+                if (nmap_tag(p) != NmapTag::port) continue;
+                if (!any) { h.ports.clear(); any = true; }
+                h.ports.emplace_back();
+                nmap_extract_port(p, h.ports.back());
+            }
+            break;
+        }
+        case NmapTag::hostscript: {
+            bool any = false;
+            for (xmlNodePtr s = n->children; s; s = s->next) {
+                if (nmap_tag(s) != NmapTag::script) continue;
+                if (!any) { h.hostscripts.clear(); any = true; }
+                h.hostscripts.push_back(nmap_extract_script(s));
+            }
+            break;
+        }
+        case NmapTag::uptime: {
+            PropValue v[2];
+            read_props(n, k_nmap_uptime_keys, 2, v);
+            if (v[0] || v[1]) {
+                h.uptime_lastboot.reset();
+                h.uptime_seconds.reset();
+                opt_from(v[0], h.uptime_lastboot);
+                opt_from(v[1], h.uptime_seconds);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+// ---------- Run statistics (--stats / --progress) ----------
+// Cheap counters filled in by main(): per-stage wall time, a record-size
+// histogram and SQLite commit latencies, written as one JSON object at the
+// end. Stage times use one clock read per stage boundary, and only when
+// --stats is given. Each stage is written by exactly one thread (read/expand
+// by the reader, write/sizes by whoever runs emit), so no locking is needed.
+using StatClock = std::chrono::steady_clock;
+
+struct RunStats {
+    enum Stage { read, expand, convert, serialize, write, n_stages };
+    static constexpr size_t k_size_buckets = 27;  // <= 64 B ... <= 4 GB
+
+    bool enabled = false;
+    bool measured[n_stages] = {};
+    double seconds[n_stages] = {};
+    uint64_t records = 0;
+    uint64_t input_bytes = 0;
+    uint64_t size_hist[k_size_buckets] = {};
+    uint64_t size_min = UINT64_MAX, size_max = 0, size_total = 0, sized = 0;
+    std::vector<double> sqlite_commit_ms;
+    const RecordLimits* limits = nullptr;   // --max-record-bytes / --max-children
+    StatClock::time_point started = StatClock::now();
+
+    // adds the time since `since` to stage `s`; returns now for the next stage
+    StatClock::time_point add(Stage s, StatClock::time_point since) {
+        auto now = StatClock::now();
+        seconds[s] += std::chrono::duration<double>(now - since).count();
+        return now;
+    }
+
+    void record_size(size_t n) {
+        size_t b = 0;
+        while (b + 1 < k_size_buckets && n > (size_t(64) << b)) ++b;
+        ++size_hist[b];
+        size_min = std::min<uint64_t>(size_min, n);
+        size_max = std::max<uint64_t>(size_max, n);
+        size_total += n;
+        ++sized;
+    }
+};
+
+// --stats: libxml2's allocations, counted by routing xmlMalloc & co.
+// through these wrappers (see count_allocs)
+static void* counting_xml_malloc(size_t n) {
+    g_xml_allocs.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(n);
+}
+static void* counting_xml_realloc(void* p, size_t n) {
+    g_xml_allocs.fetch_add(1, std::memory_order_relaxed);
+    return std::realloc(p, n);
+}
+static char* counting_xml_strdup(const char* s) {
+    g_xml_allocs.fetch_add(1, std::memory_order_relaxed);
+    return strdup(s);
+}
+
+// start counting; call before the first libxml2 allocation to be counted
+static void count_allocs() {
+    xmlMemSetup(std::free, counting_xml_malloc, counting_xml_realloc, counting_xml_strdup);
+    g_count_allocs.store(true, std::memory_order_relaxed);
+}
+
+// nearest-rank percentile of a sorted vector
+static double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::min(sorted.size(), std::max<size_t>(1, rank)) - 1];
+}
+
+static bool write_stats_report(const std::string& path, const RunStats& st) {
+    static const char* const stage_names[RunStats::n_stages] = {"read", "expand", "convert", "serialize", "write"};
+    nlohmann::json j = nlohmann::json::object();
+    j["records"] = st.records;
+    j["input_bytes"] = st.input_bytes;
+    j["wall_s"] = std::chrono::duration<double>(StatClock::now() - st.started).count();
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) j["peak_rss_kb"] = (long)ru.ru_maxrss;
+
+    nlohmann::json stages = nlohmann::json::object();
+    for (int s = 0; s < RunStats::n_stages; ++s)
+        if (st.measured[s]) stages[stage_names[s]] = st.seconds[s];
+    j["stages_s"] = stages;
+
+    if (g_count_allocs.load(std::memory_order_relaxed)) {
+        const uint64_t cxx = g_cxx_allocs.load(), xml = g_xml_allocs.load();
+        j["allocs"] = {{"cxx", cxx}, {"libxml2", xml},
+                       {"per_record", st.records ? (double)(cxx + xml) / st.records : 0.0}};
+    }
+
+    if (st.sized) {
+        nlohmann::json hist = nlohmann::json::object();
+        for (size_t b = 0; b < RunStats::k_size_buckets; ++b)
+            if (st.size_hist[b]) hist[std::to_string(uint64_t(64) << b)] = st.size_hist[b];
+        j["record_bytes"] = {{"min", st.size_min}, {"max", st.size_max},
+                             {"mean", (double)st.size_total / st.sized}, {"histogram_le", hist}};
+    }
+    if (!st.sqlite_commit_ms.empty()) {
+        std::vector<double> v = st.sqlite_commit_ms;
+        std::sort(v.begin(), v.end());
+        j["sqlite_commit_ms"] = {{"batches", v.size()}, {"p50", percentile(v, 50)}, {"p90", percentile(v, 90)},
+                                 {"p99", percentile(v, 99)}, {"max", v.back()}};
+    }
+    if (const RecordLimits* l = st.limits) {
+        j["oversized"] = {{"records", l->records}, {"children_dropped", l->children_dropped},
+                          {"values_spilled", l->values_spilled}, {"bytes_spilled", l->bytes_spilled},
+                          {"record_numbers", l->listed}};
+        if (!l->spill_path.empty()) j["oversized"]["spill_file"] = l->spill_path;
+    }
+    std::ofstream f(path, std::ios::out | std::ios::trunc);
+    f << j.dump() << "\n";
+    return (bool)f;
+}
+
+// --progress: one status line on stderr about once a second. Rewritten in
+// place on a terminal, one line per update otherwise (log files).
+class Progress {
+public:
+    Progress(bool enabled, uint64_t total_bytes)
+        : enabled_(enabled), total_(total_bytes), tty_(isatty(STDERR_FILENO)) {}
+
+    // cheap enough to call per record: looks at the clock every 256 calls
+    bool due() {
+        if (!enabled_ || (++calls_ & 255)) return false;
+        auto now = StatClock::now();
+        if (now - last_ < std::chrono::seconds(1)) return false;
+        last_ = now;
+        return true;
+    }
+
+    // `bytes` = 0 when the input position is unknown (--chunked)
+    void report(uint64_t records, uint64_t bytes, bool final_line = false) {
+        if (!enabled_) return;
+        const double el = std::max(1e-9, std::chrono::duration<double>(StatClock::now() - start_).count());
+        char line[256];
+        int n = std::snprintf(line, sizeof(line), "[*] %llu records  %.0f rec/s", (unsigned long long)records, records / el);
+        if (bytes) {
+            n += std::snprintf(line + n, sizeof(line) - n, "  %.1f MB", bytes / 1e6);
+            if (total_) n += std::snprintf(line + n, sizeof(line) - n, " / %.1f MB (%.1f%%)", total_ / 1e6,
+                                           100.0 * std::min<uint64_t>(bytes, total_) / total_);
+            n += std::snprintf(line + n, sizeof(line) - n, "  %.1f MB/s", bytes / 1e6 / el);
+            if (total_ && bytes < total_ && !final_line) {
+                const unsigned long eta = (unsigned long)((total_ - bytes) / (bytes / el));
+                n += std::snprintf(line + n, sizeof(line) - n, "  ETA %lu:%02lu:%02lu", eta / 3600, eta / 60 % 60, eta % 60);
+            }
+        }
+        std::fprintf(stderr, tty_ ? "\r%s\033[K%s" : "%s%s", line, (final_line || !tty_) ? "\n" : "");
+        std::fflush(stderr);
+    }
+
+private:
+    const bool enabled_;
+    const uint64_t total_;
+    const bool tty_;
+    uint64_t calls_ = 0;
+    const StatClock::time_point start_ = StatClock::now();
+    StatClock::time_point last_ = start_;
+};
+
+// ---------- Record paths (--record-path / --record-tag) ----------
+// Which elements are records: paths like /nmaprun/host (from the document
+// element down), //host (anywhere; what --record-tag NAME means) or
+// //scan/*/host (`*` matches any one element). Each distinct record name
+// is a route: the record type that --record-path alternatives and
+// `{tag}` in the output names (-o, --mysql-table, --sqlite-table) refer to.
+//
+// A RecordMatcher holds the steps as the parser's interned name pointers
+// plus a stack of the open elements' names, so telling that an element is
+// not a record is a pointer compare on its local name. (Element names come
+// from the parser's dictionary; a qualified name is only the same entry
+// when looked up with xmlDictQLookup.)
+
+struct RecordPathStep {
+    std::string prefix, local, qname;       // qname "p:x" = prefix "p" + local "x"; "*" = any
+};
+
+struct RecordPath {
+    bool anywhere = false;                  // //...: may start below the document element
+    std::vector<RecordPathStep> steps;
+    size_t route = 0;
+};
+
+struct RecordPaths {
+    std::vector<RecordPath> paths;
+    std::vector<std::string> routes;        // record names, one per route
+
+    // only //name paths: records can be told by their name alone
+    bool names_only() const {
+        for (const RecordPath& p : paths)
+            if (!p.anywhere || p.steps.size() != 1) return false;
+        return true;
+    }
+};
+
+// Compiles --record-path and --record-tag (comma-separated lists; a tag T
+// is //T). False (with a message) on a malformed path.
+static bool compile_record_paths(const Options& opt, RecordPaths& rp) {
+    std::vector<std::string> specs;
+    if (!opt.record_path.empty()) specs = split_list(opt.record_path, ',');
+    if (!opt.record_tag.empty())
+        for (const std::string& t : split_list(opt.record_tag, ',')) specs.push_back("//" + t);
+    for (const std::string& spec : specs) {
+        RecordPath p;
+        std::string s = spec;
+        if (s.compare(0, 2, "//") == 0) { p.anywhere = true; s.erase(0, 2); }
+        else if (s.compare(0, 1, "/") == 0) s.erase(0, 1);
+        else p.anywhere = true;             // a bare name, as with --record-tag
+        bool ok = !s.empty();
+        for (const std::string& name : ok ? split_list(s, '/') : std::vector<std::string>()) {
+            RecordPathStep st;
+            st.qname = name;
+            const size_t colon = name.find(':');
+            st.local = colon == std::string::npos ? name : name.substr(colon + 1);
+            if (colon != std::string::npos) st.prefix = name.substr(0, colon);
+            if (name.empty() || st.local.empty() || (colon != std::string::npos && st.prefix.empty())) ok = false;
+            p.steps.push_back(std::move(st));
+        }
+        if (ok && p.steps.back().qname == "*") ok = false;
+        if (!ok) {
+            std::cerr << "[!] Invalid record path '" << spec << "' (expected /a/b, //b or a tag name; "
+                      << "the last step must be a name)\n";
+            return false;
+        }
+        const std::string& name = p.steps.back().qname;
+        auto it = std::find(rp.routes.begin(), rp.routes.end(), name);
+        p.route = (size_t)(it - rp.routes.begin());
+        if (it == rp.routes.end()) rp.routes.push_back(name);
+        rp.paths.push_back(std::move(p));
+    }
+    return true;
+}
+
+// `pattern` with every "{tag}" replaced by the route's record name (reduced
+// to [A-Za-z0-9_] when it names a table)
+static std::string route_target(const std::string& pattern, const std::string& tag, bool table) {
+    std::string name = tag;
+    if (table)
+        for (char& c : name)
+            if (!std::isalnum(static_cast<unsigned char>(c))) c = '_';
+    std::string out = pattern;
+    for (size_t pos; (pos = out.find("{tag}")) != std::string::npos;) out.replace(pos, 5, name);
+    return out;
+}
+
+class RecordMatcher {
+public:
+    // `dict`: the parser's dictionary (null: compare names as strings)
+    RecordMatcher(const RecordPaths& rp, xmlDictPtr dict) : by_value_(dict == nullptr) {
+        for (const RecordPath& p : rp.paths) {
+            Path c;
+            c.anywhere = p.anywhere;
+            c.route = (int)p.route;
+            for (const RecordPathStep& s : p.steps) {
+                Step st;
+                if (s.qname != "*") {
+                    const xmlChar* local = BAD_CAST s.local.c_str();
+                    const xmlChar* prefix = s.prefix.empty() ? nullptr : BAD_CAST s.prefix.c_str();
+                    if (dict) {
+                        st.local = xmlDictLookup(dict, local, -1);
+                        st.prefix = prefix ? xmlDictLookup(dict, prefix, -1) : nullptr;
+                        st.qname = prefix ? xmlDictQLookup(dict, prefix, local) : st.local;
+                    } else {
+                        st.local = local;
+                        st.prefix = prefix;
+                        st.qname = BAD_CAST s.qname.c_str();
+                    }
+                }
+                c.steps.push_back(st);
+            }
+            paths_.push_back(std::move(c));
+        }
+        open_.reserve(32);
+    }
+
+    // An element at `depth` (0 = document element) with its interned local
+    // name and prefix: the route of the first path it completes, or -1.
+    // It becomes the ancestor of whatever is matched below it next.
+    int match(size_t depth, const xmlChar* local, const xmlChar* prefix) {
+        if (open_.size() > depth) open_.resize(depth);
+        while (open_.size() < depth) open_.push_back({nullptr, nullptr});     // unseen ancestors
+        open_.push_back({local, prefix});
+        for (const Path& p : paths_) {
+            if (!is(p.steps.back(), open_.back())) continue;
+            const size_t n = p.steps.size();
+            if (p.anywhere ? open_.size() < n : open_.size() != n) continue;
+            const size_t base = open_.size() - n;
+            size_t i = 0;
+            while (i + 1 < n && is(p.steps[i], open_[base + i])) ++i;
+            if (i + 1 == n) return p.route;
+        }
+        return -1;
+    }
+
+private:
+    struct Step { const xmlChar* local = nullptr; const xmlChar* prefix = nullptr; const xmlChar* qname = nullptr; };
+    struct Path { bool anywhere = false; int route = 0; std::vector<Step> steps; };
+    struct Name { const xmlChar* local; const xmlChar* prefix; };
+
+    // an element with an unbound prefix keeps "p:x" as its local name
+    bool is(const Step& s, const Name& n) const {
+        if (!s.local) return n.local != nullptr;   // `*`
+        if (!n.local) return false;
+        if (by_value_)
+            return (xmlStrEqual(n.local, s.local) && xmlStrEqual(n.prefix, s.prefix)) ||
+                   (!n.prefix && s.prefix && xmlStrEqual(n.local, s.qname));
+        return (n.local == s.local && n.prefix == s.prefix) || (!n.prefix && s.prefix && n.local == s.qname);
+    }
+
+    const bool by_value_;
+    std::vector<Path> paths_;
+    std::vector<Name> open_;                // names of the open elements, from the document element
+};
+
+// ---------- Binary output (--format bson / msgpack / cbor) ----------
+// One binary document per record, back to back: a BSON stream is what
+// mongorestore reads from a .bson file, and MessagePack / CBOR values are
+// self-delimiting. The DOM path serializes with nlohmann's to_bson /
+// to_msgpack / to_cbor instead of dump(). The direct writers don't emit
+// binary themselves: they render their compact JSON as for jsonl, and that
+// text is transcoded in one pass. It holds only objects, arrays, strings
+// and null, with keys already sorted, so the bytes are the same as the DOM
+// path's; the extra pass (unescaping included) costs some 10-15% over
+// jsonl. Container headers are filled in when the container closes (BSON:
+// its byte length; MessagePack / CBOR: the entry count, widening a one-byte
+// header in place when the count needs more). Numbers or booleans (not
+// produced by the writers) send the record through the DOM.
+enum class BinaryFormat { none, bson, msgpack, cbor };
+
+static BinaryFormat binary_format(const std::string& f) {
+    if (f == "bson") return BinaryFormat::bson;
+    if (f == "msgpack") return BinaryFormat::msgpack;
+    if (f == "cbor") return BinaryFormat::cbor;
+    return BinaryFormat::none;
+}
+
+class BinaryTranscoder {
+public:
+    // false when `in` holds something the fast path doesn't handle
+    bool run(BinaryFormat f, const std::string& in, std::string& out) {
+        p_ = in.data();
+        end_ = p_ + in.size();
+        out_ = &out;
+        const bool ok = f == BinaryFormat::bson ? (p_ < end_ && *p_ == '{' && bson_doc(false))
+                                                 : value(f == BinaryFormat::cbor);
+        return ok && p_ == end_;
+    }
+
+private:
+    // JSON string at p_ -> [s, s + n): the input span itself unless it has escapes
+    // Escaped JSON has no raw control characters, so the escaper's SIMD
+    // scan stops exactly at the closing quote or the next backslash.
+    bool string(const char*& s, size_t& n) {
+        if (p_ >= end_ || *p_ != '"') return false;
+        const char* b = ++p_;
+        p_ += scan_(p_, (size_t)(end_ - p_));
+        if (p_ >= end_) return false;
+        if (*p_ == '"') { s = b; n = (size_t)(p_++ - b); return true; }
+        str_.assign(b, p_);
+        while (p_ < end_ && *p_ != '"') {
+            if (*p_ != '\\') {
+                const size_t k = std::max<size_t>(1, scan_(p_, (size_t)(end_ - p_)));
+                str_.append(p_, k);
+                p_ += k;
+                continue;
+            }
+            if (++p_ >= end_) return false;
+            switch (*p_++) {
+            case '"':  str_ += '"'; break;
+            case '\\': str_ += '\\'; break;
+            case '/':  str_ += '/'; break;
+            case 'b':  str_ += '\b'; break;
+            case 'f':  str_ += '\f'; break;
+            case 'n':  str_ += '\n'; break;
+            case 'r':  str_ += '\r'; break;
+            case 't':  str_ += '\t'; break;
+            case 'u': {
+                unsigned cp;
+                if (!hex4(cp)) return false;
+                if (cp >= 0xD800 && cp <= 0xDBFF) {
+                    unsigned lo;
+                    if (end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u') return false;
+                    p_ += 2;
+                    if (!hex4(lo) || lo < 0xDC00 || lo > 0xDFFF) return false;
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                    return false;
+                }
+                utf8(cp);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        if (p_ >= end_) return false;
+        ++p_;
+        s = str_.data();
+        n = str_.size();
+        return true;
+    }
+
+    bool hex4(unsigned& v) {
+        if (end_ - p_ < 4) return false;
+        v = 0;
+        for (int i = 0; i < 4; ++i) {
+            const char c = *p_++;
+            v <<= 4;
+            if (c >= '0' && c <= '9') v |= (unsigned)(c - '0');
+            else if (c >= 'a' && c <= 'f') v |= (unsigned)(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') v |= (unsigned)(c - 'A' + 10);
+            else return false;
+        }
+        return true;
+    }
+
+    void utf8(unsigned cp) {
+        if (cp < 0x80) { str_ += (char)cp; return; }
+        if (cp < 0x800) { str_ += (char)(0xC0 | (cp >> 6)); }
+        else {
+            if (cp < 0x10000) { str_ += (char)(0xE0 | (cp >> 12)); }
+            else { str_ += (char)(0xF0 | (cp >> 18)); str_ += (char)(0x80 | ((cp >> 12) & 0x3F)); }
+            str_ += (char)(0x80 | ((cp >> 6) & 0x3F));
+        }
+        str_ += (char)(0x80 | (cp & 0x3F));
+    }
+
+    bool null() {
+        if (end_ - p_ < 4 || std::memcmp(p_, "null", 4) != 0) return false;
+        p_ += 4;
+        return true;
+    }
+
+    void be(uint64_t v, int bytes) {
+        for (int i = bytes - 1; i >= 0; --i) *out_ += (char)(v >> (8 * i));
+    }
+
+    // MessagePack / CBOR header: `fix` (+n) up to `fix_max`, else `wide`
+    // followed by the smallest of 1 (CBOR only), 2, 4 or 8 bytes
+    void header(size_t n, unsigned fix, size_t fix_max, unsigned wide, bool cbor) {
+        if (n <= fix_max) { *out_ += (char)(fix | n); return; }
+        if (cbor && n <= 0xFF) { *out_ += (char)wide; be(n, 1); return; }
+        if (n <= 0xFFFF) { *out_ += (char)(wide + (cbor ? 1 : 0)); be(n, 2); return; }
+        if (n <= 0xFFFFFFFFu || !cbor) { *out_ += (char)(wide + (cbor ? 2 : 1)); be(n, 4); return; }
+        *out_ += (char)(wide + 3);
+        be(n, 8);
+    }
+
+    void put_string(const char* s, size_t n, bool cbor) {
+        if (cbor) header(n, 0x60, 0x17, 0x78, true);
+        else if (n <= 31) *out_ += (char)(0xA0 | n);
+        else if (n <= 0xFF) { *out_ += (char)0xD9; be(n, 1); }
+        else header(n, 0, 0, 0xDA, false);
+        out_->append(s, n);
+    }
+
+    // MessagePack / CBOR value
+    bool value(bool cbor) {
+        if (p_ >= end_) return false;
+        const char c = *p_;
+        if (c == '"') {
+            const char* s; size_t n;
+            if (!string(s, n)) return false;
+            put_string(s, n, cbor);
+            return true;
+        }
+        if (c == 'n') {
+            if (!null()) return false;
+            *out_ += (char)(cbor ? 0xF6 : 0xC0);
+            return true;
+        }
+        if (c != '{' && c != '[') return false;
+        const bool obj = (c == '{');
+        const size_t at = out_->size();
+        out_->push_back(0);                 // the header; widened below if needed
+        size_t n = 0;
+        ++p_;
+        if (p_ < end_ && *p_ == (obj ? '}' : ']')) ++p_;
+        else {
+            for (;;) {
+                if (obj) {
+                    const char* s; size_t len;
+                    if (!string(s, len) || p_ >= end_ || *p_++ != ':') return false;
+                    put_string(s, len, cbor);
+                }
+                if (!value(cbor)) return false;
+                ++n;
+                if (p_ >= end_) return false;
+                const char d = *p_++;
+                if (d == (obj ? '}' : ']')) break;
+                if (d != ',') return false;
+            }
+        }
+        std::string hdr;
+        std::swap(hdr, *out_);
+        if (cbor) header(n, obj ? 0xA0 : 0x80, 0x17, obj ? 0xB8 : 0x98, true);
+        else header(n, obj ? 0x80 : 0x90, 0x0F, obj ? 0xDE : 0xDC, false);
+        std::swap(hdr, *out_);
+        out_->replace(at, 1, hdr);
+        return true;
+    }
+
+    // BSON document / array at p_, with its int32 size in front
+    bool bson_doc(bool array) {
+        const size_t at = out_->size();
+        out_->append(4, '\0');
+        ++p_;
+        size_t i = 0;
+        if (p_ < end_ && *p_ == (array ? ']' : '}')) ++p_;
+        else {
+            for (;;) {
+                const char* k; size_t kn;
+                if (array) {
+                    key_ = std::to_string(i);
+                    k = key_.data(); kn = key_.size();
+                } else {
+                    if (!string(k, kn) || p_ >= end_ || *p_++ != ':') return false;
+                    if (std::memchr(k, 0, kn)) return false;
+                }
+                if (p_ >= end_) return false;
+                const char c = *p_;
+                const char type = c == '"' ? 0x02 : c == '{' ? 0x03 : c == '[' ? 0x04 : c == 'n' ? 0x0A : 0;
+                if (!type) return false;
+                *out_ += type;
+                out_->append(k, kn);
+                *out_ += '\0';
+                if (type == 0x02) {
+                    const char* s; size_t n;
+                    if (!string(s, n)) return false;
+                    le32(out_->size(), (uint32_t)n + 1);
+                    out_->append(s, n);
+                    *out_ += '\0';
+                } else if (type == 0x0A) {
+                    if (!null()) return false;
+                } else if (!bson_doc(type == 0x04)) {
+                    return false;
+                }
+                ++i;
+                if (p_ >= end_) return false;
+                const char d = *p_++;
+                if (d == (array ? ']' : '}')) break;
+                if (d != ',') return false;
+            }
+        }
+        *out_ += '\0';
+        const uint32_t size = (uint32_t)(out_->size() - at);
+        for (int b = 0; b < 4; ++b) (*out_)[at + b] = (char)(size >> (8 * b));
+        return true;
+    }
+
+    // append a little-endian int32 (`pos` is where it goes: the end)
+    void le32(size_t pos, uint32_t v) {
+        out_->resize(pos + 4);
+        for (int b = 0; b < 4; ++b) (*out_)[pos + b] = (char)(v >> (8 * b));
+    }
+
+    const SpanScanFn scan_ = escape_kernels().json;
+    const char* p_ = nullptr;
+    const char* end_ = nullptr;
+    std::string* out_ = nullptr;
+    std::string str_, key_;                 // unescaped strings, BSON array keys
+};
+
+// The direct writers' JSON text -> `f`, in place (a no-op for text formats)
+static void record_encode(BinaryFormat f, std::string& json) {
+    if (f == BinaryFormat::none) return;
+    thread_local BinaryTranscoder tc;
+    thread_local std::string out;           // swapped with `json`: buffers are recycled
+    out.clear();
+    if (!tc.run(f, json, out)) {
+        const nlohmann::json j = nlohmann::json::parse(json);
+        out.clear();
+        if (f == BinaryFormat::bson) nlohmann::json::to_bson(j, out);
+        else if (f == BinaryFormat::msgpack) nlohmann::json::to_msgpack(j, out);
+        else nlohmann::json::to_cbor(j, out);
+    }
+    json.swap(out);
+}
+
+// ---------- Incremental Nmap runs (--delta) ----------
+// Daily rescans of the same address space mostly repeat yesterday's hosts.
+// With --delta INDEX each <host> is fingerprinted: its address (the first
+// ipv4/ipv6 one, else the first of any type) and a 64-bit FNV-1a hash of
+// its normalized JSON without the fields that change on every scan
+// (starttime, uptime). Hosts whose fingerprint matches INDEX are dropped
+// before they are converted; new and changed ones are written as usual.
+// After a complete run, hosts of INDEX the input no longer has go to a
+// tombstone file as {"_tag":"host_removed","address":...} lines, and INDEX
+// is replaced (atomically) by this run's hosts. Hosts without an address
+// are always written and never indexed.
+//
+// The index file is "XSDELTA1" followed by one entry per host: the hash
+// (8 bytes, little endian), the address length (2 bytes) and the address.
+
+// temporary + fsync + rename; false (with a message) on failure
+static bool write_file_atomic(const std::string& path, const std::string& data) {
+    const std::string tmp = path + ".tmp";
+    const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0;
+    for (size_t off = 0; ok && off < data.size();) {
+        const ssize_t w = ::write(fd, data.data() + off, data.size() - off);
+        if (w < 0 && errno == EINTR) continue;
+        ok = w > 0;
+        if (ok) off += (size_t)w;
+    }
+    if (fd >= 0) {
+        ok = ok && fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+    }
+    if (ok && std::rename(tmp.c_str(), path.c_str()) != 0) ok = false;
+    if (!ok) {
+        std::cerr << "[!] Failed to write " << path << "\n";
+        ::unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+static uint64_t fnv1a64(const char* p, size_t n) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// the host's address and content hash; `key` stays empty without an address.
+// The hash covers the compact JSON without "starttime" and "uptime". Given
+// the host's full rendering (`full`, from nmap_host_write_json with every
+// field), those two top-level members are cut out of it instead of
+// rendering the host a second time; the bytes hashed are the same.
+static void nmap_host_fingerprint(xmlNodePtr host, const std::string* full, std::string& key, uint64_t& hash) {
+    static const FieldTree stable = [] {
+        FieldTree f;
+        for (const char* k : {"addresses", "hostnames", "hostscripts", "ports", "status"}) f.add({k});
+        return f;
+    }();
+    thread_local std::string body;
+    body.clear();
+    if (full) {
+        // "_tag" comes first, so a dropped member always has a ',' before it
+        const std::string& s = *full;
+        size_t from = 0;
+        for (size_t i = 1; i < s.size() && s[i] == '"';) {
+            const size_t k = json_string_end(s, i);
+            const size_t e = json_value_end(s, k + 1);
+            if (s.compare(i, k - i, "\"starttime\"") == 0 || s.compare(i, k - i, "\"uptime\"") == 0) {
+                body.append(s, from, i - 1 - from);
+                from = e;
+            }
+            i = e + 1;
+        }
+        body.append(s, from, std::string::npos);
+    } else {
+        nmap_host_write_json(host, body, stable);
+    }
+    hash = fnv1a64(body.data(), body.size());
+
+    key.clear();
+    bool ip = false;
+    for (xmlNodePtr n = host->children; n && !ip; n = n->next) {
+        if (nmap_tag(n) != NmapTag::address) continue;
+        PropValue v[2];
+        read_props(n, k_nmap_addr_keys, 2, v);
+        if (!v[0]) continue;
+        ip = v[1] && (xmlStrEqual(v[1].value, BAD_CAST "ipv4") || xmlStrEqual(v[1].value, BAD_CAST "ipv6"));
+        if (ip || key.empty()) key.assign(reinterpret_cast<const char*>(v[0].value));
+    }
+}
+
+class DeltaIndex {
+public:
+    // the previous run's index; a missing file is an empty one (first run)
+    bool load(const std::string& path) {
+        struct stat sb;
+        if (::stat(path.c_str(), &sb) != 0 && errno == ENOENT) return true;
+        std::ifstream f(path, std::ios::binary);
+        if (!f) return report(path, "cannot be read");
+        const std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        if (data.compare(0, 8, k_magic, 8) != 0) return report(path, "is not a --delta index");
+        for (size_t p = 8; p < data.size();) {
+            if (data.size() - p < 10) return report(path, "is truncated");
+            const unsigned char* e = reinterpret_cast<const unsigned char*>(data.data() + p);
+            uint64_t h = 0;
+            for (int i = 7; i >= 0; --i) h = h << 8 | e[i];
+            const size_t len = (size_t)e[8] | (size_t)e[9] << 8;
+            if (data.size() - p - 10 < len) return report(path, "is truncated");
+            prev_.emplace(data.substr(p + 10, len), h);
+            p += 10 + len;
+        }
+        return true;
+    }
+
+    // read-only during the run, so any conversion thread may ask
+    bool unchanged(const std::string& key, uint64_t hash) const {
+        auto it = prev_.find(key);
+        return it != prev_.end() && it->second == hash;
+    }
+
+    // the writing thread: adds the host to this run's index; false when
+    // it is unchanged since the last run (and not to be written)
+    bool note(const std::string& key, uint64_t hash) {
+        next_[key] = hash;
+        auto it = prev_.find(key);
+        if (it == prev_.end()) { ++added; return true; }
+        if (it->second == hash) { ++same; return false; }
+        ++changed;
+        return true;
+    }
+
+    // f(address) for each host of the last run this one didn't see
+    template <class F> void for_each_removed(F f) {
+        for (const auto& e : prev_)
+            if (!next_.count(e.first)) { ++removed; f(e.first); }
+    }
+
+    bool save(const std::string& path) const {
+        std::string data(k_magic, 8);
+        data.reserve(8 + next_.size() * 24);
+        for (const auto& e : next_) {
+            const size_t len = std::min<size_t>(e.first.size(), 0xffff);
+            for (int i = 0; i < 8; ++i) data += (char)(e.second >> (8 * i));
+            data += (char)(len & 0xff);
+            data += (char)(len >> 8);
+            data.append(e.first, 0, len);
+        }
+        return write_file_atomic(path, data);
+    }
+
+    uint64_t added = 0, changed = 0, same = 0, removed = 0;
+
+private:
+    static constexpr const char* k_magic = "XSDELTA1";
+
+    static bool report(const std::string& path, const char* what) {
+        std::cerr << "[!] --delta: " << path << " " << what << "\n";
+        return false;
+    }
+
+    std::unordered_map<std::string, uint64_t> prev_, next_;
+};
+
+// ---------- Output sharding (--shard-by / --shards) ----------
+// --shard-by PATH picks one value per record -- the first string or scalar
+// at a dot path of its JSON, as in --fields (addresses.addr, ports.state,
+// _tag) -- and routes the record by it: with --shards N to output
+// hash(value) % N, without it to an output per distinct value. A "/BITS"
+// suffix first reduces an IPv4 value to its network (addresses.addr/16:
+// 10.1.2.3 -> 10.1.0.0/16). Every shard is an output of its own ({shard}
+// in -o / --sqlite-db, or the shard name before the extension) with its
+// own buffer, INSERT writers or SQLite connection. Without --shards, a run
+// fails once more than --max-shards values (or more than the open file
+// limit allows) have turned up, rather than open one file per address of a
+// high-cardinality path. With --threads, a pool of at most that many writer
+// threads writes the shards, shard i always on writer i % pool, so every
+// shard keeps its record order. Values are taken as they appear
+// in the JSON text (escapes kept); records without one go to shard
+// "none" (hash mode: hash of the empty string).
+
+struct ShardSpec {
+    std::vector<std::string> path;
+    FieldTree fields;                       // just `path`, for rendering structured records
+    int prefix_bits = -1;                   // "/BITS" (-1: the value as is)
+    size_t count = 0;                       // --shards N (0: a shard per value)
+};
+
+// false (with a message) on a malformed --shard-by
+static bool parse_shard_spec(const Options& opt, ShardSpec& spec) {
+    std::string p = opt.shard_by;
+    const size_t slash = p.rfind('/');
+    if (slash != std::string::npos) {
+        const std::string bits = p.substr(slash + 1);
+        char* end = nullptr;
+        const long b = std::strtol(bits.c_str(), &end, 10);
+        if (bits.empty() || *end || b < 0 || b > 32) {
+            std::cerr << "[!] Invalid --shard-by prefix '/" << bits << "' (0-32)\n";
+            return false;
+        }
+        spec.prefix_bits = (int)b;
+        p.resize(slash);
+    }
+    if (!parse_field_path(p, spec.path)) {
+        std::cerr << "[!] Invalid --shard-by path '" << p << "'\n";
+        return false;
+    }
+    spec.fields.add(spec.path);
+    spec.count = opt.shards;
+    return true;
+}
+
+// Finds the first value at a dot path of compact or pretty JSON, going
+// through lists entry by entry. Strings come back without their quotes,
+// other scalars as written; objects and lists are not values.
+class JsonPathScanner {
+public:
+    bool find(const char* p, size_t n, const std::vector<std::string>& path, std::string& out) {
+        p_ = p;
+        end_ = p + n;
+        path_ = &path;
+        out_ = &out;
+        found_ = false;
+        value(0);
+        return found_;
+    }
+
+private:
+    void ws() { while (p_ < end_ && (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t')) ++p_; }
+
+    // a string at p_ -> [s, s + len), raw; false if malformed
+    bool string(const char*& s, size_t& len) {
+        if (p_ >= end_ || *p_ != '"') return false;
+        s = ++p_;
+        while (p_ < end_ && *p_ != '"') p_ += *p_ == '\\' ? 2 : 1;
+        if (p_ >= end_) return false;
+        len = (size_t)(p_++ - s);
+        return true;
+    }
+
+    // walks the value at p_; `depth` path segments have matched so far.
+    // false stops the scan (found, or malformed)
+    bool value(size_t depth) {
+        ws();
+        if (p_ >= end_) return false;
+        const bool want = depth == path_->size();
+        if (*p_ == '{') {
+            ++p_;
+            for (ws(); p_ < end_ && *p_ != '}';) {
+                const char* k;
+                size_t kn;
+                if (!string(k, kn)) return false;
+                ws();
+                if (p_ >= end_ || *p_++ != ':') return false;
+                const bool on_path = !want && depth < path_->size() && (*path_)[depth].size() == kn &&
+                                     std::memcmp((*path_)[depth].data(), k, kn) == 0;
+                if (!value(on_path ? depth + 1 : path_->size() + 1)) return false;
+                ws();
+                if (p_ < end_ && *p_ == ',') { ++p_; ws(); }
+            }
+            ++p_;
+            return true;
+        }
+        if (*p_ == '[') {
+            ++p_;
+            for (ws(); p_ < end_ && *p_ != ']';) {
+                if (!value(depth)) return false;        // a list is transparent
+                ws();
+                if (p_ < end_ && *p_ == ',') { ++p_; ws(); }
+            }
+            ++p_;
+            return true;
+        }
+        const char* s = p_;
+        size_t len;
+        if (*p_ == '"') {
+            if (!string(s, len)) return false;
+        } else {
+            while (p_ < end_ && *p_ != ',' && *p_ != '}' && *p_ != ']' && *p_ != ' ' && *p_ != '\n') ++p_;
+            len = (size_t)(p_ - s);
+        }
+        if (want) {
+            out_->assign(s, len);
+            found_ = true;
+            return false;
+        }
+        return true;
+    }
+
+    const char* p_ = nullptr;
+    const char* end_ = nullptr;
+    const std::vector<std::string>* path_ = nullptr;
+    std::string* out_ = nullptr;
+    bool found_ = false;
+};
+
+// the shard value of a record rendered as `json` (before binary encoding)
+static void shard_key_from_json(const ShardSpec& spec, const std::string& json, std::string& key) {
+    thread_local JsonPathScanner scan;
+    key.clear();
+    if (!scan.find(json.data(), json.size(), spec.path, key)) return;
+    if (spec.prefix_bits < 0) return;
+    unsigned a[4];
+    char tail;
+    if (std::sscanf(key.c_str(), "%u.%u.%u.%u%c", &a[0], &a[1], &a[2], &a[3], &tail) != 4 ||
+        a[0] > 255 || a[1] > 255 || a[2] > 255 || a[3] > 255)
+        return;                             // not IPv4: the whole value
+    uint32_t ip = a[0] << 24 | a[1] << 16 | a[2] << 8 | a[3];
+    if (spec.prefix_bits < 32) ip &= spec.prefix_bits ? ~0u << (32 - spec.prefix_bits) : 0u;
+    key = std::to_string(ip >> 24) + "." + std::to_string((ip >> 16) & 255) + "." + std::to_string((ip >> 8) & 255) +
+          "." + std::to_string(ip & 255) + "/" + std::to_string(spec.prefix_bits);
+}
+
+// a shard's output: {shard} in `pattern` replaced, or the name inserted
+// before the file extension (scan.jsonl -> scan.3.jsonl)
+static std::string shard_target(const std::string& pattern, const std::string& name) {
+    std::string out = pattern;
+    if (out.find("{shard}") != std::string::npos) {
+        for (size_t pos; (pos = out.find("{shard}")) != std::string::npos;) out.replace(pos, 7, name);
+        return out;
+    }
+    const size_t base = out.rfind('/') == std::string::npos ? 0 : out.rfind('/') + 1;
+    const size_t dot = out.rfind('.');
+    if (dot == std::string::npos || dot <= base) return out + "." + name;
+    return out.insert(dot, "." + name);
+}
+
+// a shard value as a file name part
+static std::string shard_name(const std::string& value) {
+    if (value.empty()) return "none";
+    std::string name = value;
+    for (char& c : name)
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-') c = '_';
+    return name;
+}
+
+// ---------- Typed output (--infer-schema / --schema-file) ----------
+// The writers produce strings only, and a child is a list only in records
+// that happen to repeat it. --infer-schema N samples the first N records of
+// -i FILE in a pre-pass and works out, per key path, the type of the values
+// seen there and whether it is ever a list or an object. Records are then
+// rewritten to match: values of boolean / integer / number paths lose their
+// quotes ("" becomes null), list paths are always lists, and a bare text
+// value where other records have an object becomes {"#text": ...}. A value
+// the sample didn't prepare for (say "n/a" on an integer path) stays a
+// string, so nothing is lost. Numbers are only inferred when a double holds
+// them exactly (at most 15 significant digits) and are written the way
+// json::dump() writes the double, so --dom output stays byte-identical.
+// --schema-file FILE saves the result (with --infer-schema) or loads it
+// instead of sampling. Nmap mode starts from the integers the Python
+// converter reads with safe_int (ports.portid, uptime.seconds).
+
+struct TypeNode {
+    enum Kind : uint8_t { none, boolean, integer, number, string };
+    Kind kind = none;                       // of the (non-empty) scalar values seen here
+    bool array = false;                     // a list in some record
+    bool object = false;                    // an object in some record
+    std::map<std::string, TypeNode, std::less<>> keys;
+
+    const TypeNode* get(std::string_view k) const {
+        auto it = keys.find(k);
+        return it == keys.end() ? nullptr : &it->second;
+    }
+};
+
+static const char* const k_kind_names[] = {"none", "boolean", "integer", "number", "string"};
+
+static TypeNode::Kind scalar_kind(const char* s, size_t n) {
+    if ((n == 4 && std::memcmp(s, "true", 4) == 0) || (n == 5 && std::memcmp(s, "false", 5) == 0))
+        return TypeNode::boolean;
+    // JSON number grammar, counting significant digits
+    size_t i = 0, digits = 0;
+    if (i < n && s[i] == '-') ++i;
+    if (i >= n || !std::isdigit((unsigned char)s[i])) return TypeNode::string;
+    if (s[i] == '0' && i + 1 < n && std::isdigit((unsigned char)s[i + 1])) return TypeNode::string;
+    bool integral = true;
+    for (; i < n && std::isdigit((unsigned char)s[i]); ++i) if (digits || s[i] != '0') ++digits;
+    if (i < n && s[i] == '.') {
+        integral = false;
+        if (++i >= n || !std::isdigit((unsigned char)s[i])) return TypeNode::string;
+        for (; i < n && std::isdigit((unsigned char)s[i]); ++i) if (digits || s[i] != '0') ++digits;
+    }
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+        integral = false;
+        if (++i < n && (s[i] == '+' || s[i] == '-')) ++i;
+        if (i >= n || !std::isdigit((unsigned char)s[i])) return TypeNode::string;
+        while (i < n && std::isdigit((unsigned char)s[i])) ++i;
+    }
+    if (i != n) return TypeNode::string;
+    if (integral) {
+        if (digits == 0 && s[0] == '-') return TypeNode::string;   // "-0" would print as 0
+        if (digits <= 18) return TypeNode::integer;                 // fits int64 as written
+    }
+    return digits <= 15 ? TypeNode::number : TypeNode::string;
+}
+
+static TypeNode::Kind merge_kind(TypeNode::Kind a, TypeNode::Kind b) {
+    if (a == TypeNode::none || a == b) return b;
+    if (b == TypeNode::none) return a;
+    if ((a == TypeNode::integer && b == TypeNode::number) || (a == TypeNode::number && b == TypeNode::integer))
+        return TypeNode::number;
+    return TypeNode::string;
+}
+
+// does the raw string fit a path of kind `k`?
+static bool kind_accepts(TypeNode::Kind k, const char* s, size_t n) {
+    const TypeNode::Kind v = scalar_kind(s, n);
+    return v == k || (k == TypeNode::number && v == TypeNode::integer);
+}
+
+static void schema_observe(TypeNode& t, const nlohmann::json& v) {
+    if (v.is_array()) {
+        t.array = true;
+        for (const auto& e : v) schema_observe(t, e);     // a list is transparent
+    } else if (v.is_object()) {
+        t.object = true;
+        for (auto it = v.begin(); it != v.end(); ++it) schema_observe(t.keys[it.key()], it.value());
+    } else if (v.is_string()) {
+        const std::string& s = v.get_ref<const std::string&>();
+        if (!s.empty()) t.kind = merge_kind(t.kind, scalar_kind(s.data(), s.size()));
+    }
+}
+
+// after sampling: text seen where objects are too is their "#text"
+static void schema_settle(TypeNode& t) {
+    if (t.object && t.kind != TypeNode::none) {
+        TypeNode& txt = t.keys["#text"];
+        txt.kind = merge_kind(txt.kind, t.kind);
+        t.kind = TypeNode::none;
+    }
+    for (auto& k : t.keys) schema_settle(k.second);
+}
+
+static nlohmann::json schema_to_json(const TypeNode& t) {
+    nlohmann::json j = nlohmann::json::object();
+    if (t.kind != TypeNode::none) j["type"] = k_kind_names[t.kind];
+    if (t.array) j["array"] = true;
+    if (t.object) j["object"] = true;
+    if (!t.keys.empty()) {
+        nlohmann::json& keys = j["keys"] = nlohmann::json::object();
+        for (const auto& k : t.keys) keys[k.first] = schema_to_json(k.second);
+    }
+    return j;
+}
+
+static void schema_from_json(const nlohmann::json& j, TypeNode& t) {
+    const std::string kind = j.value("type", std::string());
+    for (int k = 0; k < 5; ++k)
+        if (kind == k_kind_names[k]) t.kind = (TypeNode::Kind)k;
+    t.array = t.array || j.value("array", false);
+    t.object = t.object || j.value("object", false);
+    if (j.contains("keys"))
+        for (auto it = j["keys"].begin(); it != j["keys"].end(); ++it) schema_from_json(it.value(), t.keys[it.key()]);
+}
+
+// a typed scalar as JSON text; false when `s` doesn't fit `k` (left a string)
+static bool typed_scalar(TypeNode::Kind k, const char* s, size_t n, std::string& out) {
+    if (k == TypeNode::none || k == TypeNode::string) return false;
+    if (n == 0) { out += "null"; return true; }
+    if (!kind_accepts(k, s, n)) return false;
+    if (k == TypeNode::number) out += nlohmann::json(std::strtod(std::string(s, n).c_str(), nullptr)).dump();
+    else out.append(s, n);
+    return true;
+}
+
+// Rewrites the writers' compact JSON to the schema (see above); false on
+// input it doesn't understand, which is then left alone.
+class TypedJsonRewriter {
+public:
+    bool run(const TypeNode& root, const std::string& in, std::string& out) {
+        p_ = in.data();
+        end_ = p_ + in.size();
+        out_ = &out;
+        return value(&root) && p_ == end_;
+    }
+
+private:
+    // a raw string span at p_ (escapes kept)
+    bool string(const char*& s, size_t& n) {
+        if (p_ >= end_ || *p_ != '"') return false;
+        s = ++p_;
+        while (p_ < end_ && *p_ != '"') p_ += *p_ == '\\' ? 2 : 1;
+        if (p_ >= end_) return false;
+        n = (size_t)(p_++ - s);
+        return true;
+    }
+
+    // one value; lists at `t` are entered without wrapping again
+    bool value(const TypeNode* t) {
+        if (p_ >= end_) return false;
+        const bool wrap = t && t->array && *p_ != '[';
+        if (wrap) *out_ += '[';
+        if (!item(t)) return false;
+        if (wrap) *out_ += ']';
+        return true;
+    }
+
+    bool item(const TypeNode* t) {
+        switch (*p_) {
+        case '[':
+            *out_ += *p_++;
+            while (p_ < end_ && *p_ != ']') {
+                if (!item(t)) return false;
+                if (p_ < end_ && *p_ == ',') *out_ += *p_++;
+            }
+            if (p_ >= end_) return false;
+            *out_ += *p_++;
+            return true;
+        case '{':
+            *out_ += *p_++;
+            while (p_ < end_ && *p_ != '}') {
+                const char* k;
+                size_t kn;
+                if (!string(k, kn) || p_ >= end_ || *p_ != ':') return false;
+                out_->append(k - 1, kn + 2);
+                *out_ += *p_++;
+                if (!value(t ? t->get(std::string_view(k, kn)) : nullptr)) return false;
+                if (p_ < end_ && *p_ == ',') *out_ += *p_++;
+            }
+            if (p_ >= end_) return false;
+            *out_ += *p_++;
+            return true;
+        case '"': {
+            const char* s;
+            size_t n;
+            if (!string(s, n)) return false;
+            const bool wrap = t && t->object;
+            if (wrap) {
+                *out_ += "{\"#text\":";
+                t = t->get("#text");
+            }
+            if (!t || !typed_scalar(t->kind, s, n, *out_)) out_->append(s - 1, n + 2);
+            if (wrap) *out_ += '}';
+            return true;
+        }
+        default:
+            // null (or an already typed scalar)
+            while (p_ < end_ && *p_ != ',' && *p_ != '}' && *p_ != ']') *out_ += *p_++;
+            return true;
+        }
+    }
+
+    const char* p_ = nullptr;
+    const char* end_ = nullptr;
+    std::string* out_ = nullptr;
+};
+
+static void apply_types(const TypeNode& root, std::string& json) {
+    thread_local TypedJsonRewriter rw;
+    thread_local std::string out;           // swapped with `json`: buffers are recycled
+    out.clear();
+    if (rw.run(root, json, out)) json.swap(out);
+}
+
+// the same on a DOM record
+static void apply_types(const TypeNode& t, nlohmann::json& v, bool in_list = false) {
+    if (v.is_array()) {
+        for (auto& e : v) apply_types(t, e, true);
+        return;
+    }
+    if (v.is_object()) {
+        for (auto it = v.begin(); it != v.end(); ++it)
+            if (const TypeNode* c = t.get(it.key())) apply_types(*c, it.value());
+    } else if (v.is_string()) {
+        const TypeNode* k = t.object ? t.get("#text") : &t;
+        const std::string& s = v.get_ref<const std::string&>();
+        std::string typed;
+        nlohmann::json nv = k && typed_scalar(k->kind, s.data(), s.size(), typed) ? nlohmann::json::parse(typed) : v;
+        if (t.object) v = nlohmann::json{{"#text", std::move(nv)}};
+        else v = std::move(nv);
+    }
+    if (t.array && !in_list) v = nlohmann::json::array({std::move(v)});
+}
+
+// Nmap fields typed without sampling (as the Python converter does)
+static void schema_seed_nmap(TypeNode& root) {
+    root.object = true;
+    TypeNode& ports = root.keys["ports"];
+    ports.array = ports.object = true;
+    ports.keys["portid"].kind = TypeNode::integer;
+    TypeNode& up = root.keys["uptime"];
+    up.object = true;
+    up.keys["seconds"].kind = TypeNode::integer;
+}
+
+// The --infer-schema pre-pass: the first `opt.infer_sample` records read
+// from `r` (-i FILE, opened as the run opens it) as the writers render
+// them. Takes `r` (nullptr: the open failed, already reported); false
+// (with a message) if it yields no record.
+static bool infer_schema(const Options& opt, xmlTextReaderPtr r, TypeNode& root) {
+    if (!r) return false;
+    std::unique_ptr<RecordMatcher> matcher;
+    std::string json;
+    size_t seen = 0;
+    int ret = xmlTextReaderRead(r);
+    while (ret == 1 && seen < opt.infer_sample) {
+        if (!matcher) {
+            const xmlNodePtr node = xmlTextReaderCurrentNode(r);
+            matcher.reset(new RecordMatcher(*opt.records, node && node->doc ? node->doc->dict : nullptr));
+        }
+        const int route = xmlTextReaderNodeType(r) != XML_READER_TYPE_ELEMENT ? -1
+                        : matcher->match((size_t)std::max(0, xmlTextReaderDepth(r)),
+                                         xmlTextReaderConstLocalName(r), xmlTextReaderConstPrefix(r));
+        if (route < 0) {
+            ret = xmlTextReaderRead(r);
+            continue;
+        }
+        xmlNodePtr node = xmlTextReaderExpand(r);
+        if (node && node->type == XML_ELEMENT_NODE) {
+            RecordArena::Scope arena_scope;
+            json.clear();
+            if (opt.mode == "nmap" && xmlStrEqual(node->name, BAD_CAST "host")) nmap_host_write_json(node, json);
+            else generic_record_write_json(node, json);
+            schema_observe(root, nlohmann::json::parse(json));
+            ++seen;
+        }
+        ret = xmlTextReaderNext(r);
+    }
+    xmlFreeTextReader(r);
+    if (!seen) {
+        std::cerr << "[!] --infer-schema: no records to sample in " << opt.input
+                  << (ret < 0 ? " (XML parse error)\n" : "\n");
+        return false;
+    }
+    schema_settle(root);
+    return true;
+}
+
+// ---------- Record extractors ----------
+// How a --mode turns its record elements into JSON. An extractor is a type
+// with static members only, so the converters below are instantiated per
+// extractor and inline its calls:
+//   claims(node)             the records it converts; GenericExtractor takes the rest
+//   write_json(node, out, f) the direct writer: compact JSON, sorted keys, --fields tree `f`
+//   to_obj(node)             the same record as a DOM (--dom / --pretty)
+//   tag(node)                Record::tag
+//   k_fingerprint            fingerprint(node, full, key, hash) for --delta (full: the
+//                            record's write_json text with every field, if rendered)
+//   k_structured             extract(node, host) for the table writers (nmap_structured)
+// Another scanner's XML (Masscan, OpenVAS, ...) is one more extractor and a
+// line in k_modes; it gets every output format from the same templates.
+struct GenericExtractor {
+    static constexpr bool k_fingerprint = false, k_structured = false;
+    static bool claims(xmlNodePtr) { return true; }
+    static void write_json(xmlNodePtr node, std::string& out, const FieldTree& f) {
+        generic_record_write_json(node, out, f);
+    }
+    static nlohmann::json to_obj(xmlNodePtr node) {
+        nlohmann::json j = node_to_json(node);
+        auto it = j.begin(); // unwrap {"tag": {...}} -> {..., "_tag": "tag"}
+        if (it != j.end()) {
+            // a bare text leaf keeps its text under "#text"
+            std::string tag = it.key();
+            nlohmann::json merged = it.value().is_object() ? std::move(it.value())
+                                  : nlohmann::json{{"#text", std::move(it.value())}};
+            merged["_tag"] = std::move(tag);
+            j = std::move(merged);
+        }
+        return j;
+    }
+    static const char* tag(xmlNodePtr node) { return reinterpret_cast<const char*>(node->name); }
+};
+
+// Nmap <host>s; the scan's other records (e.g. --record-path runstats) are generic
+struct NmapHostExtractor {
+    static constexpr bool k_fingerprint = true, k_structured = true;
+    static bool claims(xmlNodePtr node) { return xmlStrEqual(node->name, BAD_CAST "host"); }
+    static void write_json(xmlNodePtr node, std::string& out, const FieldTree& f) {
+        nmap_host_write_json(node, out, f);
+    }
+    static nlohmann::json to_obj(xmlNodePtr node) { return nmap_host_to_obj(node); }
+    static const char* tag(xmlNodePtr) { return "host"; }
+    static void fingerprint(xmlNodePtr node, const std::string* full, std::string& key, uint64_t& hash) {
+        nmap_host_fingerprint(node, full, key, hash);
+    }
+    static void extract(xmlNodePtr node, NmapHost& h) { nmap_host_extract(node, h); }
+};
+
+// ---------- Record conversion ----------
+// A converted record on its way to the sinks.
+struct Record {
+    std::string tag;
+    size_t route = 0;                       // record type (RecordPaths::routes), picks the sink
+    std::string json;                       // serialized record (binary with bson/msgpack/cbor; unused with nmap_structured)
+    size_t streamed = 0;                    // bytes rendered straight into the sink's buffer instead (json stays empty)
+    std::unique_ptr<NmapHost> nmap;         // --schema relational: the extracted host
+    // --checkpoint: once this record is written, the input resumes by
+    // skipping `resume_skip` records from byte `resume_offset` (0 unless --chunked)
+    uint64_t resume_offset = 0, resume_skip = 0;
+    // --delta: the host's address (empty: not indexed) and content hash
+    std::string delta_key;
+    uint64_t delta_hash = 0;
+    std::string shard_key;                  // --shard-by: the record's value
+    // several inputs: the record's file and the byte offset of its start tag
+    // (written as "_source" / "_offset" before the filters see the record)
+    const std::string* source = nullptr;
+    uint64_t source_offset = 0;
+};
+
+// Nmap hosts go to the table writers as an NmapHost instead of JSON
+static bool nmap_structured(const Options& opt) {
+    return opt.schema == "relational";
+}
+
+// Puts `"key":value` (value already serialized) into the compact object
+// `json` where the sorted key order of the direct writers has it, replacing
+// a member of that name.
+static void json_put_member(std::string& json, const char* key, const std::string& value) {
+    std::string member = "\"";
+    member += key;
+    member += "\":";
+    member += value;
+    size_t i = 1;                           // past '{'
+    bool any = false;
+    while (i < json.size() && json[i] == '"') {
+        size_t e = i + 1;
+        while (e < json.size() && json[e] != '"') e += json[e] == '\\' ? 2 : 1;
+        const int c = json.compare(i + 1, e - i - 1, key);
+        const size_t end = json_value_end(json, e + 2);
+        if (c == 0) { json.replace(i, end - i, member); return; }
+        if (c > 0) { json.insert(i, member + ","); return; }
+        any = true;
+        i = end;
+        if (i < json.size() && json[i] == ',') ++i;
+    }
+    json.insert(i, any ? "," + member : member);
+}
+
+// One expanded record -> Record. Shared by the serial loop, the --threads
+// workers, the --chunked parsers and --serve; touches nothing but `node`'s
+// own subtree. With `stats`, the DOM path charges building the tree to
+// `convert` and dump() to `serialize`, lapping from `*t`; the direct writers
+// serialize as they go, so their whole time stays with the caller's convert
+// stage. Returns false when opt.query filters the record out.
+using RecordConverter = bool (*)(xmlNodePtr node, const Options& opt, Record& rec,
+                                 RunStats* stats, StatClock::time_point* t);
+
+// One instantiation per extractor `X` and output: `Structured` hands X's
+// records to the table writers as an NmapHost, `Dom` builds them as
+// nlohmann::json (`Pretty` indents), and `B` is the binary encoding. The
+// run's choice is made once by record_converter(), so none of it is looked
+// at again per record.
+template <class X, bool Structured, bool Dom, bool Pretty, BinaryFormat B>
+static bool convert_as(xmlNodePtr node, const Options& opt, Record& rec,
+                       RunStats* stats, StatClock::time_point* t) {
+    if constexpr (!std::is_same<X, GenericExtractor>::value) {
+        if (!X::claims(node)) return convert_as<GenericExtractor, false, Dom, Pretty, B>(node, opt, rec, stats, t);
+    }
+    RecordArena::Scope arena_scope;         // scratch is dropped with the record
+    std::string& json_str = rec.json;
+    std::string& tag_val = rec.tag;
+    rec.delta_key.clear();
+    bool rendered = false;                  // json_str already holds write_json's full text
+    if constexpr (X::k_fingerprint) {
+        if (opt.delta_index) {
+            // the text written for a changed host is the one hashed
+            if (!Structured && !Dom && !opt.query) {
+                json_str.clear();
+                X::write_json(node, json_str, FieldTree::everything());
+                rendered = true;
+            }
+            X::fingerprint(node, rendered ? &json_str : nullptr, rec.delta_key, rec.delta_hash);
+            if (opt.delta_index->unchanged(rec.delta_key, rec.delta_hash)) {
+                // only noted by the writer; nothing to convert
+                json_str.clear();
+                rec.nmap.reset();
+                tag_val = X::tag(node);
+                return true;
+            }
+        }
+    }
+    if constexpr (Structured) {
+        rec.nmap.reset(new NmapHost());
+        X::extract(node, *rec.nmap);
+        json_str.clear();
+        tag_val = X::tag(node);
+        if (opt.shard) {
+            thread_local std::string key_json;
+            key_json.clear();
+            X::write_json(node, key_json, opt.shard->fields);
+            shard_key_from_json(*opt.shard, key_json, rec.shard_key);
+        }
+    } else if constexpr (Dom) {
+        nlohmann::json j = X::to_obj(node);
+        // provenance: seen by --where, and kept whatever --fields says
+        auto provenance = [&] {
+            if (!rec.source) return;
+            j["_offset"] = rec.source_offset;
+            j["_source"] = *rec.source;
+        };
+        provenance();
+        if (opt.query && !query_apply(*opt.query, j)) return false;
+        if (opt.query) provenance();
+        if (opt.types) apply_types(*opt.types, j);
+        if (stats) *t = stats->add(RunStats::convert, *t);
+        json_str.clear();
+        if constexpr (B == BinaryFormat::bson) nlohmann::json::to_bson(j, json_str);
+        else if constexpr (B == BinaryFormat::msgpack) nlohmann::json::to_msgpack(j, json_str);
+        else if constexpr (B == BinaryFormat::cbor) nlohmann::json::to_cbor(j, json_str);
+        else json_str = Pretty ? j.dump(2) : j.dump();
+        if (opt.shard) shard_key_from_json(*opt.shard, B == BinaryFormat::none ? json_str : j.dump(), rec.shard_key);
+        if (stats) *t = stats->add(RunStats::serialize, *t);
+        tag_val  = j.contains("_tag") ? j["_tag"].get<std::string>() : opt.record_tag;
+    } else {
+        if (!rendered) {
+            json_str.clear();
+            X::write_json(node, json_str, opt.query ? opt.query->render : FieldTree::everything());
+        }
+        auto provenance = [&] {
+            if (!rec.source) return;
+            thread_local std::string src;
+            src.clear();
+            json_append_escaped(src, rec.source->data(), rec.source->size());
+            json_put_member(json_str, "_offset", std::to_string(rec.source_offset));
+            json_put_member(json_str, "_source", src);
+        };
+        provenance();
+        if (opt.query && !query_filter(*opt.query, json_str)) return false;
+        if (opt.query) provenance();
+        if (opt.types) apply_types(*opt.types, json_str);
+        if (opt.shard) shard_key_from_json(*opt.shard, json_str, rec.shard_key);
+        if constexpr (B != BinaryFormat::none) record_encode(B, json_str);
+        tag_val = X::tag(node);
+    }
+    return true;
+}
+
+template <class X, bool Dom, bool Pretty>
+static RecordConverter pick_encoding(const Options& opt) {
+    if constexpr (X::k_structured) {
+        if (nmap_structured(opt)) return &convert_as<X, true, Dom, Pretty, BinaryFormat::none>;
+    }
+    switch (binary_format(opt.format)) {
+    case BinaryFormat::bson:    return &convert_as<X, false, Dom, false, BinaryFormat::bson>;
+    case BinaryFormat::msgpack: return &convert_as<X, false, Dom, false, BinaryFormat::msgpack>;
+    case BinaryFormat::cbor:    return &convert_as<X, false, Dom, false, BinaryFormat::cbor>;
+    case BinaryFormat::none:    break;
+    }
+    return &convert_as<X, false, Dom, Pretty, BinaryFormat::none>;
+}
+
+template <class X>
+static RecordConverter pick_converter(const Options& opt, bool use_dom) {
+    if (!use_dom) return pick_encoding<X, false, false>(opt);
+    return opt.pretty ? pick_encoding<X, true, true>(opt) : pick_encoding<X, true, false>(opt);
+}
+
+// --mode NAME -> its extractor
+struct RecordMode {
+    const char* name;
+    const char* record_tag;                 // the record element without --record-tag / --record-path
+    RecordConverter (*pick)(const Options& opt, bool use_dom);
+};
+static const RecordMode k_modes[] = {
+    {"generic", nullptr, &pick_converter<GenericExtractor>},
+    {"nmap",    "host",  &pick_converter<NmapHostExtractor>},
+};
+
+// null for an unknown --mode
+static const RecordMode* find_mode(const std::string& name) {
+    for (const RecordMode& m : k_modes)
+        if (name == m.name) return &m;
+    return nullptr;
+}
+
+// The converter for opt's --mode, --format / --schema and --dom / --pretty
+// (`use_dom`), picked once per run and per --serve request. opt.mode must be
+// valid (find_mode).
+static RecordConverter record_converter(const Options& opt, bool use_dom) {
+    return find_mode(opt.mode)->pick(opt, use_dom);
+}
+
+// ---------- Buffered output ----------
+// Every text sink (jsonl, mysql-sql, mysql-tsv) appends into one large
+// user-space buffer (--out-buffer, default 8 MB) that goes to the kernel in
+// a handful of big write()s instead of one per record. Writers append to
+// buf() like any std::string -- the escapers write straight into it -- and
+// call commit() at record boundaries. A payload too large to be worth
+// copying goes out together with the buffered bytes in a single writev().
+class OutBuf {
+public:
+    static constexpr size_t k_min_cap = 64u << 10;
+    static constexpr size_t k_align = 4096;     // O_DIRECT buffer/length alignment
+
+    OutBuf(int fd, bool own_fd, size_t cap)
+        : fd_(fd), own_fd_(own_fd), cap_(std::max(cap, k_min_cap)) {
+        buf_.reserve(cap_ + (cap_ >> 3));
+#ifdef F_SETPIPE_SZ
+        // a bigger pipe lets one flush through with fewer reader wakeups
+        struct stat st;
+        if (fstat(fd_, &st) == 0 && S_ISFIFO(st.st_mode)) (void)fcntl(fd_, F_SETPIPE_SZ, 1 << 20);
+#endif
+    }
+    OutBuf(const OutBuf&) = delete;
+    OutBuf& operator=(const OutBuf&) = delete;
+    virtual ~OutBuf() {
+        finish();
+        if (dbuf_) free(dbuf_);
+        if (own_fd_) ::close(fd_);
+    }
+
+    // --out-direct: bypass the page cache for a regular output file. Writes
+    // go through an aligned staging buffer in whole blocks; the unaligned
+    // tail is written without O_DIRECT at finish(). False (and buffered
+    // writes) when the file system refuses it.
+    bool set_direct() {
+#ifdef O_DIRECT
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+        const size_t dcap = (cap_ + k_align - 1) / k_align * k_align;
+        void* p = nullptr;
+        if (posix_memalign(&p, k_align, dcap) != 0) return false;
+        const int fl = fcntl(fd_, F_GETFL);
+        if (fl < 0 || fcntl(fd_, F_SETFL, fl | O_DIRECT) != 0) { free(p); return false; }
+        dbuf_ = static_cast<char*>(p);
+        dcap_ = dcap;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    std::string& buf() { return buf_; }
+    void commit() { if (buf_.size() >= cap_) flush(); }
+    void put(char c) { buf_ += c; }
+    void write(const std::string& s) { write(s.data(), s.size()); }
+    void write(const char* p, size_t n) {
+        if (n >= cap_ / 4 && passthrough_ && !dbuf_) {
+            struct iovec iov[2] = {{const_cast<char*>(buf_.data()), buf_.size()},
+                                   {const_cast<char*>(p), n}};
+            if (ok_ && !writev_all(iov, 2)) fail();
+            buf_.clear();
+            return;
+        }
+        buf_.append(p, n);
+        commit();
+    }
+
+    // hand the buffered bytes on; false once any write has failed
+    bool flush() {
+        if (ok_ && !buf_.empty() && !drain(buf_.data(), buf_.size(), false)) fail();
+        buf_.clear();
+        return ok_;
+    }
+
+    // flush, end an encoder's stream and write the O_DIRECT tail (idempotent)
+    bool finish() {
+        if (finished_) return ok_;
+        finished_ = true;
+        if (ok_ && !drain(buf_.data(), buf_.size(), true)) fail();
+        buf_.clear();
+        if (ok_ && dbuf_ && dlen_ > 0) {
+            const size_t whole = dlen_ / k_align * k_align;
+            bool w = whole == 0 || write_all(dbuf_, whole);
+            if (w) {
+                clear_direct();
+                w = write_all(dbuf_ + whole, dlen_ - whole);
+            }
+            if (!w) fail();
+            dlen_ = 0;
+        }
+        return ok_;
+    }
+
+    bool ok() const { return ok_; }
+
+    // --checkpoint: flush to stable storage; `pos` is then the file length
+    // that holds everything written so far (plain buffered output only)
+    bool sync(uint64_t& pos) {
+        if (!flush()) return false;
+        const off_t o = lseek(fd_, 0, SEEK_CUR);
+        if (o < 0 || fdatasync(fd_) != 0) { fail(); return false; }
+        pos = (uint64_t)o;
+        return true;
+    }
+
+protected:
+    // where flushed bytes go; `end` marks the last call. A subclass that
+    // transforms the stream (--compress) overrides this, clears
+    // passthrough_ and calls finish() from its own destructor.
+    virtual bool drain(const char* p, size_t n, bool end) {
+        (void)end;
+        return sink(p, n);
+    }
+
+    // bytes for the fd, staged in whole aligned blocks with --out-direct
+    bool sink(const char* p, size_t n) {
+        if (!dbuf_) return write_all(p, n);
+        while (n > 0) {
+            const size_t k = std::min(n, dcap_ - dlen_);
+            memcpy(dbuf_ + dlen_, p, k);
+            dlen_ += k; p += k; n -= k;
+            if (dlen_ == dcap_) {
+                if (!write_all(dbuf_, dlen_)) return false;
+                dlen_ = 0;
+            }
+        }
+        return true;
+    }
+
+    bool passthrough_ = true;
+
+private:
+    void fail() {
+        if (ok_) std::cerr << "[!] Failed to write output\n";
+        ok_ = false;
+    }
+
+    void clear_direct() {
+#ifdef O_DIRECT
+        const int fl = fcntl(fd_, F_GETFL);
+        if (fl >= 0) (void)fcntl(fd_, F_SETFL, fl & ~O_DIRECT);
+#endif
+    }
+
+    bool write_all(const char* p, size_t n) {
+        while (n > 0) {
+            ssize_t w = ::write(fd_, p, n);
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && errno == EINVAL && dbuf_) {
+                // the file system took the O_DIRECT flag but not the I/O
+                clear_direct();
+                continue;
+            }
+            if (w <= 0) return false;
+            p += w; n -= (size_t)w;
+        }
+        return true;
+    }
+
+    bool writev_all(struct iovec* iov, int cnt) {
+        while (cnt > 0) {
+            if (iov->iov_len == 0) { ++iov; --cnt; continue; }
+            ssize_t w = ::writev(fd_, iov, cnt);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            size_t done = (size_t)w;
+            while (cnt > 0 && done >= iov->iov_len) { done -= iov->iov_len; ++iov; --cnt; }
+            if (cnt > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+                iov->iov_len -= done;
+            }
+        }
+        return true;
+    }
+
+    int fd_;
+    bool own_fd_;
+    const size_t cap_;
+    std::string buf_;
+    char* dbuf_ = nullptr;      // O_DIRECT staging
+    size_t dcap_ = 0, dlen_ = 0;
+    bool ok_ = true;
+    bool finished_ = false;
+};
+
+// ---------- MySQL dump helpers ----------
+static void sql_append_escaped(std::string& out, const char* s, size_t n) {
+    const SpanScanFn scan = escape_kernels().sql;
+    for (;;) {
+        const size_t k = scan(s, n);
+        out.append(s, k);
+        if (k == n) break;
+        switch (s[k]) {
+            case '\\': out += "\\\\"; break;
+            case '\'': out += "\\\'"; break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:   out += "\\0";  break;    // '\0'
+        }
+        s += k + 1;
+        n -= k + 1;
+    }
+}
+
+static std::string mysql_create_table_sql(const std::string& table) {
+    return "CREATE TABLE IF NOT EXISTS `" + table + R"(` (
+  `id` BIGINT NOT NULL AUTO_INCREMENT,
+  `tag` VARCHAR(128) NULL,
+  `json` JSON NOT NULL,
+  `added_at` TIMESTAMP NULL DEFAULT CURRENT_TIMESTAMP,
+  PRIMARY KEY (`id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+)";
+}
+
+static void mysql_write_create_table(OutBuf& out, const std::string& table) {
+    out.buf() += mysql_create_table_sql(table);
+}
+
+static void mysql_write_preamble(OutBuf& out, const std::string& table) {
+    out.buf().append("-- MySQL dump generated by xml2stream\n"
+                     "SET NAMES utf8mb4; SET FOREIGN_KEY_CHECKS=0;\n");
+    mysql_write_create_table(out, table);
+}
+
+// Transaction framing shared by all INSERT writers of one dump: every
+// `commit_every` statements (0 = never) are wrapped in START TRANSACTION /
+// COMMIT.
+struct MysqlTxn {
+    OutBuf& out;
+    size_t commit_every = 0;
+    size_t stmts = 0;
+    bool open = false;
+
+    MysqlTxn(OutBuf& o, size_t every) : out(o), commit_every(every) {}
+    void before_statement() {
+        if (commit_every && !open) { out.buf() += "START TRANSACTION;\n"; open = true; }
+    }
+    void after_statement() {
+        if (commit_every && ++stmts >= commit_every) { out.buf() += "COMMIT;\n"; open = false; stmts = 0; }
+    }
+    void finish() {
+        if (open) { out.buf() += "COMMIT;\n"; open = false; }
+    }
+};
+
+// Groups rows into extended INSERTs of at most `rows_per_insert` rows and
+// about `max_bytes` per statement (a single oversized row still goes out
+// alone). `header` is "INSERT INTO `t`(...) VALUES"; rows are the
+// parenthesized tuples. With one row per INSERT the output is the classic
+// one-statement-per-record dump. Tuples are escaped straight into the
+// pending statement (begin_row / end_row), which is handed to the OutBuf
+// whole.
+class MysqlInsertWriter {
+public:
+    MysqlInsertWriter(MysqlTxn& txn, std::string header, size_t rows_per_insert, size_t max_bytes)
+        : txn_(txn), header_(std::move(header)),
+          rows_per_insert_(std::max<size_t>(1, rows_per_insert)), max_bytes_(max_bytes) {}
+
+    // the classic `records` table row
+    void add(const std::string& tag, const std::string& json_str) {
+        std::string& t = begin_row();
+        t += "('";
+        sql_append_escaped(t, tag.data(), tag.size());
+        t += "', CAST('";
+        sql_append_escaped(t, json_str.data(), json_str.size());
+        t += "' AS JSON))";
+        end_row();
+    }
+
+    // append exactly one parenthesized tuple to the returned string, then
+    // call end_row()
+    std::string& begin_row() {
+        if (rows_ == 0) stmt_ = header_; else stmt_ += ',';
+        row_start_ = stmt_.size();
+        return stmt_;
+    }
+
+    void end_row() {
+        if (rows_ > 0 && stmt_.size() + 2 > max_bytes_) {
+            // the row does not fit: close the statement without it and
+            // start the next one with it
+            spill_.assign(stmt_, row_start_, std::string::npos);
+            stmt_.resize(row_start_ - 1);
+            flush_statement();
+            stmt_ = header_;
+            stmt_ += spill_;
+        }
+        if (++rows_ >= rows_per_insert_) flush_statement();
+    }
+
+    void finish() { flush_statement(); }
+
+private:
+    void flush_statement() {
+        if (rows_ == 0) return;
+        txn_.before_statement();
+        stmt_ += ";\n";
+        txn_.out.write(stmt_);
+        rows_ = 0;
+        txn_.after_statement();
+        txn_.out.commit();
+    }
+
+    MysqlTxn& txn_;
+    const std::string header_;
+    const size_t rows_per_insert_;
+    const size_t max_bytes_;
+    std::string stmt_;
+    std::string spill_;
+    size_t row_start_ = 0;
+    size_t rows_ = 0;
+};
+
+static void mysql_write_postamble(OutBuf& out) {
+    out.buf() += "SET FOREIGN_KEY_CHECKS=1;\n";
+}
+
+// ---------- MySQL LOAD DATA (mysql-tsv) ----------
+// One `tag<TAB>json` line per record, escaped for LOAD DATA's defaults
+// (FIELDS TERMINATED BY '\t' ESCAPED BY '\\' LINES TERMINATED BY '\n').
+static void tsv_append_escaped(std::string& out, const char* s, size_t n) {
+    const SpanScanFn scan = escape_kernels().sql;   // superset of what TSV needs
+    for (;;) {
+        const size_t k = scan(s, n);
+        out.append(s, k);
+        if (k == n) break;
+        switch (s[k]) {
+            case '\\': out += "\\\\"; break;
+            case '\'': out += '\'';     break;    // no escape needed in TSV
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:   out += "\\0";  break;
+        }
+        s += k + 1;
+        n -= k + 1;
+    }
+}
+
+static void mysql_tsv_write_row(OutBuf& out, const std::string& tag, const std::string& json_str) {
+    std::string& line = out.buf();
+    tsv_append_escaped(line, tag.data(), tag.size());
+    line += '\t';
+    tsv_append_escaped(line, json_str.data(), json_str.size());
+    line += '\n';
+    out.commit();
+}
+
+// the schema plus a LOAD DATA LOCAL INFILE for `data_path`
+static void mysql_write_loader(OutBuf& out, const std::string& table, const std::string& data_path) {
+    mysql_write_preamble(out, table);
+    std::string& b = out.buf();
+    b += "LOAD DATA LOCAL INFILE '";
+    sql_append_escaped(b, data_path.data(), data_path.size());
+    b.append("'\n  INTO TABLE `").append(table).append("` CHARACTER SET utf8mb4\n"
+             "  FIELDS TERMINATED BY '\\t' ESCAPED BY '\\\\'\n"
+             "  LINES TERMINATED BY '\\n'\n"
+             "  (`tag`, `json`);\n");
+    mysql_write_postamble(out);
+}
+
+// ---------- Relational Nmap schema (--schema relational) ----------
+// hosts <- addresses, hostnames, ports, scripts(host_id)
+// ports <- services(port_id) <- cpes(port_id); ports <- scripts(port_id)
+// host and port ids are assigned here so child rows can reference them
+// without a round trip; secondary indexes are built after the load.
+
+static const char* const k_relational_indexes[][3] = {
+    // name, table, columns
+    {"idx_addresses_host",  "addresses", "host_id"},
+    {"idx_addresses_addr",  "addresses", "addr"},
+    {"idx_hostnames_host",  "hostnames", "host_id"},
+    {"idx_ports_host",      "ports",     "host_id"},
+    {"idx_ports_port",      "ports",     "portid,state"},
+    {"idx_services_name",   "services",  "name"},
+    {"idx_cpes_port",       "cpes",      "port_id"},
+    {"idx_scripts_host",    "scripts",   "host_id"},
+    {"idx_scripts_port",    "scripts",   "port_id"},
+    {"idx_scripts_id",      "scripts",   "script_id"},
+};
+
+static void sql_append_value(std::string& out, const OptStr& v) {
+    if (!v) { out += "NULL"; return; }
+    out += '\'';
+    sql_append_escaped(out, v->data(), v->size());
+    out += '\'';
+}
+
+// InnoDB indexes foreign key columns when the table is created, so only the
+// lookup indexes are deferred to mysql_relational_postamble.
+static void mysql_relational_preamble(OutBuf& out) {
+    out.buf() += "-- MySQL dump generated by xml2stream (relational Nmap schema)\n"
+                 "SET NAMES utf8mb4; SET FOREIGN_KEY_CHECKS=0;\n"
+                 R"(CREATE TABLE IF NOT EXISTS `hosts` (
+  `id` BIGINT NOT NULL,
+  `starttime` BIGINT NULL,
+  `status` VARCHAR(32) NULL,
+  `uptime_seconds` BIGINT NULL,
+  `uptime_lastboot` VARCHAR(64) NULL,
+  PRIMARY KEY (`id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+CREATE TABLE IF NOT EXISTS `addresses` (
+  `id` BIGINT NOT NULL AUTO_INCREMENT,
+  `host_id` BIGINT NOT NULL,
+  `addr` VARCHAR(64) NULL,
+  `addrtype` VARCHAR(16) NULL,
+  `vendor` VARCHAR(255) NULL,
+  PRIMARY KEY (`id`),
+  FOREIGN KEY (`host_id`) REFERENCES `hosts`(`id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+CREATE TABLE IF NOT EXISTS `hostnames` (
+  `id` BIGINT NOT NULL AUTO_INCREMENT,
+  `host_id` BIGINT NOT NULL,
+  `name` VARCHAR(255) NULL,
+  `type` VARCHAR(32) NULL,
+  PRIMARY KEY (`id`),
+  FOREIGN KEY (`host_id`) REFERENCES `hosts`(`id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+CREATE TABLE IF NOT EXISTS `ports` (
+  `id` BIGINT NOT NULL,
+  `host_id` BIGINT NOT NULL,
+  `protocol` VARCHAR(16) NULL,
+  `portid` INT NULL,
+  `state` VARCHAR(32) NULL,
+  `reason` VARCHAR(64) NULL,
+  PRIMARY KEY (`id`),
+  FOREIGN KEY (`host_id`) REFERENCES `hosts`(`id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+CREATE TABLE IF NOT EXISTS `services` (
+  `port_id` BIGINT NOT NULL,
+  `name` VARCHAR(128) NULL,
+  `product` VARCHAR(255) NULL,
+  `version` VARCHAR(255) NULL,
+  `extrainfo` VARCHAR(255) NULL,
+  `tunnel` VARCHAR(32) NULL,
+  `method` VARCHAR(32) NULL,
+  `conf` VARCHAR(8) NULL,
+  PRIMARY KEY (`port_id`),
+  FOREIGN KEY (`port_id`) REFERENCES `ports`(`id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+CREATE TABLE IF NOT EXISTS `cpes` (
+  `id` BIGINT NOT NULL AUTO_INCREMENT,
+  `port_id` BIGINT NOT NULL,
+  `cpe` VARCHAR(255) NULL,
+  PRIMARY KEY (`id`),
+  FOREIGN KEY (`port_id`) REFERENCES `services`(`port_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+CREATE TABLE IF NOT EXISTS `scripts` (
+  `id` BIGINT NOT NULL AUTO_INCREMENT,
+  `host_id` BIGINT NOT NULL,
+  `port_id` BIGINT NULL,
+  `script_id` VARCHAR(128) NULL,
+  `output` MEDIUMTEXT NULL,
+  PRIMARY KEY (`id`),
+  FOREIGN KEY (`host_id`) REFERENCES `hosts`(`id`),
+  FOREIGN KEY (`port_id`) REFERENCES `ports`(`id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;
+SELECT COALESCE(MAX(`id`),0) INTO @xs_host FROM `hosts`;
+SELECT COALESCE(MAX(`id`),0) INTO @xs_port FROM `ports`;
+)";
+}
+
+// MySQL has no CREATE INDEX IF NOT EXISTS; check information_schema so the
+// dump can be replayed into the same database.
+static void mysql_relational_postamble(OutBuf& out) {
+    std::string& b = out.buf();
+    for (const auto& ix : k_relational_indexes) {
+        b.append("SET @xs_sql = IF((SELECT COUNT(*) FROM information_schema.statistics"
+                 " WHERE table_schema = DATABASE() AND table_name = '").append(ix[1])
+         .append("' AND index_name = '").append(ix[0]).append("') = 0, 'CREATE INDEX `").append(ix[0])
+         .append("` ON `").append(ix[1]).append("`(").append(ix[2]).append(")', 'DO 0');\n"
+                 "PREPARE xs_stmt FROM @xs_sql; EXECUTE xs_stmt; DEALLOCATE PREPARE xs_stmt;\n");
+    }
+    mysql_write_postamble(out);
+}
+
+class MysqlRelationalWriter {
+public:
+    MysqlRelationalWriter(MysqlTxn& txn, size_t rows_per_insert, size_t max_bytes)
+        : hosts_(txn, "INSERT INTO `hosts`(`id`,`starttime`,`status`,`uptime_seconds`,`uptime_lastboot`) VALUES", rows_per_insert, max_bytes),
+          addresses_(txn, "INSERT INTO `addresses`(`host_id`,`addr`,`addrtype`,`vendor`) VALUES", rows_per_insert, max_bytes),
+          hostnames_(txn, "INSERT INTO `hostnames`(`host_id`,`name`,`type`) VALUES", rows_per_insert, max_bytes),
+          ports_(txn, "INSERT INTO `ports`(`id`,`host_id`,`protocol`,`portid`,`state`,`reason`) VALUES", rows_per_insert, max_bytes),
+          services_(txn, "INSERT INTO `services`(`port_id`,`name`,`product`,`version`,`extrainfo`,`tunnel`,`method`,`conf`) VALUES", rows_per_insert, max_bytes),
+          cpes_(txn, "INSERT INTO `cpes`(`port_id`,`cpe`) VALUES", rows_per_insert, max_bytes),
+          scripts_(txn, "INSERT INTO `scripts`(`host_id`,`port_id`,`script_id`,`output`) VALUES", rows_per_insert, max_bytes) {}
+
+    void add(const NmapHost& h) {
+        const std::string host_ref = "@xs_host+" + std::to_string(++host_seq_);
+        std::string* t = &hosts_.begin_row();
+        t->append("(").append(host_ref);
+        for (const OptStr* v : {&h.starttime, &h.status, &h.uptime_seconds, &h.uptime_lastboot}) {
+            *t += ','; sql_append_value(*t, *v);
+        }
+        *t += ')'; hosts_.end_row();
+
+        for (const auto& a : h.addresses) {
+            t = &addresses_.begin_row();
+            t->append("(").append(host_ref);
+            for (const OptStr* v : {&a.addr, &a.addrtype, &a.vendor}) { *t += ','; sql_append_value(*t, *v); }
+            *t += ')'; addresses_.end_row();
+        }
+        for (const auto& hn : h.hostnames) {
+            t = &hostnames_.begin_row();
+            t->append("(").append(host_ref);
+            for (const OptStr* v : {&hn.name, &hn.type}) { *t += ','; sql_append_value(*t, *v); }
+            *t += ')'; hostnames_.end_row();
+        }
+        for (const auto& s : h.hostscripts) add_script(host_ref, "NULL", s);
+        for (const auto& p : h.ports) {
+            const std::string port_ref = "@xs_port+" + std::to_string(++port_seq_);
+            t = &ports_.begin_row();
+            t->append("(").append(port_ref).append(",").append(host_ref);
+            for (const OptStr* v : {&p.protocol, &p.portid, &p.state, &p.reason}) { *t += ','; sql_append_value(*t, *v); }
+            *t += ')'; ports_.end_row();
+            if (p.service) {
+                const NmapService& s = *p.service;
+                t = &services_.begin_row();
+                t->append("(").append(port_ref);
+                for (const OptStr* v : {&s.name, &s.product, &s.version, &s.extrainfo, &s.tunnel, &s.method, &s.conf}) {
+                    *t += ','; sql_append_value(*t, *v);
+                }
+                *t += ')'; services_.end_row();
+                for (const auto& c : s.cpes) {
+                    t = &cpes_.begin_row();
+                    t->append("(").append(port_ref).append(",");
+                    sql_append_value(*t, c);
+                    *t += ')'; cpes_.end_row();
+                }
+            }
+            for (const auto& sc : p.scripts) add_script(host_ref, port_ref, sc);
+        }
+    }
+
+    void finish() {
+        for (MysqlInsertWriter* w : {&hosts_, &addresses_, &hostnames_, &ports_, &services_, &cpes_, &scripts_}) w->finish();
+    }
+
+    // ids handed out so far, relative to @xs_host / @xs_port (--checkpoint)
+    uint64_t host_seq() const { return host_seq_; }
+    uint64_t port_seq() const { return port_seq_; }
+    void resume(uint64_t host_seq, uint64_t port_seq) { host_seq_ = host_seq; port_seq_ = port_seq; }
+
+private:
+    void add_script(const std::string& host_ref, const std::string& port_ref, const NmapScript& s) {
+        std::string& t = scripts_.begin_row();
+        t.append("(").append(host_ref).append(",").append(port_ref);
+        for (const OptStr* v : {&s.id, &s.output}) { t += ','; sql_append_value(t, *v); }
+        t += ')'; scripts_.end_row();
+    }
+
+    MysqlInsertWriter hosts_, addresses_, hostnames_, ports_, services_, cpes_, scripts_;
+    uint64_t host_seq_ = 0, port_seq_ = 0;
+};
+
+// ---------- Checkpoints (--checkpoint / --resume) ----------
+// A checkpoint names a record boundary of the input -- skip `skip` records
+// counted from byte `offset` (0, unless --chunked cut the input there) --
+// and the length of every output at that point. It is only taken between
+// records, after open mysql statements and transactions have been closed
+// and the outputs flushed and fdatasync()ed, so each output ends exactly
+// after the records it covers; the file itself is replaced atomically
+// (temporary + fsync + rename). --resume cuts the outputs back to those
+// lengths and goes on appending: the reader and SAX paths skip the covered
+// records without expanding them, --chunked starts cutting at `offset`.
+// Records are counted as the record paths match them, filtered or not.
+//
+// Only --chunked resumes at a byte offset. The reader and SAX paths (an
+// mmapped file included) still parse the covered prefix from byte 0 and
+// skip `skip` records there: the reader can't tell where a record's start
+// tag was (xmlTextReaderByteConsumed runs ahead of the current node), and a
+// text search for record tags, as chunk_bounds does, can count nested or
+// commented-out tags that the record paths don't match. Resuming a large
+// plain file is fastest with --chunked on both runs.
+//
+// With --format sqlite the checkpoint is a row of the database instead
+// (sqlite_save_checkpoint), written inside each batch's transaction.
+
+struct CheckpointState {
+    std::string input;
+    uint64_t input_size = 0;
+    std::string format;
+    uint64_t offset = 0, skip = 0;
+    std::vector<std::pair<std::string, uint64_t>> outputs;     // path, bytes
+    uint64_t host_seq = 0, port_seq = 0;    // mysql-sql --schema relational ids
+    bool complete = false;                  // written once the run finished
+};
+
+static bool checkpoint_save(const std::string& path, const CheckpointState& st) {
+    nlohmann::json j = {{"input", st.input}, {"input_size", st.input_size}, {"format", st.format},
+                        {"offset", st.offset}, {"skip", st.skip},
+                        {"host_seq", st.host_seq}, {"port_seq", st.port_seq}, {"complete", st.complete}};
+    nlohmann::json& outs = j["outputs"] = nlohmann::json::array();
+    for (const auto& o : st.outputs) outs.push_back({{"path", o.first}, {"bytes", o.second}});
+    return write_file_atomic(path, j.dump() + "\n");
+}
+
+static bool checkpoint_load(const std::string& path, CheckpointState& st) {
+    std::ifstream f(path);
+    if (!f) {
+        std::cerr << "[!] --resume: cannot read checkpoint " << path << "\n";
+        return false;
+    }
+    try {
+        const nlohmann::json j = nlohmann::json::parse(f);
+        st.input = j.at("input").get<std::string>();
+        st.input_size = j.at("input_size").get<uint64_t>();
+        st.format = j.at("format").get<std::string>();
+        st.offset = j.at("offset").get<uint64_t>();
+        st.skip = j.at("skip").get<uint64_t>();
+        st.host_seq = j.value("host_seq", (uint64_t)0);
+        st.port_seq = j.value("port_seq", (uint64_t)0);
+        st.complete = j.value("complete", false);
+        st.outputs.clear();
+        for (const auto& o : j.at("outputs"))
+            st.outputs.emplace_back(o.at("path").get<std::string>(), o.at("bytes").get<uint64_t>());
+    } catch (const std::exception& ex) {
+        std::cerr << "[!] --resume: " << path << " is not a checkpoint: " << ex.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Like Progress::due(): looks at the clock every 256 calls
+class CheckpointTimer {
+public:
+    explicit CheckpointTimer(int seconds) : period_(std::chrono::seconds(std::max(1, seconds))) {}
+    bool due() {
+        if (++calls_ & 255) return false;
+        const auto now = StatClock::now();
+        if (now - last_ < period_) return false;
+        last_ = now;
+        return true;
+    }
+
+private:
+    const StatClock::duration period_;
+    uint64_t calls_ = 0;
+    StatClock::time_point last_ = StatClock::now();
+};
+
+// ---------- SQLite helpers ----------
+#ifdef WITH_SQLITE
+static void sqlite_exec_checked(sqlite3* db, const std::string& sql, const char* what) {
+    char* errmsg = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        std::string e = errmsg ? errmsg : sqlite3_errmsg(db);
+        sqlite3_free(errmsg);
+        throw std::runtime_error(std::string(what) + " failed: " + e);
+    }
+}
+
+static void sqlite_ensure_schema(sqlite3* db, const std::string& table) {
+    std::string create = "CREATE TABLE IF NOT EXISTS " + table + R"( (
+        id INTEGER PRIMARY KEY AUTOINCREMENT,
+        tag TEXT,
+        json TEXT NOT NULL,
+        added_at TEXT DEFAULT (datetime('now'))
+    );)";
+    sqlite_exec_checked(db, create, "SQLite create");
+}
+
+// Tuning pragmas from the command line; run before the schema is created
+// so page_size applies to a fresh database.
+static void sqlite_apply_pragmas(sqlite3* db, const Options& opt) {
+    auto word = [](const std::string& v) {
+        if (v.empty() || !std::all_of(v.begin(), v.end(), [](unsigned char c) { return std::isalpha(c); }))
+            throw std::runtime_error("invalid pragma value '" + v + "'");
+        return v;
+    };
+    if (opt.sqlite_page_size > 0)
+        sqlite_exec_checked(db, "PRAGMA page_size=" + std::to_string(opt.sqlite_page_size) + ";", "SQLite page_size");
+    if (!opt.sqlite_journal.empty())
+        sqlite_exec_checked(db, "PRAGMA journal_mode=" + word(opt.sqlite_journal) + ";", "SQLite journal_mode");
+    if (!opt.sqlite_sync.empty())
+        sqlite_exec_checked(db, "PRAGMA synchronous=" + word(opt.sqlite_sync) + ";", "SQLite synchronous");
+    if (opt.sqlite_cache_size != 0)
+        sqlite_exec_checked(db, "PRAGMA cache_size=" + std::to_string(opt.sqlite_cache_size) + ";", "SQLite cache_size");
+}
+
+static void sqlite_step_done(sqlite3* db, sqlite3_stmt* stmt) {
+    const int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) throw std::runtime_error(std::string("step failed: ") + sqlite3_errmsg(db));
+}
+
+static sqlite3_stmt* sqlite_prepare(sqlite3* db, const std::string& sql) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK)
+        throw std::runtime_error(std::string("SQLite prepare failed: ") + sqlite3_errmsg(db));
+    return stmt;
+}
+
+// Binds borrow the record's strings (SQLITE_STATIC): they live in the
+// writer's batch buffer until the batch is committed.
+static void sqlite_bind(sqlite3_stmt* stmt, int i, const std::string& v) {
+    sqlite3_bind_text(stmt, i, v.data(), (int)v.size(), SQLITE_STATIC);
+}
+static void sqlite_bind(sqlite3_stmt* stmt, int i, const OptStr& v) {
+    if (v) sqlite_bind(stmt, i, *v); else sqlite3_bind_null(stmt, i);
+}
+
+// --checkpoint: the resume point as a one-row table, replaced inside every
+// batch's transaction (so it always matches the committed rows)
+static void sqlite_ensure_checkpoint_table(sqlite3* db) {
+    sqlite_exec_checked(db, "CREATE TABLE IF NOT EXISTS xmlstream_checkpoint ("
+                            "id INTEGER PRIMARY KEY, input TEXT, input_size INTEGER, input_offset INTEGER, skip INTEGER);",
+                        "SQLite create");
+}
+
+// false if the database has no checkpoint yet
+static bool sqlite_load_checkpoint(sqlite3* db, CheckpointState& st) {
+    sqlite3_stmt* q = sqlite_prepare(db, "SELECT input, input_size, input_offset, skip FROM xmlstream_checkpoint WHERE id = 1;");
+    const bool found = sqlite3_step(q) == SQLITE_ROW;
+    if (found) {
+        const unsigned char* in = sqlite3_column_text(q, 0);
+        st.input = in ? reinterpret_cast<const char*>(in) : "";
+        st.input_size = (uint64_t)sqlite3_column_int64(q, 1);
+        st.offset = (uint64_t)sqlite3_column_int64(q, 2);
+        st.skip = (uint64_t)sqlite3_column_int64(q, 3);
+    }
+    sqlite3_finalize(q);
+    return found;
+}
+
+// What one record turns into inside SqliteWriter's transaction.
+class SqliteInserter {
+public:
+    virtual ~SqliteInserter() = default;
+    virtual void insert(const Record& rec) = 0;     // throws on failure
+    virtual void finish_load() {}                   // after the last batch
+};
+
+// one row per record in the `records(tag, json)` table
+// one table, or one per route (Record::route indexes `tables`)
+class SqliteJsonInserter : public SqliteInserter {
+public:
+    SqliteJsonInserter(sqlite3* db, const std::vector<std::string>& tables) : db_(db) {
+        try {
+            for (const std::string& table : tables)
+                stmts_.push_back(sqlite_prepare(db, "INSERT INTO " + table + "(tag,json) VALUES(?,?);"));
+        } catch (...) {
+            for (sqlite3_stmt* st : stmts_) sqlite3_finalize(st);
+            throw;
+        }
+    }
+    ~SqliteJsonInserter() override { for (sqlite3_stmt* st : stmts_) sqlite3_finalize(st); }
+
+    void insert(const Record& rec) override {
+        sqlite3_stmt* stmt = stmts_[stmts_.size() > 1 ? rec.route : 0];
+        sqlite_bind(stmt, 1, rec.tag);
+        sqlite_bind(stmt, 2, rec.json);
+        sqlite_step_done(db_, stmt);
+    }
+
+private:
+    sqlite3* db_;
+    std::vector<sqlite3_stmt*> stmts_;
+};
+
+// --schema relational; tables match mysql_relational_preamble
+static void sqlite_ensure_relational_schema(sqlite3* db) {
+    sqlite_exec_checked(db, R"(
+        CREATE TABLE IF NOT EXISTS hosts (
+            id INTEGER PRIMARY KEY, starttime INTEGER, status TEXT,
+            uptime_seconds INTEGER, uptime_lastboot TEXT);
+        CREATE TABLE IF NOT EXISTS addresses (
+            id INTEGER PRIMARY KEY, host_id INTEGER NOT NULL REFERENCES hosts(id),
+            addr TEXT, addrtype TEXT, vendor TEXT);
+        CREATE TABLE IF NOT EXISTS hostnames (
+            id INTEGER PRIMARY KEY, host_id INTEGER NOT NULL REFERENCES hosts(id),
+            name TEXT, type TEXT);
+        CREATE TABLE IF NOT EXISTS ports (
+            id INTEGER PRIMARY KEY, host_id INTEGER NOT NULL REFERENCES hosts(id),
+            protocol TEXT, portid INTEGER, state TEXT, reason TEXT);
+        CREATE TABLE IF NOT EXISTS services (
+            port_id INTEGER PRIMARY KEY REFERENCES ports(id),
+            name TEXT, product TEXT, version TEXT, extrainfo TEXT, tunnel TEXT, method TEXT, conf TEXT);
+        CREATE TABLE IF NOT EXISTS cpes (
+            id INTEGER PRIMARY KEY, port_id INTEGER NOT NULL REFERENCES services(port_id), cpe TEXT);
+        CREATE TABLE IF NOT EXISTS scripts (
+            id INTEGER PRIMARY KEY, host_id INTEGER NOT NULL REFERENCES hosts(id),
+            port_id INTEGER REFERENCES ports(id), script_id TEXT, output TEXT);
+    )", "SQLite create");
+}
+
+class SqliteRelationalInserter : public SqliteInserter {
+public:
+    explicit SqliteRelationalInserter(sqlite3* db) : db_(db) {
+        host_id_ = max_id("hosts");
+        port_id_ = max_id("ports");
+        hosts_     = sqlite_prepare(db, "INSERT INTO hosts(id,starttime,status,uptime_seconds,uptime_lastboot) VALUES(?,?,?,?,?);");
+        addresses_ = sqlite_prepare(db, "INSERT INTO addresses(host_id,addr,addrtype,vendor) VALUES(?,?,?,?);");
+        hostnames_ = sqlite_prepare(db, "INSERT INTO hostnames(host_id,name,type) VALUES(?,?,?);");
+        ports_     = sqlite_prepare(db, "INSERT INTO ports(id,host_id,protocol,portid,state,reason) VALUES(?,?,?,?,?,?);");
+        services_  = sqlite_prepare(db, "INSERT INTO services(port_id,name,product,version,extrainfo,tunnel,method,conf) VALUES(?,?,?,?,?,?,?,?);");
+        cpes_      = sqlite_prepare(db, "INSERT INTO cpes(port_id,cpe) VALUES(?,?);");
+        scripts_   = sqlite_prepare(db, "INSERT INTO scripts(host_id,port_id,script_id,output) VALUES(?,?,?,?);");
+    }
+    ~SqliteRelationalInserter() override {
+        for (sqlite3_stmt* s : {hosts_, addresses_, hostnames_, ports_, services_, cpes_, scripts_}) sqlite3_finalize(s);
+    }
+
+    void insert(const Record& rec) override {
+        if (!rec.nmap) return;
+        const NmapHost& h = *rec.nmap;
+        const sqlite3_int64 host = ++host_id_;
+        sqlite3_bind_int64(hosts_, 1, host);
+        sqlite_bind(hosts_, 2, h.starttime);
+        sqlite_bind(hosts_, 3, h.status);
+        sqlite_bind(hosts_, 4, h.uptime_seconds);
+        sqlite_bind(hosts_, 5, h.uptime_lastboot);
+        sqlite_step_done(db_, hosts_);
+        for (const auto& a : h.addresses) {
+            sqlite3_bind_int64(addresses_, 1, host);
+            sqlite_bind(addresses_, 2, a.addr);
+            sqlite_bind(addresses_, 3, a.addrtype);
+            sqlite_bind(addresses_, 4, a.vendor);
+            sqlite_step_done(db_, addresses_);
+        }
+        for (const auto& hn : h.hostnames) {
+            sqlite3_bind_int64(hostnames_, 1, host);
+            sqlite_bind(hostnames_, 2, hn.name);
+            sqlite_bind(hostnames_, 3, hn.type);
+            sqlite_step_done(db_, hostnames_);
+        }
+        for (const auto& s : h.hostscripts) insert_script(host, 0, s);
+        for (const auto& p : h.ports) {
+            const sqlite3_int64 port = ++port_id_;
+            sqlite3_bind_int64(ports_, 1, port);
+            sqlite3_bind_int64(ports_, 2, host);
+            sqlite_bind(ports_, 3, p.protocol);
+            sqlite_bind(ports_, 4, p.portid);
+            sqlite_bind(ports_, 5, p.state);
+            sqlite_bind(ports_, 6, p.reason);
+            sqlite_step_done(db_, ports_);
+            if (p.service) {
+                const NmapService& s = *p.service;
+                sqlite3_bind_int64(services_, 1, port);
+                int i = 2;
+                for (const OptStr* v : {&s.name, &s.product, &s.version, &s.extrainfo, &s.tunnel, &s.method, &s.conf})
+                    sqlite_bind(services_, i++, *v);
+                sqlite_step_done(db_, services_);
+                for (const auto& c : s.cpes) {
+                    sqlite3_bind_int64(cpes_, 1, port);
+                    sqlite_bind(cpes_, 2, c);
+                    sqlite_step_done(db_, cpes_);
+                }
+            }
+            for (const auto& sc : p.scripts) insert_script(host, port, sc);
+        }
+    }
+
+    // indexes go in after the bulk load; building them once is much cheaper
+    // than maintaining them row by row
+    void finish_load() override {
+        for (const auto& ix : k_relational_indexes) {
+            sqlite_exec_checked(db_, std::string("CREATE INDEX IF NOT EXISTS ") + ix[0] + " ON " + ix[1] + "(" + ix[2] + ");",
+                                "SQLite create index");
+        }
+    }
+
+private:
+    sqlite3_int64 max_id(const char* table) {
+        sqlite3_stmt* st = sqlite_prepare(db_, std::string("SELECT COALESCE(MAX(id),0) FROM ") + table + ";");
+        sqlite3_int64 v = sqlite3_step(st) == SQLITE_ROW ? sqlite3_column_int64(st, 0) : 0;
+        sqlite3_finalize(st);
+        return v;
+    }
+
+    void insert_script(sqlite3_int64 host, sqlite3_int64 port, const NmapScript& s) {
+        sqlite3_bind_int64(scripts_, 1, host);
+        if (port) sqlite3_bind_int64(scripts_, 2, port); else sqlite3_bind_null(scripts_, 2);
+        sqlite_bind(scripts_, 3, s.id);
+        sqlite_bind(scripts_, 4, s.output);
+        sqlite_step_done(db_, scripts_);
+    }
+
+    sqlite3* db_;
+    sqlite3_int64 host_id_ = 0, port_id_ = 0;
+    sqlite3_stmt* hosts_ = nullptr;
+    sqlite3_stmt* addresses_ = nullptr;
+    sqlite3_stmt* hostnames_ = nullptr;
+    sqlite3_stmt* ports_ = nullptr;
+    sqlite3_stmt* services_ = nullptr;
+    sqlite3_stmt* cpes_ = nullptr;
+    sqlite3_stmt* scripts_ = nullptr;
+};
+
+// Batched, transactional writer around a SqliteInserter. Statements are
+// prepared once by the inserter; records are swapped into the batch buffer
+// (the caller gets the old buffers back, so string capacity is recycled).
+// With `background`, full batches are swapped into a second buffer and
+// committed on a writer thread while the caller keeps filling the first one.
+// A batch that fails is rolled back and ends the load: later batches are
+// dropped rather than committed, so the checkpoint row never moves past
+// rows that were never stored, and flush()/finish() report the failure.
+class SqliteWriter {
+public:
+    using Rows = std::vector<Record>;
+
+    // `checkpoint` (input name and size): also keep xmlstream_checkpoint
+    // at the last record of each batch
+    SqliteWriter(sqlite3* db, std::unique_ptr<SqliteInserter> inserter, size_t batch, bool background,
+                 const CheckpointState* checkpoint = nullptr)
+        : db_(db), inserter_(std::move(inserter)), batch_(std::max<size_t>(1, batch)), background_(background) {
+        if (checkpoint) {
+            sqlite_ensure_checkpoint_table(db_);
+            checkpoint_ = sqlite_prepare(db_, "INSERT OR REPLACE INTO xmlstream_checkpoint(id,input,input_size,input_offset,skip)"
+                                              " VALUES(1,?,?,?,?);");
+            sqlite_bind(checkpoint_, 1, checkpoint->input);
+            sqlite3_bind_int64(checkpoint_, 2, (sqlite3_int64)checkpoint->input_size);
+        }
+        if (background_) thread_ = std::thread([this] { run(); });
+    }
+    ~SqliteWriter() {
+        finish();
+        if (checkpoint_) sqlite3_finalize(checkpoint_);
+    }
+
+    // takes the record's contents; `rec` is left with recycled buffers
+    void add(Record& rec) {
+        if (front_n_ < front_.size()) std::swap(front_[front_n_], rec);
+        else { front_.push_back(std::move(rec)); rec = Record(); }
+        if (++front_n_ >= batch_) submit();
+    }
+
+    // commit everything added so far and wait for it; false once a batch failed
+    bool flush() {
+        if (front_n_) submit();
+        if (background_) {
+            std::unique_lock<std::mutex> lk(m_);
+            idle_.wait(lk, [&] { return !back_ready_; });
+        }
+        return !failed_;
+    }
+
+    // a batch failed to commit (set on the writer thread)
+    bool failed() const { return failed_; }
+    // --serve: every request is its own batch, so one that failed (and was
+    // rolled back) doesn't stop the next
+    void clear_failed() { failed_ = false; }
+
+    // BEGIN..COMMIT time of every batch so far (read after finish())
+    const std::vector<double>& commit_latencies_ms() const { return commit_ms_; }
+
+    // stop the writer thread (without committing the open batch), run the
+    // inserter's post-load step and release its statements; false if a
+    // batch or that step failed
+    bool finish() {
+        if (thread_.joinable()) {
+            {
+                std::unique_lock<std::mutex> lk(m_);
+                idle_.wait(lk, [&] { return !back_ready_; });
+                stop_ = true;
+            }
+            work_.notify_all();
+            thread_.join();
+        }
+        if (inserter_) {
+            try { inserter_->finish_load(); }
+            catch (const std::exception& ex) {
+                std::cerr << "[!] SQLite: " << ex.what() << "\n";
+                failed_ = true;
+            }
+            inserter_.reset();
+        }
+        return !failed_;
+    }
+
+private:
+    void submit() {
+        if (!background_) {
+            commit_logged(front_, front_n_);
+            front_n_ = 0;
+            return;
+        }
+        std::unique_lock<std::mutex> lk(m_);
+        idle_.wait(lk, [&] { return !back_ready_; });
+        std::swap(front_, back_);
+        back_n_ = front_n_;
+        front_n_ = 0;
+        back_ready_ = true;
+        work_.notify_one();
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lk(m_);
+        for (;;) {
+            work_.wait(lk, [&] { return back_ready_ || stop_; });
+            if (!back_ready_) break;
+            lk.unlock();
+            commit_logged(back_, back_n_);
+            lk.lock();
+            back_ready_ = false;
+            idle_.notify_all();
+        }
+    }
+
+    void commit_logged(const Rows& rows, size_t n) {
+        if (failed_) return;
+        auto t0 = std::chrono::steady_clock::now();
+        try { commit(rows, n); }
+        catch (const std::exception& ex) {
+            std::cerr << "[!] SQLite: " << ex.what() << "\n";
+            failed_ = true;
+            return;
+        }
+        commit_ms_.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+    }
+
+    void commit(const Rows& rows, size_t n) {
+        sqlite_exec_checked(db_, "BEGIN;", "SQLite BEGIN");
+        try {
+            for (size_t i = 0; i < n; ++i) inserter_->insert(rows[i]);
+            if (checkpoint_ && n) {
+                sqlite3_bind_int64(checkpoint_, 3, (sqlite3_int64)rows[n - 1].resume_offset);
+                sqlite3_bind_int64(checkpoint_, 4, (sqlite3_int64)rows[n - 1].resume_skip);
+                sqlite_step_done(db_, checkpoint_);
+            }
+            sqlite_exec_checked(db_, "COMMIT;", "SQLite COMMIT");
+        } catch (...) {
+            sqlite3_exec(db_, "ROLLBACK;", nullptr, nullptr, nullptr);
+            throw;
+        }
+    }
+
+    sqlite3* db_;
+    std::unique_ptr<SqliteInserter> inserter_;
+    sqlite3_stmt* checkpoint_ = nullptr;    // the --checkpoint row
+    const size_t batch_;
+    const bool background_;
+    Rows front_, back_;
+    size_t front_n_ = 0, back_n_ = 0;
+    bool back_ready_ = false;
+    bool stop_ = false;
+    std::thread thread_;
+    std::mutex m_;
+    std::condition_variable work_, idle_;
+    std::vector<double> commit_ms_;
+    std::atomic<bool> failed_{false};
+};
+#endif
+
+// ---------- Parallel conversion pipeline ----------
+// reader thread --(detached record copies)--> N workers --(JSON)--> writer thread
+//
+// The reader hands over an xmlCopyNode() of each expanded record (the reader
+// frees its own subtree on the next read), workers run the record converter, and
+// a single writer thread feeds the sinks. In ordered mode results are put
+// back in input order through a ring of `depth` slots; the reader never has
+// more than `depth` records in flight, which also caps memory.
+
+// Bounded blocking queue; pop() returns false once closed and drained.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t cap) : cap_(std::max<size_t>(1, cap)) {}
+
+    void push(T v) {
+        std::unique_lock<std::mutex> lk(m_);
+        not_full_.wait(lk, [&] { return q_.size() < cap_; });
+        q_.push_back(std::move(v));
+        not_empty_.notify_one();
+    }
+    bool pop(T& v) {
+        std::unique_lock<std::mutex> lk(m_);
+        not_empty_.wait(lk, [&] { return !q_.empty() || closed_; });
+        if (q_.empty()) return false;
+        v = std::move(q_.front());
+        q_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> lk(m_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    const size_t cap_;
+    std::deque<T> q_;
+    bool closed_ = false;
+    std::mutex m_;
+    std::condition_variable not_full_, not_empty_;
+};
+
+struct RecordJob {
+    uint64_t seq = 0;
+    xmlNodePtr node = nullptr;              // detached copy, owned by the job
+    size_t route = 0;
+    uint64_t ordinal = 0;                   // records matched so far, this one included (Record::resume_skip)
+};
+
+struct RecordResult {
+    uint64_t seq = 0;
+    bool ok = false;                        // false: conversion failed or filtered out, nothing to write
+    Record rec;
+};
+
+// Releases items (anything with a `seq`) strictly in sequence order.
+template <typename T>
+class ReorderBuffer {
+public:
+    explicit ReorderBuffer(size_t depth) : slots_(std::max<size_t>(1, depth)) {}
+
+    // reader side: block until `seq` fits in the window
+    void reserve(uint64_t seq) {
+        std::unique_lock<std::mutex> lk(m_);
+        slot_free_.wait(lk, [&] { return seq < next_ + slots_.size(); });
+    }
+    void put(T r) {
+        std::lock_guard<std::mutex> lk(m_);
+        const uint64_t seq = r.seq;
+        slots_[seq % slots_.size()] = std::move(r);
+        if (seq == next_) ready_.notify_one();
+    }
+    bool take(T& r) {
+        std::unique_lock<std::mutex> lk(m_);
+        auto& slot = slots_[next_ % slots_.size()];
+        ready_.wait(lk, [&] { return slot.has_value() || closed_; });
+        if (!slot) return false;
+        r = std::move(*slot);
+        slot.reset();
+        ++next_;
+        slot_free_.notify_one();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> lk(m_);
+        closed_ = true;
+        ready_.notify_all();
+    }
+
+private:
+    std::vector<std::optional<T>> slots_;
+    uint64_t next_ = 0;
+    bool closed_ = false;
+    std::mutex m_;
+    std::condition_variable ready_, slot_free_;
+};
+
+class ConvertPipeline {
+public:
+    using Emit = std::function<void(Record& rec)>;
+
+    ConvertPipeline(const Options& opt, RecordConverter convert, Emit emit)
+        : opt_(opt), convert_(convert), ordered_(!opt.unordered),
+          depth_(opt.queue_depth > 0 ? (size_t)opt.queue_depth : (size_t)opt.threads * 16),
+          emit_(std::move(emit)), jobs_(depth_), results_(depth_), reorder_(depth_) {
+        for (int i = 0; i < opt_.threads; ++i) workers_.emplace_back([this] { work(); });
+        writer_ = std::thread([this] { write(); });
+    }
+    ~ConvertPipeline() { finish(); }
+
+    // takes ownership of `copy` (an xmlCopyNode of the record)
+    void submit(xmlNodePtr copy, size_t route, uint64_t ordinal) {
+        const uint64_t seq = next_seq_++;
+        if (ordered_) reorder_.reserve(seq);
+        jobs_.push(RecordJob{seq, copy, route, ordinal});
+    }
+
+    // drains everything submitted so far and stops the threads
+    void finish() {
+        if (finished_) return;
+        finished_ = true;
+        jobs_.close();
+        for (auto& t : workers_) t.join();
+        if (ordered_) reorder_.close(); else results_.close();
+        writer_.join();
+    }
+
+private:
+    void work() {
+        RecordJob job;
+        while (jobs_.pop(job)) {
+            RecordResult r;
+            r.seq = job.seq;
+            r.rec.route = job.route;
+            r.rec.resume_skip = job.ordinal;
+            try {
+                r.ok = convert_(job.node, opt_, r.rec, nullptr, nullptr);
+            } catch (const std::exception& ex) {
+                std::cerr << "[!] Record " << job.seq << ": " << ex.what() << "\n";
+            }
+            xmlFreeNode(job.node);
+            if (ordered_) reorder_.put(std::move(r)); else results_.push(std::move(r));
+        }
+    }
+    void write() {
+        RecordResult r;
+        while (ordered_ ? reorder_.take(r) : results_.pop(r)) {
+            if (r.ok) emit_(r.rec);
+        }
+    }
+
+    const Options& opt_;
+    const RecordConverter convert_;
+    const bool ordered_;
+    const size_t depth_;
+    Emit emit_;
+    BoundedQueue<RecordJob> jobs_;
+    BoundedQueue<RecordResult> results_;    // unordered mode
+    ReorderBuffer<RecordResult> reorder_;   // ordered mode
+    std::vector<std::thread> workers_;
+    std::thread writer_;
+    uint64_t next_seq_ = 0;
+    bool finished_ = false;
+};
+
+// ---------- Input backends (mmap / buffered read) ----------
+// Uncompressed regular files (including stdin redirected from one) are
+// mmapped and handed to libxml2 through xmlReaderForIO: one memcpy from the
+// page cache into the parser's buffer and no read() syscalls. Pipes get
+// large aligned read()s instead of libxml2's 4 KB requests.
+
+// read() that retries on EINTR; -1 on error
+static ssize_t read_full(int fd, void* buf, size_t n) {
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = ::read(fd, static_cast<char*>(buf) + got, n - got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+    int fd = -1;
+    bool own_fd = true;
+
+    bool open(const std::string& path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        return map();
+    }
+    // maps an already open fd (kept open unless `own`)
+    bool open_fd(int f, bool own) {
+        fd = f;
+        own_fd = own;
+        return map();
+    }
+    ~MappedFile() {
+        if (data) munmap(const_cast<char*>(data), size);
+        if (fd >= 0 && own_fd) ::close(fd);
+    }
+
+private:
+    bool map() {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+        size = (size_t)st.st_size;
+        if (size == 0) return true;
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) { size = 0; return false; }
+        data = static_cast<const char*>(p);
+        return true;
+    }
+};
+
+// Sequential reader over a mapping. Read-ahead is left to the kernel
+// (MADV_SEQUENTIAL / POSIX_FADV_SEQUENTIAL); everything behind the parser is
+// dropped from the mapping and the page cache every k_drop_step bytes, so
+// inputs larger than RAM stream through without evicting the rest of the
+// page cache (libxml2 has copied those bytes already).
+class MmapInput {
+public:
+    static constexpr size_t k_drop_step = 64u << 20;
+
+    // Maps `fd` (closed with this object if `own_fd`); on failure the fd is
+    // left to the caller. `start`: where reading begins (stdin may already
+    // be positioned).
+    bool open(int fd, bool own_fd, size_t start) {
+        if (!mf_.open_fd(fd, own_fd)) { mf_.own_fd = false; return false; }
+        pos_ = std::min(start, mf_.size);
+        dropped_ = pos_ & ~(page_size() - 1);
+        posix_fadvise(mf_.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        if (mf_.data) {
+            madvise(const_cast<char*>(mf_.data), mf_.size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+            madvise(const_cast<char*>(mf_.data), mf_.size, MADV_HUGEPAGE);   // best effort
+#endif
+        }
+        return true;
+    }
+
+    static int io_read(void* ctx, char* buf, int len) {
+        auto* in = static_cast<MmapInput*>(ctx);
+        const size_t k = std::min<size_t>((size_t)len, in->mf_.size - in->pos_);
+        std::memcpy(buf, in->mf_.data + in->pos_, k);
+        in->pos_ += k;
+        if (in->pos_ - in->dropped_ >= k_drop_step) in->drop_behind();
+        return (int)k;
+    }
+    static int io_close(void*) { return 0; }
+
+private:
+    static size_t page_size() { return (size_t)sysconf(_SC_PAGESIZE); }
+
+    void drop_behind() {
+        const size_t upto = pos_ & ~(page_size() - 1);
+        if (upto <= dropped_) return;
+        madvise(const_cast<char*>(mf_.data) + dropped_, upto - dropped_, MADV_DONTNEED);
+        posix_fadvise(mf_.fd, (off_t)dropped_, (off_t)(upto - dropped_), POSIX_FADV_DONTNEED);
+        dropped_ = upto;
+    }
+
+    MappedFile mf_;
+    size_t pos_ = 0, dropped_ = 0;
+};
+
+// Pipes: replays `prefix` (bytes already read while sniffing; pipes can't
+// seek back), then serves libxml2 from 1 MB page-aligned read()s.
+class BufferedFdInput {
+public:
+    static constexpr size_t k_buf = 1u << 20;
+
+    BufferedFdInput(int fd, bool own_fd, std::string prefix)
+        : fd_(fd), own_fd_(own_fd), prefix_(std::move(prefix)) {
+        void* p = nullptr;
+        if (posix_memalign(&p, 4096, k_buf) == 0) buf_ = static_cast<char*>(p);
+    }
+    ~BufferedFdInput() {
+        free(buf_);
+        if (own_fd_) ::close(fd_);
+    }
+    BufferedFdInput(const BufferedFdInput&) = delete;
+    BufferedFdInput& operator=(const BufferedFdInput&) = delete;
+
+    static int io_read(void* ctx, char* buf, int len) {
+        auto* in = static_cast<BufferedFdInput*>(ctx);
+        if (in->ppos_ < in->prefix_.size()) {
+            const size_t k = std::min<size_t>((size_t)len, in->prefix_.size() - in->ppos_);
+            std::memcpy(buf, in->prefix_.data() + in->ppos_, k);
+            in->ppos_ += k;
+            return (int)k;
+        }
+        if (!in->buf_) return -1;
+        if (in->off_ == in->n_) {
+            ssize_t r;
+            do r = ::read(in->fd_, in->buf_, k_buf); while (r < 0 && errno == EINTR);
+            if (r <= 0) return (int)r;
+            in->n_ = (size_t)r;
+            in->off_ = 0;
+        }
+        const size_t k = std::min<size_t>((size_t)len, in->n_ - in->off_);
+        std::memcpy(buf, in->buf_ + in->off_, k);
+        in->off_ += k;
+        return (int)k;
+    }
+    static int io_close(void*) { return 0; }
+
+private:
+    int fd_;
+    bool own_fd_;
+    std::string prefix_;
+    size_t ppos_ = 0;
+    char* buf_ = nullptr;
+    size_t n_ = 0, off_ = 0;
+};
+
+// ---------- Compressed streams (gzip / zstd / xz) ----------
+// Input: the first bytes of the input are sniffed for a gzip/zstd/xz magic
+// number. Compressed input is decoded on its own thread into a ring of
+// fixed-size blocks (two BoundedQueues: free and filled), and libxml2 pulls
+// from the ring through xmlReaderForIO. Output: --compress wraps the output
+// fd in a streambuf that compresses as the writers fill it.
+//
+// Each codec is optional: -DWITH_ZLIB -lz, -DWITH_ZSTD -lzstd, -DWITH_LZMA -llzma.
+enum class Codec { none, gzip, zstd, xz };
+
+static const char* codec_name(Codec c) {
+    switch (c) {
+        case Codec::gzip: return "gzip";
+        case Codec::zstd: return "zstd";
+        case Codec::xz:   return "xz";
+        default:          return "none";
+    }
+}
+
+static bool codec_compiled(Codec c) {
+    switch (c) {
+#ifdef WITH_ZLIB
+        case Codec::gzip: return true;
+#endif
+#ifdef WITH_ZSTD
+        case Codec::zstd: return true;
+#endif
+#ifdef WITH_LZMA
+        case Codec::xz:   return true;
+#endif
+        case Codec::none: return true;
+        default:          return false;
+    }
+}
+
+static Codec sniff_codec(const unsigned char* p, size_t n) {
+    if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) return Codec::gzip;
+    if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) return Codec::zstd;
+    if (n >= 6 && std::memcmp(p, "\xfd" "7zXZ\0", 6) == 0) return Codec::xz;
+    return Codec::none;
+}
+
+// One streaming (de)compressor. process() consumes from `in` and produces
+// into `out`, advancing both; `finish` asks an encoder to end the stream.
+// Returns false on a codec error (message in `err`). Decoders accept
+// concatenated members/frames.
+class CodecStream {
+public:
+    virtual ~CodecStream() = default;
+    virtual bool process(const uint8_t*& in, size_t& in_n, uint8_t*& out, size_t& out_n, bool finish) = 0;
+    // encoders: true once `finish` has flushed everything
+    virtual bool finished() const { return true; }
+    // decoders: false when the input stopped inside a member/frame
+    virtual bool complete() const { return true; }
+    std::string err;
+};
+
+#ifdef WITH_ZLIB
+class ZlibStream : public CodecStream {
+public:
+    // level < 0: inflate (gzip or zlib), otherwise deflate to gzip at `level`
+    explicit ZlibStream(int level) : encode_(level >= 0) {
+        std::memset(&z_, 0, sizeof(z_));
+        int rc = encode_ ? deflateInit2(&z_, std::min(level, 9), Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)
+                         : inflateInit2(&z_, 15 + 32);
+        if (rc != Z_OK) err = "zlib init failed";
+    }
+    ~ZlibStream() override { if (encode_) deflateEnd(&z_); else inflateEnd(&z_); }
+
+    bool process(const uint8_t*& in, size_t& in_n, uint8_t*& out, size_t& out_n, bool finish) override {
+        if (!err.empty()) return false;
+        z_.next_in = const_cast<Bytef*>(in);
+        z_.avail_in = (uInt)std::min<size_t>(in_n, 1u << 30);
+        z_.next_out = out;
+        z_.avail_out = (uInt)std::min<size_t>(out_n, 1u << 30);
+        const uInt in0 = z_.avail_in, out0 = z_.avail_out;
+        int rc = encode_ ? deflate(&z_, finish ? Z_FINISH : Z_NO_FLUSH) : inflate(&z_, Z_NO_FLUSH);
+        in += in0 - z_.avail_in;   in_n -= in0 - z_.avail_in;
+        out += out0 - z_.avail_out; out_n -= out0 - z_.avail_out;
+        if (in0 != z_.avail_in) mid_ = true;
+        if (rc == Z_STREAM_END) {
+            if (encode_) done_ = true;
+            else inflateReset(&z_);     // next gzip member, if any
+            mid_ = false;
+            return true;
+        }
+        if (rc == Z_OK || rc == Z_BUF_ERROR) return true;
+        err = std::string("zlib: ") + (z_.msg ? z_.msg : "stream error");
+        return false;
+    }
+    bool finished() const override { return done_; }
+    bool complete() const override { return !mid_; }
+
+private:
+    z_stream z_;
+    const bool encode_;
+    bool done_ = false;
+    bool mid_ = false;
+};
+#endif
+
+#ifdef WITH_ZSTD
+class ZstdStream : public CodecStream {
+public:
+    // level < 0: decompress; otherwise compress at `level` on `workers` threads
+    ZstdStream(int level, int workers) : encode_(level >= 0) {
+        if (encode_) {
+            c_ = ZSTD_createCCtx();
+            ZSTD_CCtx_setParameter(c_, ZSTD_c_compressionLevel, level);
+            if (workers > 0 && ZSTD_isError(ZSTD_CCtx_setParameter(c_, ZSTD_c_nbWorkers, workers)))
+                std::cerr << "[!] libzstd was built without threads; compressing on one thread\n";
+        } else {
+            d_ = ZSTD_createDCtx();
+        }
+        if (!c_ && !d_) err = "zstd init failed";
+    }
+    ~ZstdStream() override { ZSTD_freeCCtx(c_); ZSTD_freeDCtx(d_); }
+
+    bool process(const uint8_t*& in, size_t& in_n, uint8_t*& out, size_t& out_n, bool finish) override {
+        if (!err.empty()) return false;
+        ZSTD_inBuffer ib = {in, in_n, 0};
+        ZSTD_outBuffer ob = {out, out_n, 0};
+        size_t rc = encode_ ? ZSTD_compressStream2(c_, &ob, &ib, finish ? ZSTD_e_end : ZSTD_e_continue)
+                            : ZSTD_decompressStream(d_, &ob, &ib);
+        in += ib.pos;  in_n -= ib.pos;
+        out += ob.pos; out_n -= ob.pos;
+        if (ZSTD_isError(rc)) { err = std::string("zstd: ") + ZSTD_getErrorName(rc); return false; }
+        if (encode_ && finish && rc == 0) done_ = true;
+        if (!encode_ && (ib.pos || ob.pos)) mid_ = rc != 0;   // 0: frame done and flushed
+        return true;
+    }
+    bool finished() const override { return done_; }
+    bool complete() const override { return !mid_; }
+
+private:
+    const bool encode_;
+    ZSTD_CCtx* c_ = nullptr;
+    ZSTD_DCtx* d_ = nullptr;
+    bool done_ = false;
+    bool mid_ = false;
+};
+#endif
+
+#ifdef WITH_LZMA
+// xz input only (.xml.xz archives); concatenated streams are accepted
+class LzmaDecodeStream : public CodecStream {
+public:
+    LzmaDecodeStream() {
+        if (lzma_stream_decoder(&s_, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) err = "xz init failed";
+    }
+    ~LzmaDecodeStream() override { lzma_end(&s_); }
+
+    bool process(const uint8_t*& in, size_t& in_n, uint8_t*& out, size_t& out_n, bool finish) override {
+        if (!err.empty()) return false;
+        s_.next_in = in;   s_.avail_in = in_n;
+        s_.next_out = out; s_.avail_out = out_n;
+        lzma_ret rc = lzma_code(&s_, finish ? LZMA_FINISH : LZMA_RUN);
+        in += in_n - s_.avail_in;    in_n = s_.avail_in;
+        out += out_n - s_.avail_out; out_n = s_.avail_out;
+        if (rc == LZMA_STREAM_END) ended_ = true;
+        if (rc == LZMA_OK || rc == LZMA_STREAM_END || rc == LZMA_BUF_ERROR) return true;
+        err = "xz: corrupt input (lzma error " + std::to_string((int)rc) + ")";
+        return false;
+    }
+    bool complete() const override { return ended_; }
+
+private:
+    lzma_stream s_ = LZMA_STREAM_INIT;
+    bool ended_ = false;
+};
+#endif
+
+// nullptr when the codec is not compiled in
+static std::unique_ptr<CodecStream> make_decoder(Codec c) {
+    switch (c) {
+#ifdef WITH_ZLIB
+        case Codec::gzip: return std::unique_ptr<CodecStream>(new ZlibStream(-1));
+#endif
+#ifdef WITH_ZSTD
+        case Codec::zstd: return std::unique_ptr<CodecStream>(new ZstdStream(-1, 0));
+#endif
+#ifdef WITH_LZMA
+        case Codec::xz:   return std::unique_ptr<CodecStream>(new LzmaDecodeStream());
+#endif
+        default:          return nullptr;
+    }
+}
+
+static std::unique_ptr<CodecStream> make_encoder(Codec c, int level, int threads) {
+    switch (c) {
+#ifdef WITH_ZLIB
+        case Codec::gzip: return std::unique_ptr<CodecStream>(new ZlibStream(level < 0 ? 6 : level));
+#endif
+#ifdef WITH_ZSTD
+        case Codec::zstd: return std::unique_ptr<CodecStream>(new ZstdStream(level < 0 ? 3 : level, threads));
+#endif
+        default:          (void)level; (void)threads; return nullptr;
+    }
+}
+
+// Background decoder: fd -> CodecStream -> ring of `nblocks` blocks -> read().
+// `prefix` holds bytes already consumed from fd while sniffing the codec.
+class DecompressReader {
+public:
+    DecompressReader(int fd, bool own_fd, Codec codec, std::string prefix,
+                     size_t block = 1u << 20, size_t nblocks = 8)
+        : fd_(fd), own_fd_(own_fd), codec_(codec), dec_(make_decoder(codec)), prefix_(std::move(prefix)),
+          free_(nblocks), full_(nblocks) {
+        for (size_t i = 0; i < nblocks; ++i) {
+            Block b;
+            b.data.resize(block);
+            free_.push(std::move(b));
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+    ~DecompressReader() {
+        // unblock the decoder if the consumer stopped early, then wait for it
+        stop_ = true;
+        Block b;
+        if (cur_.data.size()) free_.push(std::move(cur_));
+        while (full_.pop(b)) free_.push(std::move(b));
+        free_.close();
+        thread_.join();
+        if (own_fd_) ::close(fd_);
+    }
+
+    // xmlInputReadCallback: bytes copied, 0 at end of input, -1 on error
+    int read(char* buf, int len) {
+        int n = 0;
+        while (n < len) {
+            if (cur_pos_ == cur_.n) {
+                if (cur_.data.size()) free_.push(std::move(cur_));
+                cur_ = Block();
+                cur_pos_ = 0;
+                if (!full_.pop(cur_)) break;
+                delivered_.store(cur_.src, std::memory_order_relaxed);
+            }
+            const size_t k = std::min<size_t>(len - n, cur_.n - cur_pos_);
+            std::memcpy(buf + n, cur_.data.data() + cur_pos_, k);
+            cur_pos_ += k;
+            n += (int)k;
+        }
+        if (n == 0 && failed_) return -1;
+        return n;
+    }
+
+    // compressed bytes behind the data handed to libxml2 so far (the decoder
+    // itself runs up to a ring ahead)
+    uint64_t compressed_consumed() const { return delivered_.load(std::memory_order_relaxed); }
+
+    static int io_read(void* ctx, char* buf, int len) { return static_cast<DecompressReader*>(ctx)->read(buf, len); }
+    static int io_close(void*) { return 0; }
+
+private:
+    struct Block { std::string data; size_t n = 0; uint64_t src = 0; };
+
+    void run() {
+        std::vector<uint8_t> in(256u << 10);
+        uint64_t consumed = 0;
+        size_t in_n = std::min(prefix_.size(), in.size());
+        std::memcpy(in.data(), prefix_.data(), in_n);
+        const uint8_t* ip = in.data();
+        bool eof = false;
+        Block b;
+        bool have = false;
+        while (!stop_) {
+            if (in_n == 0 && !eof) {
+                ssize_t r = read_full(fd_, in.data(), in.size());
+                if (r < 0) { std::cerr << "[!] Failed to read input\n"; failed_ = true; break; }
+                if (r == 0) eof = true;
+                ip = in.data();
+                in_n = (size_t)r;
+                consumed += (uint64_t)r;
+            }
+            if (!have) {
+                if (!free_.pop(b)) break;
+                b.n = 0;
+                have = true;
+            }
+            uint8_t* op = reinterpret_cast<uint8_t*>(&b.data[b.n]);
+            size_t out_n = b.data.size() - b.n;
+            const size_t in_before = in_n, out_before = out_n;
+            if (!dec_->process(ip, in_n, op, out_n, eof)) {
+                std::cerr << "[!] " << dec_->err << "\n";
+                failed_ = true;
+                break;
+            }
+            b.n = b.data.size() - out_n;
+            const bool progress = in_n != in_before || out_n != out_before;
+            if (!progress && in_n > 0 && out_n > 0) {
+                std::cerr << "[!] " << codec_name(codec_) << ": trailing garbage after the compressed stream\n";
+                failed_ = true;
+                break;
+            }
+            if (out_n == 0 || (eof && !progress)) {
+                b.src = consumed - in_n;
+                if (b.n) full_.push(std::move(b));
+                have = false;
+            }
+            if (eof && in_n == 0 && !progress) {        // decoder has nothing left
+                if (!dec_->complete()) {
+                    std::cerr << "[!] " << codec_name(codec_) << " input is truncated\n";
+                    failed_ = true;
+                }
+                break;
+            }
+        }
+        if (have && b.n && !stop_) { b.src = consumed; full_.push(std::move(b)); }
+        full_.close();
+    }
+
+    int fd_;
+    bool own_fd_;
+    Codec codec_;
+    std::unique_ptr<CodecStream> dec_;
+    std::string prefix_;
+    BoundedQueue<Block> free_, full_;
+    Block cur_;
+    size_t cur_pos_ = 0;
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> failed_{false};
+    std::atomic<uint64_t> delivered_{0};
+    std::thread thread_;
+};
+
+// An input opened through the backend its first bytes call for: the
+// background decoder for compressed data, a mapping for regular files,
+// buffered read()s for pipes. read/close/ctx feed xmlReaderForIO or the SAX
+// parser; they stay null when libxml2 is to open the file itself (gzip or xz
+// without our codec, which its own decoder may handle).
+struct InputSource {
+    std::unique_ptr<DecompressReader> decomp;
+    std::unique_ptr<MmapInput> mmap;
+    std::unique_ptr<BufferedFdInput> fd;
+    xmlInputReadCallback read = nullptr;
+    xmlInputCloseCallback close = nullptr;
+    void* ctx = nullptr;
+};
+
+// Opens `path` ("-": stdin) into `in`. `sax`: the SAX parser reads it, so
+// libxml2 can't decode for us. 0, or the exit code after a message.
+static int input_open(const std::string& path, bool sax, InputSource& in) {
+    const bool from_stdin = (path == "-");
+    const int fd = from_stdin ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+    const off_t start = fd < 0 ? 0 : std::max<off_t>(0, lseek(fd, 0, SEEK_CUR));
+    unsigned char magic[6];
+    const ssize_t nmagic = fd < 0 ? -1 : read_full(fd, magic, sizeof(magic));
+    if (nmagic < 0) {
+        std::cerr << "[!] Failed to open input\n";
+        if (fd >= 0 && !from_stdin) ::close(fd);
+        return 4;
+    }
+    const Codec codec = sniff_codec(magic, (size_t)nmagic);
+    std::string prefix(reinterpret_cast<const char*>(magic), (size_t)nmagic);
+    static const char* const flags[] = {"", "-DWITH_ZLIB -lz", "-DWITH_ZSTD -lzstd", "-DWITH_LZMA -llzma"};
+
+    if (codec != Codec::none && codec_compiled(codec)) {
+        in.decomp.reset(new DecompressReader(fd, !from_stdin, codec, std::move(prefix)));
+        in.read = DecompressReader::io_read;
+        in.close = DecompressReader::io_close;
+        in.ctx = in.decomp.get();
+    } else if (codec != Codec::none && (from_stdin || codec == Codec::zstd)) {
+        // libxml2 may decode gzip/xz files on its own, but never pipes or zstd
+        std::cerr << "[!] Input is " << codec_name(codec) << "-compressed; rebuild with "
+                  << flags[(int)codec] << " or decompress it first\n";
+        if (!from_stdin) ::close(fd);
+        return 4;
+    } else if (codec != Codec::none && sax) {
+        std::cerr << "[!] --parser sax: input is " << codec_name(codec) << "-compressed; rebuild with "
+                  << flags[(int)codec] << " or decompress it first\n";
+        ::close(fd);
+        return 4;
+    } else if (codec != Codec::none) {
+        ::close(fd);
+    } else {
+        in.mmap.reset(new MmapInput());
+        if (in.mmap->open(fd, !from_stdin, (size_t)start)) {
+            in.read = MmapInput::io_read;
+            in.close = MmapInput::io_close;
+            in.ctx = in.mmap.get();
+        } else {
+            // a pipe, FIFO or other unmappable input
+            in.mmap.reset();
+            in.fd.reset(new BufferedFdInput(fd, !from_stdin, std::move(prefix)));
+            in.read = BufferedFdInput::io_read;
+            in.close = BufferedFdInput::io_close;
+            in.ctx = in.fd.get();
+        }
+    }
+    return 0;
+}
+
+// A reader over `path` (see input_open), or nullptr after a message
+static xmlTextReaderPtr input_reader(const std::string& path, InputSource& in) {
+    if (input_open(path, false, in) != 0) return nullptr;
+    const char* url = path == "-" ? nullptr : path.c_str();
+    xmlTextReaderPtr r = in.read ? xmlReaderForIO(in.read, in.close, in.ctx, url, nullptr, k_parse_options)
+                                 : xmlReaderForFile(path.c_str(), nullptr, k_parse_options);
+    if (!r) std::cerr << "[!] Failed to open input\n";
+    return r;
+}
+
+// --compress: an OutBuf whose flushed bytes are compressed on their way to
+// the fd
+class CompressingOut : public OutBuf {
+public:
+    CompressingOut(int fd, bool own_fd, size_t cap, std::unique_ptr<CodecStream> enc)
+        : OutBuf(fd, own_fd, cap), enc_(std::move(enc)), zbuf_(1u << 20) {
+        passthrough_ = false;
+    }
+    ~CompressingOut() override { finish(); }
+
+protected:
+    // compress `p` (and with `end`, close the stream)
+    bool drain(const char* p, size_t n, bool end) override {
+        const uint8_t* ip = reinterpret_cast<const uint8_t*>(p);
+        size_t in_n = n;
+        do {
+            uint8_t* op = zbuf_.data();
+            size_t out_n = zbuf_.size();
+            if (!enc_->process(ip, in_n, op, out_n, end)) {
+                std::cerr << "[!] " << enc_->err << "\n";
+                return false;
+            }
+            if (!sink(reinterpret_cast<const char*>(zbuf_.data()), zbuf_.size() - out_n)) return false;
+        } while (in_n > 0 || (end && !enc_->finished()));
+        return true;
+    }
+
+private:
+    std::unique_ptr<CodecStream> enc_;
+    std::vector<uint8_t> zbuf_;
+};
+
+// ---------- Chunked parallel parsing (--chunked) ----------
+// The input file is mmapped and cut at `<record-name` start positions into
+// chunks of roughly --chunk-size bytes. Each chunk is parsed by its own push
+// parser on a worker thread, fed as: prolog + chunk, where the prolog is
+// everything before the first record (XML declaration, DOCTYPE/entities,
+// the opening tags of the enclosing elements with their xmlns declarations),
+// so every chunk sees the same namespace and entity context.
+//
+// Records are converted on their end tag and freed immediately; chunks other
+// than the last are abandoned unterminated (their ancestors never close), so
+// no spurious "premature end" errors are raised.
+//
+// Assumes record elements never nest and `<record-name` does not appear in
+// comments or CDATA -- true for Nmap <host>. Records are told by name alone
+// (a chunk doesn't know its ancestors), so only //name record paths apply.
+
+// next `<tag` that starts an element named exactly `tag` at or after `from`
+static size_t find_record_start(const char* data, size_t size, size_t from, const std::string& tag) {
+    const std::string needle = "<" + tag;
+    while (from < size) {
+        const void* hit = memmem(data + from, size - from, needle.data(), needle.size());
+        if (!hit) return size;
+        const size_t pos = (size_t)(static_cast<const char*>(hit) - data);
+        const size_t after = pos + needle.size();
+        if (after >= size) return size;
+        const char c = data[after];
+        if (c == '>' || c == '/' || c == ' ' || c == '\t' || c == '\r' || c == '\n') return pos;
+        from = after;                       // e.g. <hostnames> when looking for <host
+    }
+    return size;
+}
+
+// the earliest start of any of the record names (each later name is only
+// looked for up to the best hit so far, so a rare one isn't scanned to EOF)
+static size_t find_record_start(const char* data, size_t size, size_t from, const std::vector<std::string>& tags) {
+    size_t best = size;
+    for (const std::string& t : tags) {
+        const size_t limit = std::min(size, best + t.size() + 2);
+        best = std::min(best, find_record_start(data, limit, from, t));
+    }
+    return best;
+}
+
+struct ChunkResult {
+    uint64_t seq = 0;
+    std::vector<Record> rows;
+};
+
+struct ChunkParseState {
+    static constexpr size_t k_batch = 256;  // records per hand-over to `batches`
+
+    const Options* opt = nullptr;
+    RecordConverter convert = nullptr;
+    int in_record = 0;                      // record element nesting depth
+    size_t route = 0;                       // of the open record
+    std::unique_ptr<RecordMatcher> match;   // names interned in this chunk's dictionary
+    ChunkResult* out = nullptr;
+    uint64_t begin = 0;                     // chunk start (Record::resume_offset)
+    uint64_t matched = 0;                   // records started in this chunk
+    uint64_t skip = 0;                      // --resume: records already converted (first chunk)
+
+    // several inputs (see inputs_convert)
+    bool whole = false;                     // a whole document: records are matched by path
+    size_t depth = 0;                       // open elements
+    size_t prolog = 0;                      // prolog bytes fed ahead of the chunk
+    const std::string* source = nullptr;    // the file (Record::source)
+    uint64_t offset = 0;                    // the open record's start tag
+    BoundedQueue<ChunkResult>* batches = nullptr;   // takes `out` every k_batch records
+};
+
+// the input offset of the start tag whose startElementNs is running: the
+// parser is at (or just before) its '>', and attribute values can't hold '<'
+static uint64_t start_tag_offset(xmlParserCtxtPtr ctxt) {
+    const xmlParserInputPtr in = ctxt->input;
+    const xmlChar* p = in->cur;
+    while (p > in->base && *p != '<') --p;
+    return (uint64_t)std::max(0L, xmlByteConsumed(ctxt)) - (uint64_t)(in->cur - p);
+}
+
+static void chunk_start_element(void* ctx, const xmlChar* localname, const xmlChar* prefix,
+                                const xmlChar* URI, int nb_namespaces, const xmlChar** namespaces,
+                                int nb_attributes, int nb_defaulted, const xmlChar** attributes) {
+    xmlParserCtxtPtr ctxt = static_cast<xmlParserCtxtPtr>(ctx);
+    auto* st = static_cast<ChunkParseState*>(ctxt->_private);
+    xmlSAX2StartElementNs(ctx, localname, prefix, URI, nb_namespaces, namespaces,
+                          nb_attributes, nb_defaulted, attributes);
+    const size_t depth = st->depth++;
+    if (st->in_record) {
+        ++st->in_record;
+    } else {
+        const int route = st->match->match(st->whole ? depth : 0, localname, prefix);
+        if (route >= 0) {
+            st->route = (size_t)route;
+            st->in_record = 1;
+            ++st->matched;
+            if (st->source) st->offset = st->begin + start_tag_offset(ctxt) - st->prolog;
+        }
+    }
+}
+
+static void chunk_end_element(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI) {
+    xmlParserCtxtPtr ctxt = static_cast<xmlParserCtxtPtr>(ctx);
+    auto* st = static_cast<ChunkParseState*>(ctxt->_private);
+    xmlNodePtr cur = ctxt->node;
+    xmlSAX2EndElementNs(ctx, localname, prefix, URI);
+    if (st->depth) --st->depth;
+    const bool record_end = st->in_record == 1;
+    if (st->in_record && --st->in_record > 0) return;   // still inside a record
+    if (!cur || cur->type != XML_ELEMENT_NODE || !cur->parent) return;
+    if (record_end && st->matched > st->skip) {
+        Record rec;
+        rec.route = st->route;
+        rec.resume_offset = st->begin;
+        rec.resume_skip = st->matched;
+        rec.source = st->source;
+        rec.source_offset = st->offset;
+        try {
+            if (st->convert(cur, *st->opt, rec, nullptr, nullptr)) st->out->rows.push_back(std::move(rec));
+        } catch (const std::exception& ex) {
+            std::cerr << "[!] Record: " << ex.what() << "\n";
+        }
+        if (st->batches && st->out->rows.size() >= ChunkParseState::k_batch) {
+            st->batches->push(std::move(*st->out));
+            *st->out = ChunkResult();
+        }
+    }
+    // finished elements outside records are never looked at again
+    xmlUnlinkNode(cur);
+    xmlFreeNode(cur);
+}
+
+// a push parser feeding `st`; null if none could be created
+static xmlParserCtxtPtr chunk_parser_new(ChunkParseState& st, const char* url = nullptr) {
+    xmlSAXHandler sax;
+    std::memset(&sax, 0, sizeof(sax));
+    xmlSAXVersion(&sax, 2);
+    sax.startElementNs = chunk_start_element;
+    sax.endElementNs = chunk_end_element;
+
+    xmlParserCtxtPtr ctxt = xmlCreatePushParserCtxt(&sax, nullptr, nullptr, 0, url);
+    if (!ctxt) return nullptr;
+    xmlCtxtUseOptions(ctxt, k_parse_options);
+    ctxt->_private = &st;
+    st.match.reset(new RecordMatcher(*st.opt->records, ctxt->dict));
+    return ctxt;
+}
+
+static void chunk_parser_free(xmlParserCtxtPtr ctxt) {
+    if (ctxt->myDoc) xmlFreeDoc(ctxt->myDoc);
+    ctxt->myDoc = nullptr;
+    xmlFreeParserCtxt(ctxt);
+}
+
+// Parses [begin, end) of `mf` after the `prolog_len` bytes of prolog.
+// False if the parser gave up on the chunk (its records after the error
+// are lost), or none could be created.
+static bool parse_chunk(const MappedFile& mf, size_t prolog_len, size_t begin, size_t end, bool last,
+                        ChunkParseState& st) {
+    xmlParserCtxtPtr ctxt = chunk_parser_new(st);
+    if (!ctxt) return false;
+    st.prolog = prolog_len;
+
+    // feed in bounded pieces: libxml2 takes an int length, and without
+    // XML_PARSE_HUGE it rejects more than 10 MB of unparsed input at once
+    constexpr size_t step = 1u << 18;
+    static_assert(step < XML_MAX_LOOKUP_LIMIT, "chunk pieces must stay under libxml2's lookup limit");
+    auto feed = [&](const char* p, size_t n, bool terminate) {
+        do {
+            const size_t k = std::min(n, step);
+            xmlParseChunk(ctxt, p, (int)k, terminate && k == n);
+            p += k; n -= k;
+        } while (n > 0);
+    };
+    if (prolog_len) feed(mf.data, prolog_len, false);
+    feed(mf.data + begin, end - begin, last);
+    const bool ok = ctxt->wellFormed || g_stop_requested;
+    chunk_parser_free(ctxt);
+    return ok;
+}
+
+// Chunk boundaries from record start `from` on: each chunk starts on a
+// record and ends where the next one starts, the last at the end of the file.
+static std::vector<size_t> chunk_bounds(const MappedFile& mf, const std::vector<std::string>& tags, size_t from,
+                                        size_t chunk_size) {
+    std::vector<size_t> bounds{from};
+    while (bounds.back() < mf.size) {
+        const size_t target = bounds.back() + std::max<size_t>(chunk_size, 1);
+        bounds.push_back(target >= mf.size ? mf.size : find_record_start(mf.data, mf.size, target, tags));
+    }
+    if (bounds.size() < 2) bounds.push_back(mf.size);
+    return bounds;
+}
+
+// Returns false (with a message) if the file can't be mapped or a chunk
+// fails to parse (the other chunks are still written). --resume: chunks
+// start at record boundary `start` instead, and the first `skip` records
+// from there are dropped.
+static bool chunked_convert(const Options& opt, RecordConverter convert, const ConvertPipeline::Emit& emit,
+                            uint64_t start = 0, uint64_t skip = 0) {
+    MappedFile mf;
+    if (!mf.open(opt.input)) {
+        std::cerr << "[!] --chunked: cannot mmap " << opt.input << "\n";
+        return false;
+    }
+    madvise(const_cast<char*>(mf.data), mf.size, MADV_WILLNEED);
+
+    // chunk boundaries: each starts on a record (except the first, which
+    // starts on the first record and owns no prolog of its own)
+    const std::vector<std::string>& tags = opt.records->routes;
+    const size_t first = find_record_start(mf.data, mf.size, 0, tags);
+    if (start && (start < first || start > mf.size ||
+                  (start < mf.size && find_record_start(mf.data, mf.size, start, tags) != start))) {
+        std::cerr << "[!] --resume: offset " << start << " is not a record boundary of " << opt.input << "\n";
+        return false;
+    }
+    const std::vector<size_t> bounds = chunk_bounds(mf, tags, start ? (size_t)start : first, opt.chunk_size);
+    const size_t nchunks = bounds.size() - 1;
+
+    const int nthreads = std::max(1, opt.threads);
+    const size_t window = (size_t)nthreads * 2;
+    ReorderBuffer<ChunkResult> reorder(window);
+    BoundedQueue<ChunkResult> done(window);
+    std::atomic<size_t> next_chunk{0};
+    std::atomic<int> running{nthreads};
+    std::atomic<bool> failed{false};
+
+    auto work = [&] {
+        for (;;) {
+            const size_t i = next_chunk.fetch_add(1);
+            if (i >= nchunks || g_stop_requested) break;
+            if (!opt.unordered) reorder.reserve(i);
+            ChunkResult res;
+            res.seq = i;
+            ChunkParseState st;
+            st.opt = &opt;
+            st.convert = convert;
+            st.out = &res;
+            st.begin = bounds[i];
+            if (i == 0) st.skip = skip;
+            if (!parse_chunk(mf, first, bounds[i], bounds[i + 1], i + 1 == nchunks, st)) {
+                std::cerr << "[!] --chunked: XML parse error in the chunk at byte " << bounds[i] << "\n";
+                failed = true;
+            }
+            if (opt.unordered) done.push(std::move(res)); else reorder.put(std::move(res));
+        }
+        if (--running == 0) { reorder.close(); done.close(); }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 0; t < nthreads; ++t) workers.emplace_back(work);
+
+    ChunkResult res;
+    while (opt.unordered ? done.pop(res) : reorder.take(res)) {
+        for (auto& rec : res.rows) emit(rec);
+    }
+    for (auto& t : workers) t.join();
+    return !failed;
+}
+
+// ---------- SAX record parser (--parser sax) ----------
+// Generic mode without xmlTextReader: a push parser whose SAX2 callbacks
+// skip everything outside record elements and, inside one, build a small
+// tree of SaxNodes in the record arena (names straight from the parser's
+// dictionary, text and attribute values copied in). No libxml2 nodes are
+// created, so in steady state a record costs no malloc. On the record's end
+// tag the tree goes through generic_write_parts, like the reader loop's
+// expanded subtree.
+//
+// The DTD callbacks stay libxml2's, so entities, attribute defaults and
+// element declarations still land on ctxt->myDoc. Two things the tree
+// builder does on its own are redone here:
+//  - XML_PARSE_NOBLANKS: libxml2's areBlanks() decides from the tree under
+//    construction, which this parser never has, so sax_is_blank() repeats
+//    its checks against the SaxNodes;
+//  - attributes defaulted from the DTD are dropped, as
+//    xmlSAX2StartElementNs drops them without XML_PARSE_DTDATTR.
+
+struct SaxItem;
+
+struct SaxNode {
+    const xmlChar* name = nullptr;          // as in the tree: local name, or prefix:name if unbound
+    GenAttr* attrs = nullptr;
+    size_t nattrs = 0;
+    SaxItem* first = nullptr;               // text runs and elements, in document order
+    SaxItem* last = nullptr;
+    // what areBlanks() looks at: any child node at all (comments and PIs
+    // count), and whether the first / last one is a text node
+    bool has_children = false;
+    bool first_is_text = false;
+    bool last_is_text = false;
+    size_t nelems = 0;                      // element children, for --max-children
+};
+
+struct SaxItem {
+    SaxItem* next = nullptr;
+    const SaxNode* elem = nullptr;          // null for text (and CDATA)
+    const char* text = nullptr;
+    size_t len = 0;
+};
+
+// text_spans_add for SaxNodes
+static void sax_text_spans_add(const SaxNode* n, TextSpans& ts) {
+    const size_t i = ts.open();
+    for (const SaxItem* it = n->first; it; it = it->next) {
+        if (it->elem) sax_text_spans_add(it->elem, ts);
+        else ts.text.append(it->text, it->len);
+    }
+    ts.close(i);
+}
+
+// A child element for sax_write_value: the node and its TextSpans index.
+struct SaxKid {
+    const SaxNode* node;
+    size_t ti;
+};
+
+// generic_write_value for SaxNodes
+static void sax_write_value(const SaxNode* n, const TextSpans& ts, size_t ti, std::string& out,
+                            const char* record_tag, const FieldTree& f, std::pmr::memory_resource* mr) {
+    std::pmr::vector<GenKid<SaxKid>> kids(mr);
+    size_t k = ti + 1;
+    for (const SaxItem* it = n->first; it; it = it->next) {
+        if (!it->elem) continue;
+        kids.push_back({it->elem->name, {it->elem, k}});
+        k = ts.spans[k].next;
+    }
+    generic_write_parts(out, ts.of(ti), n->attrs, n->nattrs, kids, record_tag, f, mr,
+                        [&](const SaxKid& kid, const FieldTree& sub) {
+                            sax_write_value(kid.node, ts, kid.ti, out, nullptr, sub, mr);
+                        });
+}
+
+class SaxRecordParser {
+public:
+    static constexpr size_t k_feed = 1u << 18;     // bytes per xmlParseChunk
+
+    explicit SaxRecordParser(const Options& opt)
+        : opt_(opt), bin_(binary_format(opt.format)), budget_(opt.limits) { stack_.reserve(64); }
+
+    // Parses everything `read(ctx, ...)` returns (the input backends'
+    // io_read) and hands each record to `emit`. With `stats`, parsing is
+    // charged to `read` and writing the JSON to `convert`, lapping from `t`.
+    // False if no parser could be created, the input couldn't be read or it
+    // isn't well-formed (the records before the error have been emitted).
+    bool run(xmlInputReadCallback read, void* ctx, const char* url, const ConvertPipeline::Emit& emit,
+             RunStats* stats, StatClock::time_point& t) {
+        xmlSAXHandler sax;
+        std::memset(&sax, 0, sizeof(sax));
+        xmlSAXVersion(&sax, 2);
+        sax.startElement = nullptr;
+        sax.endElement = nullptr;
+        sax.startElementNs = start_element;
+        sax.endElementNs = end_element;
+        sax.characters = characters;
+        sax.cdataBlock = cdata_block;
+        sax.comment = comment;
+        sax.processingInstruction = processing_instruction;
+        sax.reference = nullptr;
+
+        // libxml2's DTD handlers want the context as `ctx`; entity content is
+        // parsed by a child context that inherits _private
+        ctxt_ = xmlCreatePushParserCtxt(&sax, nullptr, nullptr, 0, url);
+        if (!ctxt_) {
+            std::cerr << "[!] Failed to create the SAX parser\n";
+            return false;
+        }
+        xmlCtxtUseOptions(ctxt_, k_parse_options);
+        ctxt_->_private = this;
+        matcher_.reset(new RecordMatcher(*opt_.records, ctxt_->dict));
+        depth_ = 0;
+        emit_ = &emit;
+        stats_ = stats;
+        t_ = &t;
+
+        std::unique_ptr<char[]> buf(new char[k_feed]);
+        bool ok = true;
+        for (;;) {
+            if (g_stop_requested) { xmlStopParser(ctxt_); break; }
+            const int n = read(ctx, buf.get(), (int)k_feed);
+            if (n < 0) {
+                std::cerr << "[!] Failed to read input\n";
+                ok = false;
+                break;
+            }
+            consumed_ += (uint64_t)n;
+            xmlParseChunk(ctxt_, buf.get(), n, n == 0);
+            if (n == 0 || ctxt_->instate == XML_PARSER_EOF) break;
+        }
+        if (!ctxt_->wellFormed && !g_stop_requested) ok = false;
+
+        if (ctxt_->myDoc) xmlFreeDoc(ctxt_->myDoc);
+        ctxt_->myDoc = nullptr;
+        xmlFreeParserCtxt(ctxt_);
+        ctxt_ = nullptr;
+        stack_.clear();
+        RecordArena::local().rewind();
+        return ok;
+    }
+
+    // input bytes handed to the parser so far
+    uint64_t consumed() const { return consumed_; }
+
+    // --resume: pass over the first `n` records without building them
+    void skip_records(uint64_t n) { resume_skip_ = n; }
+
+private:
+    static SaxRecordParser& self(void* ctx) {
+        return *static_cast<SaxRecordParser*>(static_cast<xmlParserCtxtPtr>(ctx)->_private);
+    }
+
+    static std::pmr::memory_resource* arena() { return RecordArena::local().resource(); }
+
+    template <class T>
+    static T* make() { return new (arena()->allocate(sizeof(T), alignof(T))) T(); }
+
+    static const char* copy(const xmlChar* p, size_t n) {
+        char* s = static_cast<char*>(arena()->allocate(n + 1, 1));
+        std::memcpy(s, p, n);
+        s[n] = '\0';
+        return s;
+    }
+
+    // the name xmlSAX2StartElementNs / xmlSAX2AttributeNs give the node
+    const xmlChar* node_name(const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI) const {
+        if (!prefix || URI) return localname;
+        const xmlChar* q = xmlDictQLookup(ctxt_->dict, prefix, localname);
+        return q ? q : localname;
+    }
+
+    static void mark(SaxNode* parent, bool is_text) {
+        if (!parent->has_children) parent->first_is_text = is_text;
+        parent->has_children = true;
+        parent->last_is_text = is_text;
+    }
+
+    static void append(SaxNode* parent, SaxItem* it, bool is_text) {
+        mark(parent, is_text);
+        if (parent->last) parent->last->next = it; else parent->first = it;
+        parent->last = it;
+    }
+
+    // --max-record-bytes: the arena copy of `n` bytes at `p`, or of their
+    // spill reference when they don't fit the record (`n` becomes its length)
+    const char* copy_limited(const xmlChar* p, size_t& n, bool& spilled) {
+        spilled = !budget_.fits(reinterpret_cast<const char*>(p), n);
+        if (!spilled) return copy(p, n);
+        std::string marker;
+        budget_.spill(reinterpret_cast<const char*>(p), n, marker);
+        n = marker.size();
+        return copy(BAD_CAST marker.data(), n);
+    }
+
+    // Appends a text (or CDATA) run to `n`, within the record's budget. A
+    // run right after the one spilled last goes on that reference. Runs
+    // kept one after another ("&#36;spill:..." comes in two) are checked
+    // for a reference look-alike together: once their start reads like
+    // one, they are moved to the spill file as a whole.
+    void append_text(SaxNode* n, const xmlChar* ch, size_t len, bool is_text) {
+        if (spilled_ && n->last == spilled_) {
+            std::string marker(spilled_->text, spilled_->len);
+            if (budget_.extend(reinterpret_cast<const char*>(ch), len, marker)) {
+                spilled_->text = copy(BAD_CAST marker.data(), marker.size());
+                spilled_->len = marker.size();
+                return;
+            }
+        }
+        if (budget_.spills() && kept_ && n->last == kept_ && lead_.size() < 7) {
+            lead_.append(reinterpret_cast<const char*>(ch), std::min<size_t>(len, 7 - lead_.size()));
+            if (RecordBudget::looks_like_reference(lead_.data(), lead_.size())) {
+                std::string run;
+                for (const SaxItem* it = lead_item_; it; it = it->next) run.append(it->text, it->len);
+                run.append(reinterpret_cast<const char*>(ch), len);
+                std::string marker;
+                budget_.spill(run.data(), run.size(), marker);
+                lead_item_->text = copy(BAD_CAST marker.data(), marker.size());
+                lead_item_->len = marker.size();
+                lead_item_->next = nullptr;
+                n->last = lead_item_;
+                spilled_ = lead_item_;
+                kept_ = nullptr;
+                return;
+            }
+        }
+        bool spilled;
+        SaxItem* it = make<SaxItem>();
+        const bool continues = kept_ && n->last == kept_;
+        it->text = copy_limited(ch, len, spilled);
+        it->len = len;
+        append(n, it, is_text);
+        spilled_ = spilled ? it : nullptr;
+        if (!spilled && !continues) {
+            lead_item_ = it;
+            lead_.assign(it->text, std::min<size_t>(len, 7));
+        }
+        kept_ = spilled ? nullptr : it;
+    }
+
+    // areBlanks(): would the tree builder drop this whitespace run? RAW
+    // (c->input->cur) is already past the run when characters() is called
+    // for it.
+    static bool sax_is_blank(xmlParserCtxtPtr c, const SaxNode* n, const xmlChar* ch, int len) {
+        for (int i = 0; i < len; ++i)
+            if (ch[i] != 0x20 && ch[i] != 0x9 && ch[i] != 0xA && ch[i] != 0xD) return false;
+        if (!c->space || *c->space == 1 || *c->space == -2) return false;
+        if (c->myDoc) {
+            const int mixed = xmlIsMixedElement(c->myDoc, n->name);
+            if (mixed == 0) return true;
+            if (mixed == 1) return false;
+        }
+        const xmlChar* raw = c->input ? c->input->cur : nullptr;
+        if (!raw || (raw[0] != '<' && raw[0] != 0xD)) return false;
+        if (!n->has_children) return !(raw[0] == '<' && raw[1] == '/');
+        return !n->last_is_text && !n->first_is_text;
+    }
+
+    // libxml2 marks an element that got text through characters() (*space
+    // -1 -> -2, after the callback returns) and then keeps all its later
+    // whitespace. A run dropped here was ignorable whitespace to the tree
+    // builder, which doesn't mark it, so the mark is undone on the context's
+    // next event (entity content is parsed by a child context in between).
+    static SaxRecordParser& settle(void* ctx) {
+        SaxRecordParser& p = self(ctx);
+        const xmlParserCtxtPtr c = static_cast<xmlParserCtxtPtr>(ctx);
+        if (p.undo_ctxt_ != c) return p;
+        if (p.undo_slot_ < c->spaceNr && c->spaceTab[p.undo_slot_] == -2) c->spaceTab[p.undo_slot_] = -1;
+        p.undo_ctxt_ = nullptr;
+        return p;
+    }
+
+    static void start_element(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI,
+                              int, const xmlChar**, int nb_attributes, int nb_defaulted,
+                              const xmlChar** attributes) {
+        SaxRecordParser& p = settle(ctx);
+        if (p.skip_) { ++p.skip_; return; }
+        if (p.drop_) { ++p.drop_; return; }
+        if (p.stack_.empty()) {
+            const int route = p.matcher_->match(p.depth_, localname, prefix);
+            if (route < 0) { ++p.depth_; return; }
+            p.rec_.route = (size_t)route;
+            if (++p.matched_ <= p.resume_skip_) { p.skip_ = 1; return; }
+            if (p.opt_.query && !p.start_tag_matches(nb_attributes - nb_defaulted, attributes)) {
+                p.skip_ = 1;                // the record and everything in it
+                return;
+            }
+            p.budget_.begin();
+            p.spilled_ = nullptr;
+            p.kept_ = nullptr;
+        } else if (!p.budget_.child(p.stack_.back()->nelems)) {
+            mark(p.stack_.back(), false);   // still a child to areBlanks()
+            p.drop_ = 1;
+            return;
+        }
+
+        SaxNode* n = make<SaxNode>();
+        n->name = p.node_name(localname, prefix, URI);
+        n->nattrs = (size_t)std::max(0, nb_attributes - nb_defaulted);
+        if (n->nattrs) {
+            n->attrs = static_cast<GenAttr*>(arena()->allocate(n->nattrs * sizeof(GenAttr), alignof(GenAttr)));
+            for (size_t i = 0; i < n->nattrs; ++i) {
+                const xmlChar** a = attributes + 5 * i;     // localname, prefix, URI, value, end
+                n->attrs[i].name = p.node_name(a[0], a[1], a[2]);
+                size_t len = (size_t)(a[4] - a[3]);
+                bool spilled;
+                n->attrs[i].value = BAD_CAST p.copy_limited(a[3], len, spilled);
+            }
+        }
+        if (!p.stack_.empty()) {
+            SaxItem* it = make<SaxItem>();
+            it->elem = n;
+            append(p.stack_.back(), it, false);
+            ++p.stack_.back()->nelems;
+        }
+        p.stack_.push_back(n);
+    }
+
+    static void end_element(void* ctx, const xmlChar*, const xmlChar*, const xmlChar*) {
+        SaxRecordParser& p = settle(ctx);
+        if (p.skip_) { --p.skip_; return; }
+        if (p.drop_) { --p.drop_; return; }
+        if (p.stack_.empty()) {
+            if (p.depth_) --p.depth_;
+            return;
+        }
+        const SaxNode* n = p.stack_.back();
+        p.stack_.pop_back();
+        if (p.stack_.empty()) p.finish(n);
+    }
+
+    static void characters(void* ctx, const xmlChar* ch, int len) {
+        SaxRecordParser& p = settle(ctx);
+        if (p.stack_.empty() || len <= 0 || p.drop_) return;
+        SaxNode* n = p.stack_.back();
+        const xmlParserCtxtPtr c = static_cast<xmlParserCtxtPtr>(ctx);
+        if (sax_is_blank(c, n, ch, len)) {
+            if (*c->space == -1) { p.undo_ctxt_ = c; p.undo_slot_ = c->spaceNr - 1; }
+            return;
+        }
+        p.append_text(n, ch, (size_t)len, true);
+    }
+
+    static void cdata_block(void* ctx, const xmlChar* value, int len) {
+        SaxRecordParser& p = settle(ctx);
+        if (p.stack_.empty() || p.drop_) return;
+        p.append_text(p.stack_.back(), value, (size_t)std::max(0, len), false);
+    }
+
+    // comments and PIs aren't output, but as tree nodes they count for areBlanks()
+    static void mark_child(void* ctx) {
+        SaxRecordParser& p = settle(ctx);
+        if (p.stack_.empty() || p.drop_) return;
+        mark(p.stack_.back(), false);
+    }
+    static void comment(void* ctx, const xmlChar*) { mark_child(ctx); }
+    static void processing_instruction(void* ctx, const xmlChar*, const xmlChar*) { mark_child(ctx); }
+
+    // record_start_tag_matches on a record's (non-defaulted) attributes
+    bool start_tag_matches(int nattrs, const xmlChar** attributes) const {
+        for (const auto& w : opt_.query->start_tag) {
+            const xmlChar** v = nullptr;
+            for (int i = 0; i < nattrs; ++i) {
+                const xmlChar** a = attributes + 5 * i;
+                if (xmlStrEqual(node_name(a[0], a[1], a[2]), BAD_CAST w.first.c_str())) v = a;
+            }
+            if (!v || w.second.compare(0, std::string::npos, reinterpret_cast<const char*>(v[3]),
+                                       (size_t)(v[4] - v[3])) != 0)
+                return false;
+        }
+        return true;
+    }
+
+    void finish(const SaxNode* n) {
+        if (stats_) *t_ = stats_->add(RunStats::read, *t_);
+        rec_.json.clear();
+        rec_.tag = reinterpret_cast<const char*>(n->name);
+        rec_.resume_skip = matched_;
+        budget_.end(matched_);
+        const RecordQuery* q = opt_.query;
+        TextSpans& ts = TextSpans::local();
+        sax_text_spans_add(n, ts);
+        sax_write_value(n, ts, 0, rec_.json, rec_.tag.c_str(), q ? q->render : FieldTree::everything(), arena());
+        RecordArena::local().rewind();
+        const bool keep = !q || query_filter(*q, rec_.json);
+        if (keep && opt_.types) apply_types(*opt_.types, rec_.json);
+        if (keep && opt_.shard) shard_key_from_json(*opt_.shard, rec_.json, rec_.shard_key);
+        if (keep) record_encode(bin_, rec_.json);
+        if (stats_) *t_ = stats_->add(RunStats::convert, *t_);
+        if (keep) (*emit_)(rec_);           // charges its own write time
+        if (stats_) *t_ = StatClock::now();
+    }
+
+    const Options& opt_;
+    const BinaryFormat bin_;
+    xmlParserCtxtPtr ctxt_ = nullptr;
+    std::vector<SaxNode*> stack_;           // open elements of the current record
+    Record rec_;
+    const ConvertPipeline::Emit* emit_ = nullptr;
+    RunStats* stats_ = nullptr;
+    StatClock::time_point* t_ = nullptr;
+    uint64_t consumed_ = 0;
+    xmlParserCtxtPtr undo_ctxt_ = nullptr;  // see settle()
+    int undo_slot_ = 0;
+    int skip_ = 0;                          // depth inside a record its start tag filtered out (or --resume skips)
+    int drop_ = 0;                          // depth inside a child --max-children dropped
+    RecordBudget budget_;
+    SaxItem* spilled_ = nullptr;            // the run spilled last, see append_text()
+    SaxItem* kept_ = nullptr;               // the run kept last, see append_text()
+    SaxItem* lead_item_ = nullptr;          // the first of the runs kept one after another up to it
+    std::string lead_;                      // their first bytes (up to 7)
+    uint64_t matched_ = 0;                  // records so far (Record::resume_skip)
+    uint64_t resume_skip_ = 0;
+    std::unique_ptr<RecordMatcher> matcher_;
+    size_t depth_ = 0;                      // open elements outside records
+};
+
+// ---------- Several inputs (-i A -i B, globs, directories, --input-list) ----------
+// Every input file is a task for a pool of --threads workers with one deque
+// each. The files are dealt out largest first, round-robin, so the big ones
+// start at once; a worker takes from the front of its own deque and, once
+// that is empty, steals from the front of the fullest other one, so the
+// small files fill in at the end instead of one thread finishing a big file
+// alone. With --chunked, a worker that picks up an uncompressed file of more
+// than two --chunk-size splits it into chunk tasks at the front of its own
+// deque, for idle workers to steal. A split file's chunks are taken in file
+// order, and ChunkOrder hands their records on in that order too, so they
+// may finish in any order.
+//
+// Files are parsed the way --chunked parses a chunk: a push parser that
+// builds one record at a time and frees it on its end tag. A whole file
+// knows its ancestors, so any --record-path applies (chunks still need
+// //name paths). Records carry "_source" (the path as given) and "_offset"
+// (the byte offset of their start tag; in the decompressed text for
+// compressed files). A file's records stay in order (split or not, unless
+// --unordered), records of different files interleave.
+
+struct InputFile {
+    std::string path;
+    uint64_t size = 0;
+};
+
+// Expands the -i values and the --input-list lines into files: a directory
+// stands for its *.xml[.gz|.zst|.xz] files, a name with * ? or [ for its
+// glob(3) matches. False (with a message) when one exists nowhere.
+static bool expand_inputs(const Options& opt, std::vector<std::string>& files) {
+    std::vector<std::string> specs = opt.input_specs;
+    if (!opt.input_list.empty()) {
+        std::ifstream f;
+        if (opt.input_list != "-") f.open(opt.input_list);
+        std::istream& in = opt.input_list == "-" ? std::cin : f;
+        if (!in) {
+            std::cerr << "[!] Cannot read --input-list " << opt.input_list << "\n";
+            return false;
+        }
+        for (std::string line; std::getline(in, line);) {
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) line.pop_back();
+            if (!line.empty() && line[0] != '#') specs.push_back(line);
+        }
+    }
+    static const char* const k_exts[] = {".xml", ".xml.gz", ".xml.zst", ".xml.xz"};
+    auto xml_name = [](const std::string& name) {
+        for (const char* e : k_exts) {
+            const size_t n = std::strlen(e);
+            if (name.size() > n && name.compare(name.size() - n, n, e) == 0) return true;
+        }
+        return false;
+    };
+    for (const std::string& spec : specs) {
+        struct stat sb;
+        if (spec.find_first_of("*?[") != std::string::npos && ::stat(spec.c_str(), &sb) != 0) {
+            glob_t g;
+            const int rc = glob(spec.c_str(), 0, nullptr, &g);
+            if (rc == 0)
+                for (size_t i = 0; i < g.gl_pathc; ++i) files.push_back(g.gl_pathv[i]);
+            globfree(&g);
+            if (rc != 0) {
+                std::cerr << "[!] No input matches " << spec << "\n";
+                return false;
+            }
+        } else if (::stat(spec.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            DIR* d = opendir(spec.c_str());
+            std::vector<std::string> names;
+            while (struct dirent* e = d ? readdir(d) : nullptr)
+                if (e->d_name[0] != '.' && xml_name(e->d_name)) names.push_back(e->d_name);
+            if (d) closedir(d);
+            std::sort(names.begin(), names.end());
+            const std::string dir = spec.back() == '/' ? spec : spec + "/";
+            for (const std::string& n : names) files.push_back(dir + n);
+        } else {
+            files.push_back(spec);
+        }
+    }
+    return true;
+}
+
+// Per-worker task deques; see the top of this section.
+template <typename T>
+class StealingDeques {
+public:
+    explicit StealingDeques(size_t workers) : q_(std::max<size_t>(1, workers)) {}
+
+    // a task for worker `w`: at the back while dealing, at the front for
+    // the pieces of the task it is running
+    void push(size_t w, T t, bool front = false) {
+        std::lock_guard<std::mutex> lk(m_);
+        if (front) q_[w].push_front(std::move(t)); else q_[w].push_back(std::move(t));
+        cv_.notify_one();
+    }
+
+    // Worker `w`'s next task: its own front, else the front of the fullest
+    // other deque. Waits while a running task may still add some; false
+    // once every deque is empty and nothing runs (or on SIGINT).
+    bool take(size_t w, T& t) {
+        std::unique_lock<std::mutex> lk(m_);
+        for (;;) {
+            size_t v = w;
+            if (q_[w].empty())
+                for (size_t i = 0; i < q_.size(); ++i)
+                    if (q_[i].size() > q_[v].size()) v = i;
+            if (!q_[v].empty() && !g_stop_requested) {
+                t = std::move(q_[v].front());
+                q_[v].pop_front();
+                ++running_;
+                if (v != w) ++steals_;
+                return true;
+            }
+            if (!running_ || g_stop_requested) return false;
+            cv_.wait(lk);
+        }
+    }
+
+    // the task from take() is finished
+    void done() {
+        std::lock_guard<std::mutex> lk(m_);
+        if (--running_ == 0) cv_.notify_all();
+    }
+
+    uint64_t steals() const { return steals_; }
+
+private:
+    std::vector<std::deque<T>> q_;
+    size_t running_ = 0;
+    uint64_t steals_ = 0;
+    std::mutex m_;
+    std::condition_variable cv_;
+};
+
+// A split file's chunk results, released in chunk order: a chunk that
+// finishes early is held until those before it are through, and no chunk
+// starts more than `window` ahead of them, which bounds what is held.
+class ChunkOrder {
+public:
+    explicit ChunkOrder(size_t window) : window_(std::max<size_t>(1, window)) {}
+
+    // before converting `chunk`: wait until it fits in the window
+    void reserve(size_t chunk) {
+        std::unique_lock<std::mutex> lk(m_);
+        slot_free_.wait(lk, [&] { return chunk < next_ + window_; });
+    }
+    // `chunk` is converted: push it, and any held chunks it unblocks, to `done`
+    void put(size_t chunk, ChunkResult res, BoundedQueue<ChunkResult>& done) {
+        std::lock_guard<std::mutex> lk(m_);
+        if (chunk != next_) {
+            held_.emplace(chunk, std::move(res));
+            return;
+        }
+        for (;;) {
+            if (!res.rows.empty()) done.push(std::move(res));
+            auto it = held_.find(++next_);
+            if (it == held_.end()) break;
+            res = std::move(it->second);
+            held_.erase(it);
+        }
+        slot_free_.notify_all();
+    }
+
+private:
+    const size_t window_;
+    size_t next_ = 0;                       // the chunk whose records go out next
+    std::map<size_t, ChunkResult> held_;
+    std::mutex m_;
+    std::condition_variable slot_free_;
+};
+
+struct InputTask {
+    size_t file = 0;                        // into the file list
+    std::shared_ptr<MappedFile> mf;         // a chunk: the mapping its file's chunks share
+    std::shared_ptr<ChunkOrder> order;      // its file's chunk order (null with --unordered)
+    size_t chunk = 0;                       // its index in the file
+    size_t begin = 0, end = 0;              // the chunk's bytes
+    bool last = false;                      // the file's last chunk
+};
+
+// Converts every file in opt.inputs and hands the records to `emit` on the
+// calling thread. False if a file couldn't be read or parsed (the others are
+// converted all the same).
+static bool inputs_convert(const Options& opt, RecordConverter convert, const ConvertPipeline::Emit& emit) {
+    std::vector<InputFile> files;
+    for (const std::string& path : opt.inputs) {
+        struct stat sb;
+        InputFile f;
+        f.path = path;
+        if (::stat(path.c_str(), &sb) == 0) f.size = (uint64_t)sb.st_size;
+        files.push_back(std::move(f));
+    }
+    std::vector<size_t> order(files.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return files[a].size > files[b].size; });
+
+    const int nthreads = std::max(1, opt.threads);
+    StealingDeques<InputTask> tasks((size_t)nthreads);
+    for (size_t i = 0; i < order.size(); ++i) {
+        InputTask t;
+        t.file = order[i];
+        tasks.push(i % (size_t)nthreads, std::move(t));
+    }
+    const bool split = opt.chunked && opt.records->names_only();
+    BoundedQueue<ChunkResult> done((size_t)nthreads * 2);
+    std::atomic<int> running{nthreads};
+    std::atomic<bool> failed{false};
+
+    auto fail = [&](const InputFile& f, const std::string& why) {
+        std::cerr << "[!] " << f.path << ": " << why << "\n";
+        failed = true;
+    };
+    // a whole file, through a push parser fed from `read`
+    auto parse_file = [&](const InputFile& f, xmlInputReadCallback read, void* ctx, ChunkParseState& st) {
+        xmlParserCtxtPtr ctxt = chunk_parser_new(st, f.path.c_str());
+        if (!ctxt) return fail(f, "cannot create the XML parser");
+        std::unique_ptr<char[]> buf(new char[SaxRecordParser::k_feed]);
+        for (;;) {
+            if (g_stop_requested) { xmlStopParser(ctxt); break; }
+            const int n = read(ctx, buf.get(), (int)SaxRecordParser::k_feed);
+            if (n < 0) { fail(f, "read error"); break; }
+            xmlParseChunk(ctxt, buf.get(), n, n == 0);
+            if (n == 0 || ctxt->instate == XML_PARSER_EOF) break;
+        }
+        if (!ctxt->wellFormed && !g_stop_requested) fail(f, "XML parse error");
+        chunk_parser_free(ctxt);
+    };
+    auto run = [&](size_t w, InputTask& task) {
+        const InputFile& f = files[task.file];
+        ChunkResult res;
+        ChunkParseState st;
+        st.opt = &opt;
+        st.convert = convert;
+        st.out = &res;
+        st.source = &f.path;
+        // an ordered chunk hands its records on in one piece, when its turn comes
+        st.batches = task.order ? nullptr : &done;
+        if (task.mf) {
+            if (task.order) task.order->reserve(task.chunk);
+            st.begin = task.begin;
+            const size_t first = find_record_start(task.mf->data, task.mf->size, 0, opt.records->routes);
+            if (!parse_chunk(*task.mf, first, task.begin, task.end, task.last, st))
+                fail(f, "XML parse error in the chunk at byte " + std::to_string(task.begin));
+            if (task.order) return task.order->put(task.chunk, std::move(res), done);
+        } else {
+            const int fd = ::open(f.path.c_str(), O_RDONLY | O_CLOEXEC);
+            unsigned char magic[6];
+            const ssize_t nmagic = fd < 0 ? -1 : read_full(fd, magic, sizeof(magic));
+            if (nmagic < 0) {
+                if (fd >= 0) ::close(fd);
+                return fail(f, "cannot open");
+            }
+            const Codec codec = sniff_codec(magic, (size_t)nmagic);
+            if (codec != Codec::none) {
+                if (!codec_compiled(codec)) {
+                    ::close(fd);
+                    return fail(f, std::string(codec_name(codec)) + "-compressed input needs a build with its codec");
+                }
+                DecompressReader in(fd, true, codec, std::string(reinterpret_cast<const char*>(magic), (size_t)nmagic));
+                st.whole = true;
+                parse_file(f, DecompressReader::io_read, &in, st);
+            } else if (split && f.size > 2 * opt.chunk_size) {
+                auto mf = std::make_shared<MappedFile>();
+                if (!mf->open_fd(fd, true)) return fail(f, "cannot mmap");
+                madvise(const_cast<char*>(mf->data), mf->size, MADV_WILLNEED);
+                const size_t first = find_record_start(mf->data, mf->size, 0, opt.records->routes);
+                const std::vector<size_t> bounds = chunk_bounds(*mf, opt.records->routes, first, opt.chunk_size);
+                auto order = opt.unordered ? nullptr : std::make_shared<ChunkOrder>((size_t)nthreads * 2);
+                for (size_t i = bounds.size() - 1; i-- > 0;) {
+                    InputTask c;
+                    c.file = task.file;
+                    c.mf = mf;
+                    c.order = order;
+                    c.chunk = i;
+                    c.begin = bounds[i];
+                    c.end = bounds[i + 1];
+                    c.last = i + 2 == bounds.size();
+                    tasks.push(w, std::move(c), true);
+                }
+                return;
+            } else {
+                MmapInput in;
+                if (!in.open(fd, true, 0)) {
+                    ::close(fd);
+                    return fail(f, "not a regular file");
+                }
+                st.whole = true;
+                parse_file(f, MmapInput::io_read, &in, st);
+            }
+        }
+        if (!res.rows.empty()) done.push(std::move(res));
+    };
+    auto work = [&](size_t w) {
+        InputTask task;
+        while (tasks.take(w, task)) {
+            run(w, task);
+            task = InputTask();
+            tasks.done();
+        }
+        if (--running == 0) done.close();
+    };
+    std::vector<std::thread> workers;
+    for (int t = 0; t < nthreads; ++t) workers.emplace_back(work, (size_t)t);
+
+    ChunkResult res;
+    while (done.pop(res)) {
+        for (auto& rec : res.rows) emit(rec);
+    }
+    for (auto& t : workers) t.join();
+    if (opt.progress)
+        std::cerr << "[*] " << files.size() << " inputs on " << nthreads << " workers, " << tasks.steals()
+                  << " tasks stolen\n";
+    return !failed;
+}
+
+// ---------- Benchmark harness (--gen-corpus / --bench) ----------
+// --gen-corpus writes a reproducible synthetic Nmap or generic XML file.
+// --bench re-executes this binary once per mode/format combination on an
+// input file (each run in its own process, so peak RSS is per run) and
+// reads back each child's --stats report.
+
+// xorshift64*: fixed sequence per seed, so corpora are reproducible
+struct BenchRng {
+    uint64_t s;
+    explicit BenchRng(uint64_t seed) : s(seed ? seed : 0x9E3779B97F4A7C15ull) {}
+    uint64_t next() {
+        s ^= s >> 12; s ^= s << 25; s ^= s >> 27;
+        return s * 0x2545F4914F6CDD1Dull;
+    }
+    unsigned below(unsigned n) { return n ? (unsigned)(next() % n) : 0; }
+};
+
+struct CorpusSpec {
+    std::string kind;           // "nmap" | "generic"
+    uint64_t records = 10000;   // hosts or items
+    unsigned ports = 8;         // nmap: <port> elements per host
+    unsigned script_bytes = 256;// nmap: length of each script output attribute (0 = no scripts)
+    unsigned depth = 3;         // generic: element nesting below each record
+    unsigned width = 4;         // generic: children per element
+    unsigned text_bytes = 32;   // generic: text per leaf
+    uint64_t seed = 1;
+};
+
+// "nmap:hosts=1000000,ports=10,script-bytes=512" | "generic:records=1e5,depth=4,width=3"
+static bool parse_corpus_spec(const std::string& s, CorpusSpec& spec) {
+    size_t colon = s.find(':');
+    spec.kind = s.substr(0, colon);
+    if (spec.kind != "nmap" && spec.kind != "generic") return false;
+    if (colon == std::string::npos) return true;
+    size_t pos = colon + 1;
+    while (pos <= s.size()) {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        std::string kv = s.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (kv.empty()) continue;
+        size_t eq = kv.find('=');
+        if (eq == std::string::npos) return false;
+        const std::string key = kv.substr(0, eq);
+        const uint64_t v = (uint64_t)std::strtod(kv.c_str() + eq + 1, nullptr);   // allows 1e6
+        if (key == "hosts" || key == "records") spec.records = v;
+        else if (key == "ports") spec.ports = (unsigned)v;
+        else if (key == "script-bytes") spec.script_bytes = (unsigned)v;
+        else if (key == "depth") spec.depth = (unsigned)v;
+        else if (key == "width") spec.width = (unsigned)v;
+        else if (key == "text-bytes") spec.text_bytes = (unsigned)v;
+        else if (key == "seed") spec.seed = v;
+        else return false;
+    }
+    return true;
+}
+
+// `n` bytes of word-like text; with `markup`, sprinkles in the entities and
+// character references real script output is full of
+static void bench_text(std::string& out, BenchRng& rng, unsigned n, bool markup) {
+    static const char* const words[] = {"open", "http", "server", "Apache", "title", "ssl",
+                                        "cert", "Subject:", "commonName=", "example", "200", "OK"};
+    const size_t end = out.size() + n;
+    while (out.size() < end) {
+        unsigned r = rng.below(16);
+        if (markup && r == 0) out += "&#xa;  ";
+        else if (markup && r == 1) out += "&quot;";
+        else if (markup && r == 2) out += "&amp;";
+        else { out += words[rng.below(sizeof(words) / sizeof(words[0]))]; out += ' '; }
+    }
+}
+
+static void gen_nmap_host(std::string& out, BenchRng& rng, const CorpusSpec& spec, uint64_t i) {
+    struct Svc { int port; const char* name; const char* product; const char* version; const char* cpe; };
+    static const Svc svcs[] = {
+        {22,   "ssh",   "OpenSSH",     "8.9p1",  "cpe:/a:openbsd:openssh:8.9p1"},
+        {80,   "http",  "nginx",       "1.24.0", "cpe:/a:igor_sysoev:nginx:1.24.0"},
+        {443,  "https", "Apache httpd","2.4.57", "cpe:/a:apache:http_server:2.4.57"},
+        {3306, "mysql", "MySQL",       "8.0.35", "cpe:/a:mysql:mysql:8.0.35"},
+        {25,   "smtp",  "Postfix smtpd", "",     "cpe:/a:postfix:postfix"},
+        {3389, "ms-wbt-server", "Microsoft Terminal Services", "", "cpe:/o:microsoft:windows"},
+    };
+    const size_t nsvc = sizeof(svcs) / sizeof(svcs[0]);
+    const uint64_t start = 1700000000 + i / 64;
+    out += "<host starttime=\"" + std::to_string(start) + "\" endtime=\"" + std::to_string(start + 30) + "\">";
+    out += "<status state=\"up\" reason=\"syn-ack\" reason_ttl=\"0\"/>\n";
+    out += "<address addr=\"10." + std::to_string((i >> 16) & 255) + "." + std::to_string((i >> 8) & 255) +
+           "." + std::to_string(i & 255) + "\" addrtype=\"ipv4\"/>\n";
+    if (rng.below(4) == 0) {
+        char mac[96];
+        std::snprintf(mac, sizeof(mac), "<address addr=\"00:1A:2B:%02X:%02X:%02X\" addrtype=\"mac\" vendor=\"Acme\"/>\n",
+                      (unsigned)(i >> 16) & 255, (unsigned)(i >> 8) & 255, (unsigned)i & 255);
+        out += mac;
+    }
+    out += "<hostnames>";
+    if (rng.below(3)) out += "<hostname name=\"host" + std::to_string(i) + ".example.net\" type=\"PTR\"/>";
+    const std::string closed = std::to_string(spec.ports < 1000 ? 1000 - spec.ports : 0);
+    out += "</hostnames>\n<ports><extraports state=\"closed\" count=\"" + closed +
+           "\"><extrareasons reason=\"reset\" count=\"" + closed + "\"/></extraports>\n";
+    for (unsigned p = 0; p < spec.ports; ++p) {
+        const Svc& s = svcs[p % nsvc];
+        const int portid = p < nsvc ? s.port : 1024 + (int)rng.below(60000);
+        out += "<port protocol=\"tcp\" portid=\"" + std::to_string(portid) + "\">";
+        out += "<state state=\"open\" reason=\"syn-ack\" reason_ttl=\"64\"/>";
+        out += std::string("<service name=\"") + s.name + "\" product=\"" + s.product + "\"";
+        if (*s.version) out += std::string(" version=\"") + s.version + "\"";
+        out += std::string(" method=\"probed\" conf=\"10\"><cpe>") + s.cpe + "</cpe></service>";
+        if (spec.script_bytes) {
+            out += "<script id=\"banner\" output=\"";
+            bench_text(out, rng, spec.script_bytes, true);
+            out += "\"/>";
+        }
+        out += "</port>\n";
+    }
+    out += "</ports>\n";
+    if (spec.script_bytes && rng.below(4) == 0) {
+        out += "<hostscript><script id=\"smb-os-discovery\" output=\"";
+        bench_text(out, rng, spec.script_bytes, true);
+        out += "\"/></hostscript>\n";
+    }
+    out += "<uptime seconds=\"" + std::to_string(rng.below(5000000)) + "\" lastboot=\"Mon Jan  1 00:00:00 2024\"/>\n";
+    out += "<times srtt=\"" + std::to_string(200 + rng.below(5000)) + "\" rttvar=\"100\" to=\"100000\"/>\n</host>\n";
+}
+
+static void gen_generic_elem(std::string& out, BenchRng& rng, const CorpusSpec& spec, unsigned level) {
+    static const char* const names[] = {"entry", "name", "value", "meta"};
+    for (unsigned c = 0; c < spec.width; ++c) {
+        const char* nm = names[c % 4];
+        out += '<'; out += nm;
+        if (rng.below(2)) out += " k=\"" + std::to_string(rng.below(1000)) + "\"";
+        out += '>';
+        if (level + 1 < spec.depth) gen_generic_elem(out, rng, spec, level + 1);
+        else bench_text(out, rng, spec.text_bytes, false);
+        out += "</"; out += nm; out += '>';
+    }
+}
+
+static int gen_corpus(const CorpusSpec& spec, std::ostream& os) {
+    BenchRng rng(spec.seed);
+    std::string buf;
+    const bool nmap = spec.kind == "nmap";
+    os << (nmap ? "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<!DOCTYPE nmaprun>\n"
+                  "<nmaprun scanner=\"nmap\" args=\"nmap -sV\" start=\"1700000000\" version=\"7.94\" xmloutputversion=\"1.05\">\n"
+                  "<scaninfo type=\"syn\" protocol=\"tcp\" numservices=\"1000\" services=\"1-1000\"/>\n"
+                : "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<records>\n");
+    for (uint64_t i = 0; i < spec.records && !g_stop_requested; ++i) {
+        buf.clear();
+        if (nmap) {
+            gen_nmap_host(buf, rng, spec, i);
+        } else {
+            buf += "<item id=\"" + std::to_string(i) + "\">";
+            gen_generic_elem(buf, rng, spec, 0);
+            buf += "</item>\n";
+        }
+        os << buf;
+    }
+    os << (nmap ? "<runstats><finished time=\"1700003600\"/><hosts up=\"" + std::to_string(spec.records) + "\"/></runstats>\n</nmaprun>\n"
+                : std::string("</records>\n"));
+    os.flush();
+    if (!os) { std::cerr << "[!] Failed to write corpus\n"; return 5; }
+    return 0;
+}
+
+struct BenchRun {
+    std::string mode, format, schema;
+    std::string parser = "reader";
+    bool ok = false;
+    uint64_t records = 0;
+    double wall = 0;
+    long peak_rss_kb = 0;
+    uint64_t out_bytes = 0;
+    double allocs_per_record = 0;   // heap allocations (C++ and libxml2) per record
+    nlohmann::json stages;      // parse_s/convert_s/write_s from the child, if split
+};
+
+static uint64_t file_size(const std::string& path) {
+    struct stat sb;
+    return ::stat(path.c_str(), &sb) == 0 ? (uint64_t)sb.st_size : 0;
+}
+
+// One child run of this binary; fills wall time, peak RSS and the child's report.
+static void bench_one(const char* self, const Options& opt, const std::string& dir, BenchRun& r) {
+    const std::string out = dir + "/out", db = dir + "/out.db", report = dir + "/report.json";
+    std::vector<std::string> args = {self, "-i", opt.input, "--mode", r.mode, "--record-tag", opt.record_tag,
+                                     "--format", r.format, "--schema", r.schema, "--parser", r.parser,
+                                     "--stats", report};
+    if (r.format == "sqlite") { args.push_back("--sqlite-db"); args.push_back(db); }
+    else { args.push_back("-o"); args.push_back(out); }
+    if (opt.threads > 1) { args.push_back("--threads"); args.push_back(std::to_string(opt.threads)); }
+    if (opt.chunked) args.push_back("--chunked");
+    if (opt.dom) args.push_back("--dom");
+    std::vector<char*> argv;
+    for (auto& a : args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+
+    auto t0 = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(self, argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage ru;
+    std::memset(&ru, 0, sizeof(ru));
+    if (pid < 0 || wait4(pid, &status, 0, &ru) < 0) return;
+    r.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    r.peak_rss_kb = ru.ru_maxrss;
+    r.out_bytes = file_size(out) + file_size(out + ".load.sql") + file_size(db);
+    r.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    std::ifstream rf(report);
+    std::string line;
+    if (r.ok && std::getline(rf, line)) {
+        try {
+            nlohmann::json j = nlohmann::json::parse(line);
+            r.records = j.value("records", (uint64_t)0);
+            if (j.contains("allocs")) r.allocs_per_record = j["allocs"].value("per_record", 0.0);
+            // the bench's three columns: read+expand, convert+serialize, write
+            const nlohmann::json st = j.value("stages_s", nlohmann::json::object());
+            if (st.contains("read")) r.stages["parse_s"] = st.value("read", 0.0) + st.value("expand", 0.0);
+            if (st.contains("convert")) r.stages["convert_s"] = st.value("convert", 0.0) + st.value("serialize", 0.0);
+            if (st.contains("write")) r.stages["write_s"] = st["write"];
+        } catch (const std::exception&) { r.ok = false; }
+    }
+    for (const std::string& p : {out, out + ".load.sql", db, report}) std::remove(p.c_str());
+}
+
+static int run_bench(const char* argv0, const Options& opt) {
+    if (opt.input == "-" || !file_size(opt.input)) {
+        std::cerr << "[!] --bench needs a non-empty input file (-i FILE)\n";
+        return 2;
+    }
     if (opt.record_tag.empty()) {
-        std::cerr << "[!] --record-tag is required for streaming conversion.\n";
-        xmlFreeTextReader(reader);
-        xmlCleanupParser();
+        std::cerr << "[!] --bench needs --record-tag\n";
+        return 9;
+    }
+    char self[4096];
+    ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n > 0) self[n] = 0;
+    else std::snprintf(self, sizeof(self), "%s", argv0);
+
+    const char* tmp = std::getenv("TMPDIR");
+    std::string dir_tmpl = std::string(tmp && *tmp ? tmp : "/tmp") + "/xml2stream-bench.XXXXXX";
+    std::vector<char> dir_buf(dir_tmpl.begin(), dir_tmpl.end());
+    dir_buf.push_back(0);
+    if (!mkdtemp(dir_buf.data())) { std::cerr << "[!] Failed to create a temporary directory\n"; return 5; }
+    const std::string dir(dir_buf.data());
+
+    // nmap mode only makes sense on <host> records
+    std::vector<std::string> modes = {"generic"};
+    if (opt.record_tag == "host") modes.push_back("nmap");
+    std::vector<std::string> formats = {"jsonl", "bson", "msgpack", "cbor", "mysql-sql", "mysql-tsv"};
+#ifdef WITH_SQLITE
+    formats.push_back("sqlite");
+#endif
+    // the SAX parser is compared wherever it can run: serial generic, compact
+    const bool sax = opt.threads <= 1 && !opt.chunked && !opt.dom;
+    std::vector<BenchRun> runs;
+    for (const auto& m : modes) {
+        for (const auto& f : formats) {
+            std::vector<std::string> schemas = {"json"};
+            if (m == "nmap" && (f == "mysql-sql" || f == "sqlite")) schemas.push_back("relational");
+            std::vector<std::string> parsers = {"reader"};
+            if (m == "generic" && sax) parsers.push_back("sax");
+            for (const auto& sc : schemas) {
+                for (const auto& pa : parsers) {
+                    BenchRun r;
+                    r.mode = m; r.format = f; r.schema = sc; r.parser = pa;
+                    runs.push_back(std::move(r));
+                }
+            }
+        }
+    }
+
+    const uint64_t in_bytes = file_size(opt.input);
+    std::printf("%-8s %-10s %-10s %-6s %10s %8s %11s %8s %9s %9s %8s %8s %8s\n", "mode", "format", "schema", "parser", "records",
+                "wall_s", "rec/s", "MB/s", "rss_MB", "alloc/rec", "parse_s", "conv_s", "write_s");
+    nlohmann::json results = nlohmann::json::array();
+    for (BenchRun& r : runs) {
+        if (g_stop_requested) break;
+        bench_one(self, opt, dir, r);
+        const double rps = r.wall > 0 ? r.records / r.wall : 0;
+        const double mbps = r.wall > 0 ? in_bytes / 1e6 / r.wall : 0;
+        auto stage = [&](const char* k) {
+            char b[32];
+            if (r.stages.contains(k)) std::snprintf(b, sizeof(b), "%.3f", r.stages[k].get<double>());
+            else std::snprintf(b, sizeof(b), "-");
+            return std::string(b);
+        };
+        if (r.ok)
+            std::printf("%-8s %-10s %-10s %-6s %10llu %8.3f %11.0f %8.1f %9.1f %9.1f %8s %8s %8s\n", r.mode.c_str(),
+                        r.format.c_str(), r.schema.c_str(), r.parser.c_str(), (unsigned long long)r.records, r.wall, rps, mbps, r.peak_rss_kb / 1024.0,
+                        r.allocs_per_record, stage("parse_s").c_str(), stage("convert_s").c_str(), stage("write_s").c_str());
+        else
+            std::printf("%-8s %-10s %-10s %-6s   failed\n", r.mode.c_str(), r.format.c_str(), r.schema.c_str(),
+                        r.parser.c_str());
+        std::fflush(stdout);
+
+        nlohmann::json j = {{"mode", r.mode}, {"format", r.format}, {"schema", r.schema}, {"parser", r.parser}, {"ok", r.ok},
+                            {"records", r.records}, {"wall_s", r.wall}, {"records_per_s", rps},
+                            {"mb_per_s", mbps}, {"peak_rss_kb", r.peak_rss_kb}, {"output_bytes", r.out_bytes},
+                            {"allocs_per_record", r.allocs_per_record}};
+        for (auto it = r.stages.begin(); it != r.stages.end(); ++it) j[it.key()] = it.value();
+        results.push_back(std::move(j));
+    }
+    rmdir(dir.c_str());
+
+    if (!opt.bench_json.empty()) {
+        nlohmann::json doc = {{"input", opt.input}, {"input_bytes", in_bytes}, {"threads", opt.threads},
+                              {"chunked", opt.chunked}, {"dom", opt.dom}, {"runs", results}};
+        std::ofstream f(opt.bench_json, std::ios::out | std::ios::trunc);
+        f << doc.dump(2) << "\n";
+        if (!f) { std::cerr << "[!] Failed to write " << opt.bench_json << "\n"; return 5; }
+    }
+    for (const BenchRun& r : runs) if (!r.ok) return 10;
+    return 0;
+}
+
+// ---------- Conversion server (--serve) ----------
+// One warm process for many small conversions, instead of paying process
+// startup, parser setup and the SQLite open per job. --serve ADDR listens on
+// a Unix socket (a path) or on TCP (HOST:PORT; :PORT is 127.0.0.1) and
+// speaks just enough HTTP/1.1 for curl and orchestration clients:
+//
+//   POST /convert[?mode=M&record-tag=T&record-path=P&path=FILE]
+//        body: the XML (Content-Length or chunked, up to --serve-max-body
+//        bytes, else 413), unless path= names a file under --serve-root
+//        (refused without it)
+//   GET  /stats   totals since startup
+//
+// Each connection (keep-alive included) is served by one of --threads
+// workers. jsonl and bson/msgpack/cbor records are streamed back as they are
+// converted (chunked transfer encoding); with --format sqlite they go to the
+// database opened at startup, committed once per request, and the body is
+// the request's stats. Either way the response ends with an
+// X-Xmlstream-Stats trailer. The remaining options (--fields, --where,
+// --schema-file, --dom, ...) apply to every request.
+
+struct HttpRequest {
+    std::string method, target, path;
+    std::vector<std::pair<std::string, std::string>> query;
+    int64_t content_length = -1;
+    bool chunked = false;
+    bool keep_alive = true;
+    bool expect_continue = false;
+
+    const std::string* param(const char* name) const {
+        for (const auto& kv : query)
+            if (kv.first == name) return &kv.second;
+        return nullptr;
+    }
+};
+
+// %XX and '+' in a query component
+static std::string url_decode(const std::string& s) {
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '+') {
+            out += ' ';
+        } else if (s[i] == '%' && i + 2 < s.size() && std::isxdigit((unsigned char)s[i + 1]) &&
+                   std::isxdigit((unsigned char)s[i + 2])) {
+            out += (char)std::stoi(s.substr(i + 1, 2), nullptr, 16);
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+// One client connection: buffered reads of request heads and bodies,
+// blocking writes. Closes the socket when done.
+class HttpConn {
+public:
+    static constexpr size_t k_max_head = 64u << 10;
+    static constexpr int k_idle_ms = 10000;     // keep-alive connections idle longer are closed
+
+    explicit HttpConn(int fd) : fd_(fd) {}
+    ~HttpConn() { ::close(fd_); }
+    HttpConn(const HttpConn&) = delete;
+    HttpConn& operator=(const HttpConn&) = delete;
+
+    // the next request's head; false on EOF, idle timeout, shutdown or a
+    // malformed head (`bad` set for the latter, to answer 400)
+    bool read_request(HttpRequest& req, bool& bad) {
+        bad = false;
+        size_t end;
+        while ((end = in_.find("\r\n\r\n", pos_)) == std::string::npos) {
+            if (in_.size() - pos_ > k_max_head) { bad = true; return false; }
+            if (!fill()) return false;
+        }
+        std::string head = in_.substr(pos_, end - pos_);
+        pos_ = end + 4;
+        req = HttpRequest();
+
+        size_t eol = head.find("\r\n");
+        const std::string line = head.substr(0, eol);
+        const size_t sp1 = line.find(' '), sp2 = line.rfind(' ');
+        if (sp1 == std::string::npos || sp2 == sp1) { bad = true; return false; }
+        req.method = line.substr(0, sp1);
+        req.target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+        if (line.compare(sp2 + 1, std::string::npos, "HTTP/1.0") == 0) req.keep_alive = false;
+        const size_t q = req.target.find('?');
+        req.path = req.target.substr(0, q);
+        if (q != std::string::npos)
+            for (const std::string& kv : split_list(req.target.substr(q + 1), '&')) {
+                const size_t eq = kv.find('=');
+                req.query.emplace_back(url_decode(kv.substr(0, eq)),
+                                       eq == std::string::npos ? std::string() : url_decode(kv.substr(eq + 1)));
+            }
+
+        while (eol != std::string::npos) {
+            const size_t next = head.find("\r\n", eol + 2);
+            std::string h = head.substr(eol + 2, next == std::string::npos ? std::string::npos : next - eol - 2);
+            eol = next;
+            const size_t colon = h.find(':');
+            if (colon == std::string::npos) continue;
+            std::string name = h.substr(0, colon), value = h.substr(colon + 1);
+            for (char& ch : name) ch = (char)std::tolower((unsigned char)ch);
+            value.erase(0, value.find_first_not_of(" \t"));
+            for (char& ch : value) ch = (char)std::tolower((unsigned char)ch);
+            if (name == "content-length") {
+                char* e = nullptr;
+                req.content_length = std::strtoll(value.c_str(), &e, 10);
+                if (e == value.c_str() || req.content_length < 0) { bad = true; return false; }
+            } else if (name == "transfer-encoding") {
+                req.chunked = value.find("chunked") != std::string::npos;
+            } else if (name == "connection") {
+                if (value == "close") req.keep_alive = false;
+                else if (value == "keep-alive") req.keep_alive = true;
+            } else if (name == "expect") {
+                req.expect_continue = value == "100-continue";
+            }
+        }
+        return true;
+    }
+
+    // the request's body into `body`; false if the client went away, the
+    // chunked framing is broken or the body is longer than `max` bytes
+    // (`too_large` set; a Content-Length over it is refused before reading)
+    bool read_body(const HttpRequest& req, std::string& body, size_t max, bool& too_large) {
+        body.clear();
+        too_large = !req.chunked && req.content_length > (int64_t)max;
+        if (too_large) return false;
+        if (req.expect_continue && !send("HTTP/1.1 100 Continue\r\n\r\n")) return false;
+        if (!req.chunked) return take((size_t)std::max<int64_t>(0, req.content_length), body);
+        for (;;) {
+            size_t eol;
+            while ((eol = in_.find("\r\n", pos_)) == std::string::npos)
+                if (!fill()) return false;
+            const size_t n = std::strtoull(in_.c_str() + pos_, nullptr, 16);
+            pos_ = eol + 2;
+            if (n == 0) {
+                // skip any trailers up to the blank line
+                while ((eol = in_.find("\r\n", pos_)) != pos_) {
+                    if (eol == std::string::npos) { if (!fill()) return false; continue; }
+                    pos_ = eol + 2;
+                }
+                pos_ += 2;
+                return true;
+            }
+            if (n > max - body.size()) {
+                too_large = true;
+                return false;
+            }
+            if (!take(n, body)) return false;
+            std::string crlf;
+            if (!take(2, crlf) || crlf != "\r\n") return false;
+        }
+    }
+
+    bool send(const std::string& s) { return send(s.data(), s.size()); }
+    bool send(const char* p, size_t n) {
+        while (n) {
+            const ssize_t w = ::send(fd_, p, n, MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            p += w;
+            n -= (size_t)w;
+        }
+        return true;
+    }
+
+    // a whole response with a JSON body
+    bool reply(int status, const char* reason, const std::string& json, bool keep_alive) {
+        return send("HTTP/1.1 " + std::to_string(status) + " " + reason +
+                    "\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(json.size() + 1) +
+                    (keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n") + json + "\n");
+    }
+
+private:
+    // appends `n` body bytes to `out`
+    bool take(size_t n, std::string& out) {
+        while (in_.size() - pos_ < n) {
+            out.append(in_, pos_, std::string::npos);
+            n -= in_.size() - pos_;
+            in_.clear();
+            pos_ = 0;
+            if (!fill()) return false;
+        }
+        out.append(in_, pos_, n);
+        pos_ += n;
+        return true;
+    }
+
+    // reads more into in_; false on EOF, error, idle timeout or shutdown
+    bool fill() {
+        if (pos_ > 0 && pos_ == in_.size()) { in_.clear(); pos_ = 0; }
+        for (int waited = 0;;) {
+            if (g_stop_requested) return false;
+            pollfd p{fd_, POLLIN, 0};
+            const int r = ::poll(&p, 1, 200);
+            if (r < 0 && errno != EINTR) return false;
+            if (r <= 0) {
+                if ((waited += 200) >= k_idle_ms) return false;
+                continue;
+            }
+            char buf[64 << 10];
+            const ssize_t n = ::recv(fd_, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            in_.append(buf, (size_t)n);
+            return true;
+        }
+    }
+
+    int fd_;
+    std::string in_;
+    size_t pos_ = 0;
+};
+
+// A 200 response streamed as chunks of about k_chunk bytes; the head goes
+// out with the first chunk, so a request that fails before producing
+// anything can still be answered with an error status.
+class HttpChunkedReply {
+public:
+    static constexpr size_t k_chunk = 64u << 10;
+
+    HttpChunkedReply(HttpConn& c, const char* content_type, bool keep_alive)
+        : c_(c), type_(content_type), keep_alive_(keep_alive) {}
+
+    std::string& buf() { return buf_; }
+    bool started() const { return started_; }
+    bool ok() const { return ok_; }
+
+    // sends the buffer once it holds a chunk's worth
+    void commit() { if (buf_.size() >= k_chunk) flush(); }
+
+    void flush() {
+        if (!ok_) { buf_.clear(); return; }
+        std::string head;
+        if (!started_) {
+            head = std::string("HTTP/1.1 200 OK\r\nContent-Type: ") + type_ +
+                   "\r\nTransfer-Encoding: chunked\r\nTrailer: X-Xmlstream-Stats\r\n" +
+                   (keep_alive_ ? "\r\n" : "Connection: close\r\n\r\n");
+            started_ = true;
+        }
+        if (!buf_.empty()) {
+            char size[32];
+            head += std::string(size, (size_t)std::snprintf(size, sizeof(size), "%zx\r\n", buf_.size()));
+            buf_ += "\r\n";
+        }
+        ok_ = c_.send(head) && c_.send(buf_);
+        buf_.clear();
+    }
+
+    // the last chunk and the stats trailer
+    bool finish(const std::string& stats) {
+        flush();
+        return ok_ && c_.send("0\r\nX-Xmlstream-Stats: " + stats + "\r\n\r\n");
+    }
+
+private:
+    HttpConn& c_;
+    const char* type_;
+    const bool keep_alive_;
+    std::string buf_;
+    bool started_ = false;
+    bool ok_ = true;
+};
+
+// What the workers share
+struct ServeState {
+    const Options* opt = nullptr;
+    const RecordPaths* records = nullptr;
+    std::atomic<uint64_t> requests{0}, failed{0}, records_out{0}, input_bytes{0};
+    StatClock::time_point started = StatClock::now();
+#ifdef WITH_SQLITE
+    sqlite3* db = nullptr;
+    std::unique_ptr<SqliteWriter> sqlite;
+    std::mutex sqlite_m;                    // one request's batch at a time
+#endif
+};
+
+// POST /convert
+// path= FILE -> its real path in `resolved`: relative to --serve-root
+// `root` (itself a real path), and false unless the result (symlinks
+// followed) is still under it
+static bool serve_resolve(const std::string& root, const std::string& file, std::string& resolved) {
+    const std::string joined = !file.empty() && file[0] == '/' ? file : root + "/" + file;
+    char* rp = realpath(joined.c_str(), nullptr);
+    if (!rp) return false;
+    resolved = rp;
+    free(rp);
+    const std::string prefix = root.back() == '/' ? root : root + "/";
+    return resolved == root || resolved.compare(0, prefix.size(), prefix) == 0;
+}
+
+// --serve: no external entity or DTD is ever fetched, whatever a request declares
+static xmlParserInputPtr serve_refuse_entity(const char* url, const char*, xmlParserCtxtPtr) {
+    std::cerr << "[!] serve: refused to load external entity " << (url ? url : "(null)") << "\n";
+    return nullptr;
+}
+
+static void serve_convert(HttpConn& c, const HttpRequest& req, ServeState& st, bool& keep_alive) {
+    const auto t0 = StatClock::now();
+    Options opt = *st.opt;
+    RecordPaths paths;
+    const RecordPaths* rp = st.records;
+    const std::string* mode = req.param("mode");
+    const std::string* tag = req.param("record-tag");
+    const std::string* rpath = req.param("record-path");
+    const std::string* file = req.param("path");
+    bool body_read = false;
+    auto fail = [&](int status, const char* reason, const std::string& msg) {
+        ++st.requests;
+        ++st.failed;
+        // an unread body would be taken for the next request
+        if (!body_read && (req.content_length > 0 || req.chunked)) keep_alive = false;
+        std::cerr << "[!] serve: " << req.method << " " << req.target << ": " << msg << "\n";
+        nlohmann::json j = {{"error", msg}};
+        if (!c.reply(status, reason, j.dump(), keep_alive)) keep_alive = false;
+    };
+
+    if (mode || tag || rpath) {
+        if (mode) opt.mode = *mode;
+        if (tag || rpath) {
+            opt.record_tag = tag ? *tag : std::string();
+            opt.record_path = rpath ? *rpath : std::string();
+        }
+        const RecordMode* m = find_mode(opt.mode);
+        if (!m) return fail(400, "Bad Request", "invalid mode");
+        if (opt.schema == "relational" && opt.mode != "nmap")
+            return fail(400, "Bad Request", "--schema relational takes --mode nmap only");
+        if (m->record_tag && opt.record_tag.empty() && opt.record_path.empty()) opt.record_tag = m->record_tag;
+        if (!compile_record_paths(opt, paths) || paths.paths.empty())
+            return fail(400, "Bad Request", "invalid or missing record-tag / record-path");
+        rp = &paths;
+    }
+    if (rp->paths.empty()) return fail(400, "Bad Request", "record-tag or record-path is required");
+    opt.records = rp;
+
+    // the input: the body, or a file the server reads itself
+    std::string body;
+    bool too_large = false;
+    if (!c.read_body(req, body, opt.serve_max_body, too_large)) {
+        keep_alive = false;
+        if (too_large)
+            fail(413, "Payload Too Large", "body over --serve-max-body (" + std::to_string(opt.serve_max_body) + " bytes)");
+        return;
+    }
+    body_read = true;
+    xmlTextReaderPtr r = nullptr;
+    uint64_t in_bytes = body.size();
+    if (file) {
+        if (opt.serve_root.empty()) return fail(403, "Forbidden", "path= needs a server started with --serve-root");
+        std::string resolved;
+        if (!serve_resolve(opt.serve_root, *file, resolved)) return fail(403, "Forbidden", "outside --serve-root: " + *file);
+        struct stat sb;
+        if (::stat(resolved.c_str(), &sb) != 0 || !S_ISREG(sb.st_mode))
+            return fail(404, "Not Found", "cannot read " + *file);
+        in_bytes = (uint64_t)sb.st_size;
+        r = xmlReaderForFile(resolved.c_str(), nullptr, k_request_parse_options);
+    } else if (!body.empty()) {
+        // whole: --serve-max-body keeps it under INT_MAX
+        r = xmlReaderForMemory(body.data(), (int)body.size(), "request", nullptr, k_request_parse_options);
+    } else {
+        return fail(400, "Bad Request", "empty body (send the XML, or path=FILE)");
+    }
+    if (!r) return fail(500, "Internal Server Error", "cannot create the XML reader");
+
+    const RecordConverter convert = record_converter(opt, opt.dom);
+    const BinaryFormat bin = binary_format(opt.format);
+    const bool to_sqlite = opt.format == "sqlite";
+    HttpChunkedReply out(c, to_sqlite ? "application/json"
+                            : bin != BinaryFormat::none ? "application/octet-stream" : "application/x-ndjson",
+                         keep_alive);
+    std::vector<Record> rows;               // --format sqlite: committed together
+    Record rec;
+    std::unique_ptr<RecordMatcher> matcher;
+    uint64_t records = 0;
+    int ret = xmlTextReaderRead(r);
+    while (ret == 1 && out.ok()) {
+        if (!matcher) {
+            const xmlNodePtr node = xmlTextReaderCurrentNode(r);
+            matcher.reset(new RecordMatcher(*rp, node && node->doc ? node->doc->dict : nullptr));
+        }
+        const int route = xmlTextReaderNodeType(r) != XML_READER_TYPE_ELEMENT ? -1
+                        : matcher->match((size_t)std::max(0, xmlTextReaderDepth(r)),
+                                         xmlTextReaderConstLocalName(r), xmlTextReaderConstPrefix(r));
+        if (route < 0) {
+            ret = xmlTextReaderRead(r);
+            continue;
+        }
+        rec.route = (size_t)route;
+        xmlNodePtr node = xmlTextReaderExpand(r);
+        if (node && node->type == XML_ELEMENT_NODE && convert(node, opt, rec, nullptr, nullptr)) {
+            ++records;
+            if (to_sqlite) {
+                rows.push_back(std::move(rec));
+                rec = Record();
+            } else {
+                out.buf() += rec.json;
+                if (bin == BinaryFormat::none) out.buf() += '\n';
+                out.commit();
+            }
+        }
+        ret = xmlTextReaderNext(r);
+    }
+    xmlFreeTextReader(r);
+    const bool parse_failed = ret < 0;
+    if (parse_failed && !out.started()) return fail(422, "Unprocessable Entity", "XML parse error");
+
+#ifdef WITH_SQLITE
+    if (to_sqlite && !parse_failed && out.ok()) {
+        std::lock_guard<std::mutex> lk(st.sqlite_m);
+        for (Record& row : rows) st.sqlite->add(row);
+        if (!st.sqlite->flush()) {
+            st.sqlite->clear_failed();
+            return fail(500, "Internal Server Error", "SQLite insert failed");
+        }
+    }
+#endif
+    const double ms = std::chrono::duration<double, std::milli>(StatClock::now() - t0).count();
+    char stats[160];
+    std::snprintf(stats, sizeof(stats), "records=%llu input_bytes=%llu ms=%.3f%s", (unsigned long long)records,
+                  (unsigned long long)in_bytes, ms, parse_failed ? " error=parse" : "");
+    if (to_sqlite) {
+        nlohmann::json j = {{"records", parse_failed ? 0 : records}, {"input_bytes", in_bytes}, {"ms", ms}};
+        if (parse_failed) j["error"] = "XML parse error";
+        out.buf() += j.dump() + "\n";
+    }
+    if (!out.finish(stats)) keep_alive = false;
+    ++st.requests;
+    if (parse_failed) ++st.failed;
+    st.records_out += records;
+    st.input_bytes += in_bytes;
+    if (opt.progress || parse_failed)
+        std::cerr << (parse_failed ? "[!] serve: " : "[*] serve: ") << req.method << " " << req.target << ": "
+                  << stats << "\n";
+}
+
+// one connection, request after request
+static void serve_connection(int fd, ServeState& st) {
+    HttpConn c(fd);
+    HttpRequest req;
+    bool bad = false;
+    bool keep_alive = true;
+    while (keep_alive && c.read_request(req, bad)) {
+        keep_alive = req.keep_alive;
+        if (req.path == "/convert" && req.method == "POST") {
+            serve_convert(c, req, st, keep_alive);
+        } else if (req.path == "/stats" && req.method == "GET") {
+            const double up = std::chrono::duration<double>(StatClock::now() - st.started).count();
+            nlohmann::json j = {{"requests", st.requests.load()}, {"failed", st.failed.load()},
+                                {"records", st.records_out.load()}, {"input_bytes", st.input_bytes.load()},
+                                {"uptime_s", up}};
+            if (!c.reply(200, "OK", j.dump(), keep_alive)) keep_alive = false;
+        } else {
+            // an unread body would be taken for the next request
+            if (req.content_length > 0 || req.chunked) keep_alive = false;
+            const bool known = req.path == "/convert" || req.path == "/stats";
+            c.reply(known ? 405 : 404, known ? "Method Not Allowed" : "Not Found",
+                    "{\"error\":\"use POST /convert or GET /stats\"}", false);
+        }
+    }
+    if (bad) c.reply(400, "Bad Request", "{\"error\":\"malformed request\"}", false);
+}
+
+// A listening socket for ADDR (a path, or HOST:PORT / :PORT); -1 after a
+// message on failure.
+static int serve_listen(const std::string& addr) {
+    const size_t colon = addr.rfind(':');
+    if (addr.find('/') != std::string::npos || colon == std::string::npos) {
+        sockaddr_un sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (addr.size() >= sizeof(sa.sun_path)) {
+            std::cerr << "[!] --serve: socket path too long: " << addr << "\n";
+            return -1;
+        }
+        std::memcpy(sa.sun_path, addr.c_str(), addr.size());
+        const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        // a socket file left by an earlier server is replaced
+        struct stat sb;
+        if (::stat(addr.c_str(), &sb) == 0 && S_ISSOCK(sb.st_mode)) ::unlink(addr.c_str());
+        if (fd < 0 || ::bind(fd, (sockaddr*)&sa, sizeof(sa)) != 0 || ::listen(fd, 128) != 0) {
+            std::cerr << "[!] --serve: cannot listen on " << addr << ": " << std::strerror(errno) << "\n";
+            if (fd >= 0) ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    std::string host = addr.substr(0, colon);
+    const std::string port = addr.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+    if (host.empty()) host = "127.0.0.1";
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* res = nullptr;
+    if (const int e = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) {
+        std::cerr << "[!] --serve: " << addr << ": " << gai_strerror(e) << "\n";
+        return -1;
+    }
+    int fd = -1;
+    for (addrinfo* ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        const int one = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (::bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || ::listen(fd, 128) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(res);
+    if (fd < 0) std::cerr << "[!] --serve: cannot listen on " << addr << ": " << std::strerror(errno) << "\n";
+    return fd;
+}
+
+// Serves until SIGINT; the exit code.
+static int run_serve(const Options& opt, const RecordPaths& records) {
+    xmlInitParser();                        // once, before the workers
+    xmlSetExternalEntityLoader(serve_refuse_entity);
+    ServeState st;
+    st.opt = &opt;
+    st.records = &records;
+#ifdef WITH_SQLITE
+    if (opt.format == "sqlite") {
+        if (sqlite3_open(opt.sqlite_db.c_str(), &st.db) != SQLITE_OK) {
+            std::cerr << "[!] SQLite open failed: " << opt.sqlite_db << "\n";
+            sqlite3_close(st.db);
+            return 7;
+        }
+        try {
+            sqlite_apply_pragmas(st.db, opt);
+            std::unique_ptr<SqliteInserter> ins;
+            if (opt.schema == "relational") {
+                sqlite_ensure_relational_schema(st.db);
+                ins.reset(new SqliteRelationalInserter(st.db));
+            } else {
+                sqlite_ensure_schema(st.db, opt.sqlite_table);
+                ins.reset(new SqliteJsonInserter(st.db, {opt.sqlite_table}));
+            }
+            // batches never fill up: flush() commits each request
+            st.sqlite.reset(new SqliteWriter(st.db, std::move(ins), SIZE_MAX, false));
+        } catch (const std::exception& ex) {
+            std::cerr << "[!] " << ex.what() << "\n";
+            st.sqlite.reset();
+            sqlite3_close(st.db);
+            return 8;
+        }
+    }
+#endif
+    const int lfd = serve_listen(opt.serve);
+    if (lfd < 0) return 5;
+    const int workers = std::max(1, opt.threads);
+    std::cerr << "[*] Serving on " << opt.serve << " with " << workers << " worker" << (workers > 1 ? "s" : "")
+              << " (POST /convert, GET /stats; Ctrl-C stops)\n";
+
+    // accepted connections wait here for a free worker
+    BoundedQueue<int> conns((size_t)workers * 4);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < workers; ++i)
+        pool.emplace_back([&] {
+            int fd;
+            while (conns.pop(fd)) serve_connection(fd, st);
+        });
+    while (!g_stop_requested) {
+        pollfd p{lfd, POLLIN, 0};
+        if (::poll(&p, 1, 200) <= 0) continue;
+        const int fd = ::accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) conns.push(fd);
+    }
+    ::close(lfd);
+    if (opt.serve.find('/') != std::string::npos || opt.serve.find(':') == std::string::npos)
+        ::unlink(opt.serve.c_str());
+    conns.close();
+    for (std::thread& th : pool) th.join();
+#ifdef WITH_SQLITE
+    if (st.sqlite) {
+        st.sqlite->finish();
+        st.sqlite.reset();
+        sqlite3_close(st.db);
+    }
+#endif
+    std::cerr << "\n[*] Served " << st.requests.load() << " requests (" << st.failed.load() << " failed), "
+              << st.records_out.load() << " records\n";
+    return 0;
+}
+
+// ---------- Main ----------
+int main(int argc, char** argv) {
+    std::signal(SIGINT, sigint_handler);
+
+    // Help if no args and stdin is a TTY (no pipe)
+    if (argc == 1 && isatty(STDIN_FILENO)) {
+        print_help(argv[0]);
+        std::cerr << "\nTip: pipe XML in or use -i/--input.\n";
+        return 0;
+    }
+
+    Options opt;
+
+    static option longopts[] = {
+        {"input",       required_argument, nullptr, 'i'},
+        {"output",      required_argument, nullptr, 'o'},
+        {"mode",        required_argument, nullptr,  1 },
+        {"record-tag",  required_argument, nullptr,  2 },
+        {"format",      required_argument, nullptr,  3 },
+        {"pretty",      no_argument,       nullptr,  4 },
+        {"schema",      required_argument, nullptr, 22 },
+        {"dom",         no_argument,       nullptr,  8 },
+        {"threads",     required_argument, nullptr,  9 },
+        {"unordered",   no_argument,       nullptr, 10 },
+        {"queue",       required_argument, nullptr, 11 },
+        {"chunked",     no_argument,       nullptr, 12 },
+        {"chunk-size",  required_argument, nullptr, 13 },
+        {"mysql-rows-per-insert", required_argument, nullptr, 14 },
+        {"mysql-max-packet",      required_argument, nullptr, 15 },
+        {"mysql-commit-every",    required_argument, nullptr, 16 },
+        {"gen-corpus",  required_argument, nullptr, 23 },
+        {"bench",       no_argument,       nullptr, 24 },
+        {"bench-json",  required_argument, nullptr, 25 },
+        {"stats",       required_argument, nullptr, 26 },
+        {"compress",    required_argument, nullptr, 28 },
+        {"compress-level",   required_argument, nullptr, 29 },
+        {"compress-threads", required_argument, nullptr, 30 },
+        {"progress",    no_argument,       nullptr, 27 },
+        {"out-buffer",  required_argument, nullptr, 31 },
+        {"out-direct",  no_argument,       nullptr, 32 },
+        {"parser",      required_argument, nullptr, 33 },
+        {"fields",      required_argument, nullptr, 34 },
+        {"where",       required_argument, nullptr, 35 },
+        {"record-path", required_argument, nullptr, 36 },
+        {"mysql-table", required_argument, nullptr, 37 },
+        {"checkpoint",  required_argument, nullptr, 39 },
+        {"checkpoint-interval", required_argument, nullptr, 40 },
+        {"resume",      no_argument,       nullptr, 41 },
+        {"delta",       required_argument, nullptr, 42 },
+        {"tombstones",  required_argument, nullptr, 43 },
+        {"shard-by",    required_argument, nullptr, 44 },
+        {"shards",      required_argument, nullptr, 45 },
+        {"infer-schema",required_argument, nullptr, 46 },
+        {"schema-file", required_argument, nullptr, 47 },
+        {"serve",       required_argument, nullptr, 48 },
+        {"max-record-bytes", required_argument, nullptr, 53 },
+        {"max-children",     required_argument, nullptr, 54 },
+        {"spill",       required_argument, nullptr, 55 },
+        {"input-list",  required_argument, nullptr, 56 },
+        {"serve-root",  required_argument, nullptr, 57 },
+        {"max-shards",  required_argument, nullptr, 58 },
+        {"serve-max-body", required_argument, nullptr, 59 },
+#ifdef WITH_SQLITE
+        {"sqlite-db",   required_argument, nullptr,  5 },
+        {"sqlite-table",required_argument, nullptr,  6 },
+        {"batch",       required_argument, nullptr,  7 },
+        {"sqlite-journal",    required_argument, nullptr, 17 },
+        {"sqlite-sync",       required_argument, nullptr, 18 },
+        {"sqlite-cache-size", required_argument, nullptr, 19 },
+        {"sqlite-page-size",  required_argument, nullptr, 20 },
+        {"sqlite-async",      no_argument,       nullptr, 21 },
+#endif
+        {"help",        no_argument,       nullptr, 'h'},
+        {0,0,0,0}
+    };
+
+    while (true) {
+        int idx = 0;
+        int c = getopt_long(argc, argv, "i:o:h", longopts, &idx);
+        if (c == -1) break;
+        switch (c) {
+            case 'i': opt.input = optarg; opt.input_specs.push_back(optarg); break;
+            case 'o': opt.output = optarg; break;
+            case 'h': print_help(argv[0]); return 0;
+            case 1:   opt.mode = optarg; break;
+            case 2:   opt.record_tag = optarg; break;
+            case 3:   opt.format = optarg; break;
+            case 4:   opt.pretty = true; break;
+            case 22:  opt.schema = optarg; break;
+            case 8:   opt.dom = true; break;
+            case 9:   opt.threads = std::max(1, atoi(optarg)); break;
+            case 10:  opt.unordered = true; break;
+            case 11:  opt.queue_depth = std::max(1, atoi(optarg)); break;
+            case 12:  opt.chunked = true; break;
+            case 13:  opt.chunk_size = std::max<size_t>(4096, parse_size(optarg)); break;
+            case 14:  opt.mysql_rows_per_insert = (size_t)std::max(1, atoi(optarg)); break;
+            case 15:  opt.mysql_max_packet = std::max<size_t>(1024, parse_size(optarg)); break;
+            case 16:  opt.mysql_commit_every = (size_t)std::max(0, atoi(optarg)); break;
+            case 23:  opt.gen_corpus = optarg; break;
+            case 24:  opt.bench = true; break;
+            case 25:  opt.bench_json = optarg; break;
+            case 26:  opt.stats_file = optarg; break;
+            case 27:  opt.progress = true; break;
+            case 28:  opt.compress = optarg; break;
+            case 29:  opt.compress_level = std::max(0, atoi(optarg)); break;
+            case 30:  opt.compress_threads = std::max(0, atoi(optarg)); break;
+            case 31:  opt.out_buffer = std::max<size_t>(OutBuf::k_min_cap, parse_size(optarg)); break;
+            case 32:  opt.out_direct = true; break;
+            case 33:  opt.parser = optarg; break;
+            case 34:  opt.fields += opt.fields.empty() ? optarg : std::string(",") + optarg; break;
+            case 35:  opt.where += opt.where.empty() ? optarg : std::string(",") + optarg; break;
+            case 36:  opt.record_path += opt.record_path.empty() ? optarg : std::string(",") + optarg; break;
+            case 37:  opt.mysql_table = optarg; break;
+            case 39:  opt.checkpoint = optarg; break;
+            case 40:  opt.checkpoint_interval = std::max(1, atoi(optarg)); break;
+            case 41:  opt.resume = true; break;
+            case 42:  opt.delta = optarg; break;
+            case 43:  opt.tombstones = optarg; break;
+            case 44:  opt.shard_by = optarg; break;
+            case 45:  opt.shards = (size_t)std::max(1L, atol(optarg)); break;
+            case 46:  opt.infer_sample = (size_t)std::max(1L, atol(optarg)); break;
+            case 47:  opt.schema_file = optarg; break;
+            case 48:  opt.serve = optarg; break;
+            case 53:  opt.max_record_bytes = std::max<size_t>(1, parse_size(optarg)); break;
+            case 54:  opt.max_children = (size_t)std::max(1L, atol(optarg)); break;
+            case 55:  opt.spill = optarg; break;
+            case 56:  opt.input_list = optarg; break;
+            case 57:  opt.serve_root = optarg; break;
+            case 58:  opt.max_shards = (size_t)std::max(1L, atol(optarg)); break;
+            case 59:  opt.serve_max_body = std::min<size_t>(std::max<size_t>(1, parse_size(optarg)), INT_MAX); break;
+#ifdef WITH_SQLITE
+            case 5:   opt.use_sqlite = true; opt.sqlite_db = optarg; break;
+            case 6:   opt.sqlite_table = optarg; break;
+            case 7:   opt.sqlite_batch = std::max(1, atoi(optarg)); break;
+            case 17:  opt.sqlite_journal = optarg; break;
+            case 18:  opt.sqlite_sync = optarg; break;
+            case 19:  opt.sqlite_cache_size = atol(optarg); break;
+            case 20:  opt.sqlite_page_size = atoi(optarg); break;
+            case 21:  opt.sqlite_async = true; break;
+#endif
+            default:  print_help(argv[0]); return 1;
+        }
+    }
+    // files after the options are more inputs (an unquoted `-i *.xml`)
+    for (int a = optind; a < argc; ++a) opt.input_specs.push_back(argv[a]);
+
+    if (!opt.gen_corpus.empty()) {
+        CorpusSpec spec;
+        if (!parse_corpus_spec(opt.gen_corpus, spec)) {
+            std::cerr << "[!] Invalid --gen-corpus spec\n";
+            return 2;
+        }
+        if (opt.output == "-") return gen_corpus(spec, std::cout);
+        std::ofstream f(opt.output, std::ios::out | std::ios::trunc);
+        if (!f) { std::cerr << "[!] Failed to open output\n"; return 5; }
+        return gen_corpus(spec, f);
+    }
+    if (opt.bench) {
+        if (opt.mode == "nmap" && opt.record_tag.empty()) opt.record_tag = "host";
+        return run_bench(argv[0], opt);
+    }
+    if (!opt.stats_file.empty()) count_allocs();
+
+    // several inputs: -i more than once, files after the options, a
+    // directory or glob, or --input-list (see inputs_convert)
+    bool several = opt.input_specs.size() > 1 || !opt.input_list.empty();
+    for (const std::string& spec : opt.input_specs) {
+        struct stat sb;
+        const bool exists = ::stat(spec.c_str(), &sb) == 0;
+        if ((exists && S_ISDIR(sb.st_mode)) || (!exists && spec.find_first_of("*?[") != std::string::npos))
+            several = true;
+    }
+    if (several) {
+        if (!expand_inputs(opt, opt.inputs)) return 4;
+        if (opt.inputs.empty()) {
+            std::cerr << "[!] No input files\n";
+            return 4;
+        }
+        if (std::find(opt.inputs.begin(), opt.inputs.end(), "-") != opt.inputs.end()) {
+            std::cerr << "[!] stdin (-) can't be one of several inputs\n";
+            return 2;
+        }
+        opt.input = opt.inputs[0];          // what --infer-schema samples
+    } else if (!opt.input_specs.empty()) {
+        opt.input = opt.input_specs[0];
+    }
+    const bool multi = !opt.inputs.empty();
+
+    // Extra guard: input is stdin but no pipe
+    if (opt.input == "-" && isatty(STDIN_FILENO) && opt.serve.empty()) {
+        print_help(argv[0]);
+        std::cerr << "\nTip: no input on stdin. Pipe XML or use -i/--input.\n";
+        return 0;
+    }
+
+    const RecordMode* mode = find_mode(opt.mode);
+    if (!mode) {
+        std::cerr << "[!] Invalid --mode\n";
+        return 2;
+    }
+    if (mode->record_tag && opt.record_tag.empty() && opt.record_path.empty()) {
+        opt.record_tag = mode->record_tag;
+    }
+    RecordPaths record_paths;
+    if (!compile_record_paths(opt, record_paths)) return 2;
+    if (record_paths.paths.empty() && opt.serve.empty()) {
+        std::cerr << "[!] --record-tag or --record-path is required for streaming conversion.\n";
         return 9;
     }
+    opt.records = &record_paths;
+#ifndef WITH_SQLITE
+    if (opt.format == "sqlite") {
+        std::cerr << "[!] Rebuild with -DWITH_SQLITE to enable --format sqlite\n";
+        return 3;
+    }
+#endif
+    if (opt.format != "jsonl" && opt.format != "mysql-sql" && opt.format != "mysql-tsv" && opt.format != "sqlite" &&
+        binary_format(opt.format) == BinaryFormat::none) {
+        std::cerr << "[!] Invalid --format (jsonl | bson | msgpack | cbor | mysql-sql | mysql-tsv | sqlite)\n";
+        return 2;
+    }
 
-    // Streaming loop
-    int ret = xmlTextReaderRead(reader);
-    while (ret == 1 && !g_stop_requested) {
-        int type = xmlTextReaderNodeType(reader);
-        if (type == XML_READER_TYPE_ELEMENT) {
-            const xmlChar* nm = xmlTextReaderConstName(reader);
-            std::string tag = nm ? (const char*)nm : "";
-
-            if (tag == opt.record_tag) {
-                xmlNodePtr node = xmlTextReaderExpand(reader);
-                if (node && node->type == XML_ELEMENT_NODE) {
-                    nlohmann::json j;
-                    if (opt.mode == "nmap" && tag == "host") {
-                        j = nmap_host_to_obj(node);
-                    } else {
-                        j = node_to_json(node);
-                        auto it = j.begin(); // unwrap {"tag": {...}} -> {..., "_tag": "tag"}
-                        if (it != j.end()) { nlohmann::json merged = it.value(); merged["_tag"] = it.key(); j = merged; }
-                    }
-                    const std::string json_str = opt.pretty ? j.dump(2) : j.dump();
-                    const std::string tag_val  = j.contains("_tag") ? j["_tag"].get<std::string>() : opt.record_tag;
+    const bool relational = (opt.schema == "relational");
+    if (opt.schema != "json" && !relational) {
+        std::cerr << "[!] Invalid --schema\n";
+        return 2;
+    }
+    if (relational && (opt.mode != "nmap" || (opt.format != "sqlite" && opt.format != "mysql-sql"))) {
+        std::cerr << "[!] --schema relational needs --mode nmap and --format sqlite or mysql-sql\n";
+        return 2;
+    }
+    if (opt.chunked && opt.input == "-") {
+        std::cerr << "[!] --chunked needs a regular file (-i FILE), not stdin\n";
+        return 2;
+    }
+    if (opt.chunked && !record_paths.names_only()) {
+        std::cerr << "[!] --chunked finds records by name only (--record-tag or //name paths)\n";
+        return 2;
+    }
+    bool use_sax = (opt.parser == "sax");
+    if (opt.parser != "reader" && !use_sax) {
+        std::cerr << "[!] Invalid --parser (reader | sax)\n";
+        return 2;
+    }
+    // --max-record-bytes / --max-children hold where records are built piece
+    // by piece: the SAX parser, and the Nmap streamer for <host>
+    const bool limited = opt.max_record_bytes || opt.max_children;
+    if (limited && opt.mode == "generic") use_sax = true;
+    if (use_sax && (opt.mode != "generic" || opt.dom || opt.pretty || opt.threads > 1 || opt.chunked)) {
+        std::cerr << (opt.parser == "sax" ? "[!] --parser sax" : "[!] --max-record-bytes/--max-children")
+                  << " needs --mode generic without --dom/--pretty/--threads/--chunked\n";
+        return 2;
+    }
+    if (limited && opt.mode == "nmap") {
+        bool hosts = true;
+        for (const std::string& name : record_paths.routes) hosts = hosts && name == "host";
+        if (!hosts || opt.dom || opt.pretty || opt.threads > 1 || opt.chunked || relational || !opt.delta.empty()) {
+            std::cerr << "[!] --max-record-bytes/--max-children in --mode nmap need streamed <host> records: no other\n"
+                         "    record tags, --dom/--pretty/--threads/--chunked/--delta or --schema relational\n";
+            return 2;
+        }
+    }
+    if (multi && (use_sax || limited || !opt.serve.empty() || !opt.checkpoint.empty())) {
+        std::cerr << "[!] Several inputs can't be combined with --parser sax, --max-record-bytes/--max-children,\n"
+                     "    --serve or --checkpoint\n";
+        return 2;
+    }
+    const bool binary = binary_format(opt.format) != BinaryFormat::none;
+
+    RecordQuery query;
+    if (!opt.fields.empty() || !opt.where.empty()) {
+        if (relational) {
+            std::cerr << "[!] --fields/--where filter JSON records; they don't apply to --schema relational\n";
+            return 2;
+        }
+        if (!compile_record_query(opt, query)) return 2;
+        opt.query = &query;
+    }
+
+    Codec out_codec = Codec::none;
+    if (!opt.compress.empty()) {
+        if (opt.compress == "zstd") out_codec = Codec::zstd;
+        else if (opt.compress == "gzip") out_codec = Codec::gzip;
+        else { std::cerr << "[!] Invalid --compress (zstd | gzip)\n"; return 2; }
+        if (!codec_compiled(out_codec)) {
+            std::cerr << "[!] Rebuild with " << (out_codec == Codec::zstd ? "-DWITH_ZSTD -lzstd" : "-DWITH_ZLIB -lz")
+                      << " to enable --compress " << opt.compress << "\n";
+            return 3;
+        }
+        if (opt.format != "jsonl" && opt.format != "mysql-sql" && !binary) {
+            std::cerr << "[!] --compress applies to --format jsonl, bson/msgpack/cbor and mysql-sql only\n";
+            return 2;
+        }
+    }
+
+    DeltaIndex delta;
+    if (!opt.delta.empty()) {
+        if (opt.mode != "nmap") {
+            std::cerr << "[!] --delta tracks Nmap hosts; it needs --mode nmap\n";
+            return 2;
+        }
+        // a filtered or partial run would report the hosts it didn't see as gone
+        if (!opt.where.empty() || !opt.checkpoint.empty()) {
+            std::cerr << "[!] --delta can't be combined with --where or --checkpoint\n";
+            return 2;
+        }
+        if (!delta.load(opt.delta)) return 2;
+        if (opt.tombstones.empty()) opt.tombstones = opt.delta + ".removed.jsonl";
+        opt.delta_index = &delta;
+    } else if (!opt.tombstones.empty()) {
+        std::cerr << "[!] --tombstones needs --delta INDEX\n";
+        return 2;
+    }
+
+    TypeNode types;
+    if (opt.infer_sample || !opt.schema_file.empty()) {
+        if (relational) {
+            std::cerr << "[!] --infer-schema/--schema-file type JSON records; they don't apply to --schema relational\n";
+            return 2;
+        }
+        if (opt.mode == "nmap") schema_seed_nmap(types);
+        if (opt.infer_sample) {
+            if (opt.input == "-") {
+                std::cerr << "[!] --infer-schema samples -i FILE; for stdin, pass a saved --schema-file\n";
+                return 2;
+            }
+            InputSource sample;
+            if (!infer_schema(opt, input_reader(opt.input, sample), types)) return 4;
+            if (!opt.schema_file.empty() && !write_file_atomic(opt.schema_file, schema_to_json(types).dump(2) + "\n"))
+                return 5;
+        } else {
+            std::ifstream f(opt.schema_file);
+            try {
+                if (!f) throw std::runtime_error("cannot be read");
+                schema_from_json(nlohmann::json::parse(f), types);
+            } catch (const std::exception& ex) {
+                std::cerr << "[!] --schema-file " << opt.schema_file << ": " << ex.what() << "\n";
+                return 2;
+            }
+        }
+        opt.types = &types;
+    }
+
+    ShardSpec shard;
+    if (!opt.shard_by.empty()) {
+        if (!parse_shard_spec(opt, shard)) return 2;
+        if (!opt.checkpoint.empty()) {
+            std::cerr << "[!] --shard-by can't be combined with --checkpoint\n";
+            return 2;
+        }
+        // each dump numbers its rows from MAX(id) when it is loaded, so dumps
+        // loaded side by side into one database would hand out the same ids
+        if (relational && opt.format == "mysql-sql") {
+            std::cerr << "[!] --shard-by can't be combined with --schema relational --format mysql-sql\n";
+            return 2;
+        }
+        if (opt.query && !query.keep.covers(shard.path)) {
+            std::cerr << "[!] --shard-by " << opt.shard_by << " must be kept by --fields\n";
+            return 2;
+        }
+        opt.shard = &shard;
+    } else if (opt.shards) {
+        std::cerr << "[!] --shards needs --shard-by PATH\n";
+        return 2;
+    }
+
+    RecordLimits limits;
+    if (limited) {
+        // a resumed run would truncate the spill file the earlier records point into
+        if (!opt.serve.empty() || !opt.checkpoint.empty()) {
+            std::cerr << "[!] --max-record-bytes/--max-children can't be combined with --serve or --checkpoint\n";
+            return 2;
+        }
+        limits.max_bytes = opt.max_record_bytes;
+        limits.max_children = opt.max_children;
+        if (opt.max_record_bytes) {
+            std::string spill = opt.spill;
+            std::string base = opt.output;
+#ifdef WITH_SQLITE
+            if (opt.format == "sqlite") base = opt.sqlite_db;
+#endif
+            if (spill.empty() && !base.empty() && base != "-") spill = base + ".spill";
+            if (spill.empty()) {
+                std::cerr << "[!] --max-record-bytes without -o FILE needs --spill FILE\n";
+                return 5;
+            }
+            limits.spill_fd = ::open(spill.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (limits.spill_fd < 0) {
+                std::cerr << "[!] Failed to open " << spill << "\n";
+                return 5;
+            }
+            limits.spill_path = spill;
+        }
+        opt.limits = &limits;
+    } else if (!opt.spill.empty()) {
+        std::cerr << "[!] --spill needs --max-record-bytes N\n";
+        return 2;
+    }
+
+    // --serve: requests bring the input, responses (or the database) take the output
+    if (!opt.serve.empty()) {
+        if (opt.format != "jsonl" && opt.format != "sqlite" && !binary) {
+            std::cerr << "[!] --serve writes jsonl, bson/msgpack/cbor or sqlite\n";
+            return 2;
+        }
+        if (opt.shard || opt.delta_index || !opt.checkpoint.empty() || opt.chunked || use_sax ||
+            out_codec != Codec::none || opt.output != "-") {
+            std::cerr << "[!] --serve can't be combined with -o, --shard-by, --delta, --checkpoint, --chunked,\n"
+                         "    --parser sax or --compress\n";
+            return 2;
+        }
+        if (!opt.serve_root.empty()) {
+            char* root = realpath(opt.serve_root.c_str(), nullptr);
+            struct stat sb;
+            if (!root || ::stat(root, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+                std::cerr << "[!] --serve-root: not a directory: " << opt.serve_root << "\n";
+                free(root);
+                return 2;
+            }
+            opt.serve_root = root;
+            free(root);
+        }
+#ifdef WITH_SQLITE
+        if (opt.format == "sqlite" && opt.sqlite_db.empty()) {
+            std::cerr << "[!] --sqlite-db is required for --format sqlite\n";
+            return 6;
+        }
+        if (opt.format == "sqlite" && opt.sqlite_table.find("{tag}") != std::string::npos) {
+            std::cerr << "[!] --serve writes one --sqlite-table; {tag} doesn't apply\n";
+            return 2;
+        }
+#endif
+        return run_serve(opt, record_paths);
+    }
+    if (!opt.serve_root.empty()) {
+        std::cerr << "[!] --serve-root needs --serve\n";
+        return 2;
+    }
 
+    uint64_t input_size = 0;
+    struct stat in_sb;
+    if (opt.input != "-" && ::stat(opt.input.c_str(), &in_sb) == 0 && S_ISREG(in_sb.st_mode))
+        input_size = (uint64_t)in_sb.st_size;
+    if (multi) {
+        input_size = 0;
+        for (const std::string& path : opt.inputs)
+            if (::stat(path.c_str(), &in_sb) == 0) input_size += (uint64_t)in_sb.st_size;
+    }
+
+    // --checkpoint: the outputs must be plain files that can be cut back to
+    // a checkpoint, and records must reach them in input order
+    const bool checkpointing = !opt.checkpoint.empty();
+    CheckpointState ckpt;                   // where --resume starts (skip 0 from the top otherwise)
+    if (opt.resume && !checkpointing) {
+        std::cerr << "[!] --resume needs --checkpoint FILE\n";
+        return 2;
+    }
+    if (checkpointing) {
+        if (opt.unordered) {
+            std::cerr << "[!] --checkpoint needs records written in input order (no --unordered)\n";
+            return 2;
+        }
+        if (out_codec != Codec::none || opt.out_direct) {
+            std::cerr << "[!] --checkpoint needs plain buffered output (no --compress or --out-direct)\n";
+            return 2;
+        }
+        if (opt.format != "sqlite" && opt.output == "-") {
+            std::cerr << "[!] --checkpoint needs -o FILE\n";
+            return 5;
+        }
+    }
+    if (opt.resume) {
+        if (!checkpoint_load(opt.checkpoint, ckpt)) return 2;
+        if (ckpt.input != opt.input || ckpt.input_size != input_size || ckpt.format != opt.format) {
+            std::cerr << "[!] --resume: " << opt.checkpoint << " is for " << ckpt.input << " (" << ckpt.input_size
+                      << " bytes) as " << ckpt.format << "\n";
+            return 2;
+        }
+        if (ckpt.complete) {
+            std::cerr << "[*] --resume: " << opt.checkpoint << " says the conversion already finished\n";
+            return 0;
+        }
+        if (ckpt.skip && (ckpt.offset != 0) != opt.chunked) {
+            std::cerr << "[!] --resume: the checkpoint was taken " << (opt.chunked ? "without" : "with") << " --chunked\n";
+            return 2;
+        }
+        if (ckpt.skip && !opt.chunked)
+            std::cerr << "[*] --resume: parsing past the " << ckpt.skip << " records already converted\n";
+    }
+
+    // Input reader (the chunked and several-input paths open the files
+    // themselves). The first bytes decide whether the input goes through a
+    // background decoder. The backend's io_read feeds either the reader or
+    // the SAX parser.
+    xmlTextReaderPtr reader = nullptr;
+    InputSource input;
+    const char* in_url = opt.input == "-" ? nullptr : opt.input.c_str();
+    if (!multi && opt.chunked) {
+        const int fd = ::open(opt.input.c_str(), O_RDONLY);
+        unsigned char magic[6];
+        const ssize_t nmagic = fd < 0 ? -1 : read_full(fd, magic, sizeof(magic));
+        if (fd >= 0) ::close(fd);
+        if (nmagic < 0) {
+            std::cerr << "[!] Failed to open input\n";
+            return 4;
+        }
+        const Codec in_codec = sniff_codec(magic, (size_t)nmagic);
+        if (in_codec != Codec::none) {
+            std::cerr << "[!] --chunked needs an uncompressed file (input is " << codec_name(in_codec) << ")\n";
+            return 2;
+        }
+    } else if (!multi) {
+        if (use_sax) {
+            if (int rc = input_open(opt.input, true, input)) return rc;
+        } else {
+            reader = input_reader(opt.input, input);
+            if (!reader) return 4;
+        }
+    }
+    std::unique_ptr<SaxRecordParser> sax;
+    if (use_sax && input.read) sax.reset(new SaxRecordParser(opt));
+    if (!reader && !sax && !opt.chunked && !multi) {
+        std::cerr << "[!] Failed to open input\n";
+        return 4;
+    }
+    // bytes of the input consumed so far (compressed bytes for compressed input)
+    auto input_consumed = [&]() -> uint64_t {
+        if (input.decomp) return input.decomp->compressed_consumed();
+        if (sax) return sax->consumed();
+        return reader ? (uint64_t)std::max(0L, xmlTextReaderByteConsumed(reader)) : 0;
+    };
+
+    // Output targets. `{tag}` in -o writes each record type (route) to its
+    // own file; in --mysql-table / --sqlite-table, to its own table.
+    // --shard-by splits the output into shards (see ShardSpec) instead.
+    const std::vector<std::string>& routes = record_paths.routes;
+    bool to_jsonl    = (opt.format == "jsonl");
+    bool to_binary   = binary;
+    bool to_mysql    = (opt.format == "mysql-sql");
+    bool to_tsv      = (opt.format == "mysql-tsv");
+#ifdef WITH_SQLITE
+    bool to_sqlite   = (opt.format == "sqlite");
+#endif
+    const bool to_text = to_jsonl || to_binary || to_mysql || to_tsv;
+    const bool per_file = to_text && opt.output.find("{tag}") != std::string::npos;
+    const bool per_table = opt.mysql_table.find("{tag}") != std::string::npos
+#ifdef WITH_SQLITE
+        || (to_sqlite && opt.sqlite_table.find("{tag}") != std::string::npos)
+#endif
+        ;
+
+    if (to_tsv && opt.output == "-") {
+        std::cerr << "[!] --format mysql-tsv needs -o FILE (the loader script refers to it)\n";
+        xmlFreeTextReader(reader);
+        return 5;
+    }
+    if (relational && (per_file || per_table)) {
+        std::cerr << "[!] {tag} outputs don't apply to --schema relational\n";
+        xmlFreeTextReader(reader);
+        return 2;
+    }
+    if (to_tsv && per_table && !per_file) {
+        std::cerr << "[!] --format mysql-tsv: {tag} in --mysql-table needs {tag} in -o as well\n";
+        xmlFreeTextReader(reader);
+        return 2;
+    }
+    if (opt.shard && (per_file || (to_text && opt.output == "-"))) {
+        std::cerr << "[!] --shard-by needs -o FILE without {tag}\n";
+        xmlFreeTextReader(reader);
+        return 5;
+    }
+
+    // One output: a text file (or one per route) with its own INSERT
+    // writers, or a SQLite database. With --shard-by, one per shard, and
+    // with --threads the shards are written by a pool of writer threads.
+    struct ShardWriter;
+    struct Sink {
+        std::string path;
+        std::unique_ptr<OutBuf> out;
+        std::unique_ptr<MysqlTxn> txn;
+        std::vector<std::unique_ptr<MysqlInsertWriter>> mysql; // one per route with {tag} in --mysql-table
+        std::unique_ptr<MysqlRelationalWriter> rel;            // --schema relational
+#ifdef WITH_SQLITE
+        sqlite3* db = nullptr;
+        std::unique_ptr<SqliteWriter> sqlite;
+#endif
+        void (*write)(Sink& sk, Record& r) = nullptr;          // see pick_writer
+        ShardWriter* writer = nullptr;                         // --shard-by --threads: the pool thread writing it
+    };
+    std::deque<Sink> sinks;                 // stable references while shards are added
+    // --shard-by with --threads: shard i is written by shard_writers[i % size]
+    struct ShardWrite { Sink* sk = nullptr; Record r; };
+    struct ShardWriter {
+        BoundedQueue<ShardWrite> queue{256};
+        std::thread thread;
+    };
+    std::deque<ShardWriter> shard_writers;
+    // the tables a sink's records go to
+    auto sink_tables = [&](const std::string& pattern, size_t sink) {
+        std::vector<std::string> tables;
+        if (per_file) tables.push_back(route_target(pattern, routes[sink], true));
+        else if (pattern.find("{tag}") != std::string::npos)
+            for (const std::string& r : routes) tables.push_back(route_target(pattern, r, true));
+        else tables.push_back(pattern);
+        return tables;
+    };
+    // the format-specific part of writing a record: one writer per sink,
+    // picked when it opens, so emit doesn't test the format per record
+    auto pick_writer = [&](const Sink& sk) -> void (*)(Sink&, Record&) {
 #ifdef WITH_SQLITE
-                    if (to_sqlite) {
-                        sqlite_buf.emplace_back(tag_val, json_str);
-                        if ((int)sqlite_buf.size() >= opt.sqlite_batch) {
-                            try { sqlite_batch_insert(sdb, opt.sqlite_table, sqlite_buf); }
-                            catch (const std::exception& ex) { std::cerr << "[!] SQLite: " << ex.what() << "\n"; }
-                            sqlite_buf.clear();
-                        }
-                    } else
-#endif
-                    if (to_mysql) {
-                        mysql_write_insert(*pout, "records", tag_val, json_str);
-                    } else if (to_jsonl) {
-                        *pout << json_str << "\n";
+        if (sk.sqlite)
+            return [](Sink& s, Record& r) {
+                s.sqlite->add(r);
+                if (s.sqlite->failed()) g_stop_requested = 1;   // stop reading; later batches are dropped
+            };
+#endif
+        if (sk.rel) return [](Sink& s, Record& r) { if (r.nmap) s.rel->add(*r.nmap); };
+        if (to_mysql && sk.mysql.size() > 1) return [](Sink& s, Record& r) { s.mysql[r.route]->add(r.tag, r.json); };
+        if (to_mysql) return [](Sink& s, Record& r) { s.mysql[0]->add(r.tag, r.json); };
+        if (to_tsv) return [](Sink& s, Record& r) { mysql_tsv_write_row(*s.out, r.tag, r.json); };
+        if (to_jsonl) return [](Sink& s, Record& r) { s.out->write(r.json); s.out->put('\n'); };
+        if (to_binary) return [](Sink& s, Record& r) { s.out->write(r.json); };
+        return [](Sink&, Record&) {};
+    };
+    // Sets up sinks[i] writing to `path` (the i-th route with per_file);
+    // 0, or the exit code after a message.
+    auto open_sink = [&](size_t i, const std::string& path) -> int {
+        Sink& sk = sinks[i];
+        sk.path = path;
+#ifdef WITH_SQLITE
+        if (to_sqlite) {
+            if (sqlite3_open(path.c_str(), &sk.db) != SQLITE_OK) { std::cerr << "[!] SQLite open failed: " << path << "\n"; return 7; }
+            try {
+                sqlite_apply_pragmas(sk.db, opt);
+                std::unique_ptr<SqliteInserter> ins;
+                if (relational) {
+                    sqlite_ensure_relational_schema(sk.db);
+                    ins.reset(new SqliteRelationalInserter(sk.db));
+                } else {
+                    const std::vector<std::string> tables = sink_tables(opt.sqlite_table, 0);
+                    for (const std::string& table : tables) sqlite_ensure_schema(sk.db, table);
+                    ins.reset(new SqliteJsonInserter(sk.db, tables));
+                }
+                if (checkpointing) {
+                    ckpt.input = opt.input;
+                    ckpt.input_size = input_size;
+                    sqlite_ensure_checkpoint_table(sk.db);
+                    // the row committed with the last batch may be past the file
+                    CheckpointState row;
+                    if (opt.resume && sqlite_load_checkpoint(sk.db, row)) {
+                        if (row.input != opt.input || row.input_size != input_size)
+                            throw std::runtime_error("--resume: the database's checkpoint is for " + row.input);
+                        ckpt.offset = row.offset;
+                        ckpt.skip = row.skip;
                     }
                 }
-                // Skip subtree quickly
-                xmlTextReaderNext(reader);
-                ret = xmlTextReaderRead(reader);
-                continue;
+                sk.sqlite.reset(new SqliteWriter(sk.db, std::move(ins), (size_t)opt.sqlite_batch, opt.sqlite_async,
+                                                 checkpointing ? &ckpt : nullptr));
+            }
+            catch (const std::exception& ex) { std::cerr << "[!] " << ex.what() << "\n"; return 8; }
+        }
+#endif
+        if (to_text) {
+            const int fd = path == "-" ? STDOUT_FILENO
+                         : ::open(path.c_str(), O_WRONLY | O_CREAT | (opt.resume ? 0 : O_TRUNC), 0644);
+            if (fd < 0) { std::cerr << "[!] Failed to open output " << path << "\n"; return 5; }
+            if (opt.resume) {
+                // drop whatever was written after the checkpoint, then append
+                auto it = std::find_if(ckpt.outputs.begin(), ckpt.outputs.end(),
+                                       [&](const std::pair<std::string, uint64_t>& o) { return o.first == path; });
+                struct stat sb;
+                if (it == ckpt.outputs.end() || fstat(fd, &sb) != 0 || (uint64_t)sb.st_size < it->second ||
+                    ftruncate(fd, (off_t)it->second) != 0 || lseek(fd, 0, SEEK_END) < 0) {
+                    std::cerr << "[!] --resume: " << path << " doesn't match " << opt.checkpoint << "\n";
+                    ::close(fd);
+                    return 5;
+                }
+            }
+            if (out_codec != Codec::none)
+                sk.out.reset(new CompressingOut(fd, fd != STDOUT_FILENO, opt.out_buffer,
+                                                make_encoder(out_codec, opt.compress_level, opt.compress_threads)));
+            else
+                sk.out.reset(new OutBuf(fd, fd != STDOUT_FILENO, opt.out_buffer));
+            if (opt.out_direct && !sk.out->set_direct())
+                std::cerr << "[!] --out-direct: O_DIRECT not available for this output; using buffered writes\n";
+        }
+        if (to_mysql) {
+            sk.txn.reset(new MysqlTxn(*sk.out, opt.mysql_commit_every));
+            // a resumed dump keeps the preamble it already has
+            if (relational) {
+                if (!opt.resume) mysql_relational_preamble(*sk.out);
+                sk.rel.reset(new MysqlRelationalWriter(*sk.txn, opt.mysql_rows_per_insert, opt.mysql_max_packet));
+                sk.rel->resume(ckpt.host_seq, ckpt.port_seq);
+            } else {
+                const std::vector<std::string> tables = sink_tables(opt.mysql_table, i);
+                if (!opt.resume) mysql_write_preamble(*sk.out, tables[0]);
+                for (size_t k = 0; k < tables.size(); ++k) {
+                    if (k && !opt.resume) mysql_write_create_table(*sk.out, tables[k]);
+                    sk.mysql.emplace_back(new MysqlInsertWriter(*sk.txn, "INSERT INTO `" + tables[k] + "`(`tag`,`json`) VALUES",
+                                                                opt.mysql_rows_per_insert, opt.mysql_max_packet));
+                }
+            }
+        }
+        if (to_tsv) {
+            const std::string loader_path = path + ".load.sql";
+            const int lfd = ::open(loader_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            bool loader_ok = lfd >= 0;
+            if (loader_ok) {
+                OutBuf loader(lfd, true, OutBuf::k_min_cap);
+                char* abs = realpath(path.c_str(), nullptr);
+                mysql_write_loader(loader, sink_tables(opt.mysql_table, i)[0], abs ? abs : path);
+                free(abs);
+                loader_ok = loader.finish();
+            }
+            if (!loader_ok) { std::cerr << "[!] Failed to write " << loader_path << "\n"; return 5; }
+        }
+        sk.write = pick_writer(sk);
+        if (!shard_writers.empty()) sk.writer = &shard_writers[i % shard_writers.size()];
+        return 0;
+    };
+    // drains the shard writer pool
+    auto stop_writers = [&] {
+        for (ShardWriter& w : shard_writers) w.queue.close();
+        for (ShardWriter& w : shard_writers) w.thread.join();
+        for (Sink& sk : sinks) sk.writer = nullptr;
+        shard_writers.clear();
+    };
+    auto close_dbs = [&] {
+#ifdef WITH_SQLITE
+        for (Sink& sk : sinks) {
+            sk.sqlite.reset();
+            if (sk.db) sqlite3_close(sk.db);
+            sk.db = nullptr;
+        }
+#endif
+    };
+
+#ifdef WITH_SQLITE
+    if (to_sqlite && opt.sqlite_db.empty()) { std::cerr << "[!] --sqlite-db is required for --format sqlite\n"; xmlFreeTextReader(reader); return 6; }
+    const std::string& base_path = to_sqlite ? opt.sqlite_db : opt.output;
+    const bool any_sink = to_text || to_sqlite;
+#else
+    const std::string& base_path = opt.output;
+    const bool any_sink = to_text;
+#endif
+    // --shard-by: shard names (value mode: opened as values turn up). A
+    // shard keeps its files open to the end -- a SQLite database up to three
+    // (-wal, -shm) -- so the open file limit, raised to its hard limit first,
+    // caps the shard count as well.
+    std::map<std::string, size_t> shard_of_value;
+    size_t shard_cap = 0;
+    if (opt.shard && any_sink) {
+        uint64_t files = 1024;
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+            if (rl.rlim_cur < rl.rlim_max) {
+                rl.rlim_cur = rl.rlim_max;
+                if (setrlimit(RLIMIT_NOFILE, &rl) != 0) getrlimit(RLIMIT_NOFILE, &rl);
+            }
+            files = rl.rlim_cur == RLIM_INFINITY ? UINT64_MAX : (uint64_t)rl.rlim_cur;
+        }
+        uint64_t per_shard = 1;
+#ifdef WITH_SQLITE
+        if (to_sqlite) per_shard = 3;
+#endif
+        const uint64_t reserved = 64;       // input, spill file, stdio, --delta, loader scripts
+        const uint64_t fit = files > reserved ? (files - reserved) / per_shard : 0;
+        shard_cap = opt.shard->count ? opt.shard->count : opt.max_shards;
+        if (shard_cap > fit) {
+            if (opt.shard->count) {
+                std::cerr << "[!] --shards " << opt.shard->count << " needs more open files than the limit ("
+                          << files << ") allows; use at most " << fit << " shards\n";
+                xmlFreeTextReader(reader);
+                return 5;
+            }
+            shard_cap = (size_t)fit;
+        }
+        if (opt.threads > 1)
+            for (size_t w = 0, n = std::min<size_t>((size_t)opt.threads, std::max<size_t>(1, shard_cap)); w < n; ++w) {
+                shard_writers.emplace_back();
+                ShardWriter& sw = shard_writers.back();
+                sw.thread = std::thread([&sw] {
+                    ShardWrite job;
+                    while (sw.queue.pop(job)) job.sk->write(*job.sk, job.r);
+                });
             }
+    }
+    const size_t fixed_sinks = !any_sink ? 0 : per_file ? routes.size()
+                             : opt.shard && opt.shard->count ? opt.shard->count : opt.shard ? 0 : 1;
+    for (size_t i = 0; i < fixed_sinks; ++i) {
+        sinks.emplace_back();
+        const std::string path = per_file ? route_target(opt.output, routes[i], false)
+                               : opt.shard ? shard_target(base_path, std::to_string(i)) : base_path;
+        if (const int rc = open_sink(i, path)) {
+            stop_writers();
+            close_dbs();
+            xmlFreeTextReader(reader);
+            return rc;
         }
-        ret = xmlTextReaderRead(reader);
     }
+    bool shard_failed = false;
+    // the sink of a record's shard value; nullptr when it can't be opened
+    auto shard_sink = [&](const std::string& key) -> Sink* {
+        if (opt.shard->count) return &sinks[fnv1a64(key.data(), key.size()) % opt.shard->count];
+        auto it = shard_of_value.find(key);
+        if (it != shard_of_value.end()) return &sinks[it->second];
+        if (shard_of_value.size() >= shard_cap) {
+            std::cerr << "[!] --shard-by " << opt.shard_by << ": more than " << shard_cap << " distinct values; hash them"
+                         " into --shards N or group addresses with /BITS"
+                      << (shard_cap < opt.max_shards ? " (the open file limit allows no more)\n" : " (or raise --max-shards)\n");
+            shard_failed = true;
+            g_stop_requested = 1;
+            return nullptr;
+        }
+        const size_t i = sinks.size();
+        sinks.emplace_back();
+        if (open_sink(i, shard_target(base_path, shard_name(key))) != 0) {
+            shard_failed = true;
+            g_stop_requested = 1;           // stop reading; nothing more can be written
+            return nullptr;
+        }
+        shard_of_value.emplace(key, i);
+        return &sinks[i];
+    };
 
+    // Compact output is written straight from the tree; the DOM is only
+    // needed for pretty-printing (or when asked for explicitly).
+    const bool use_dom = opt.dom || opt.pretty;
+    // mode, format and rendering are settled: one converter for the whole run
+    const RecordConverter convert = record_converter(opt, use_dom);
+    const BinaryFormat bin = binary_format(opt.format);
+    const bool nmap_mode = opt.mode == "nmap";
+    Record rec;             // reused across records
+    const bool serial = opt.threads <= 1 && !opt.chunked && !multi;
+    // Serial Nmap JSON never expands <host>: the streamer converts it from
+    // reader events (its parsing time is charged to `convert`). --delta
+    // fingerprints the expanded host instead.
+    const bool stream_nmap = serial && !use_dom && !relational && nmap_mode && !opt.delta_index;
+    // With plain jsonl into one file and no filter, the streamer writes the
+    // host straight into that file's output buffer; the jsonl writer then
+    // only adds the newline. Otherwise the text goes through Record::json
+    // and is copied into the buffer once.
+    OutBuf* const stream_out = stream_nmap && to_jsonl && !per_file && !opt.shard && !opt.query && !opt.types &&
+                               sinks.size() == 1 ? sinks[0].out.get() : nullptr;
+
+    RunStats stats;
+    stats.enabled = !opt.stats_file.empty();
+    stats.measured[RunStats::read] = !opt.chunked && !multi;
+    stats.measured[RunStats::expand] = !opt.chunked && !multi && !stream_nmap && !sax;
+    stats.measured[RunStats::convert] = serial;
+    stats.measured[RunStats::serialize] = serial && use_dom && !relational;
+    stats.measured[RunStats::write] = true;
+
+    Progress progress(opt.progress, input_size);
+
+    // --checkpoint: the outputs end just after the last record emitted;
+    // make that durable and say so
+    uint64_t last_offset = ckpt.offset, last_skip = ckpt.skip;
+    bool ckpt_failed = false;
+    auto save_checkpoint = [&](bool complete) {
+        CheckpointState st;
+        st.input = opt.input;
+        st.input_size = input_size;
+        st.format = opt.format;
+        st.offset = last_offset;
+        st.skip = last_skip;
+        st.complete = complete;
+        for (Sink& sk : sinks) {
 #ifdef WITH_SQLITE
-    if (!g_stop_requested && (opt.format == "sqlite") && !sqlite_buf.empty()) {
-        try { sqlite_batch_insert(sdb, opt.sqlite_table, sqlite_buf); }
-        catch (const std::exception& ex) { std::cerr << "[!] SQLite: " << ex.what() << "\n"; }
-        sqlite_buf.clear();
+            // never past a batch that was rolled back
+            if (sk.sqlite && !sk.sqlite->flush()) { ckpt_failed = true; return; }
+#endif
+            if (!sk.out) continue;
+            if (sk.rel) {
+                sk.rel->finish();
+                st.host_seq = sk.rel->host_seq();
+                st.port_seq = sk.rel->port_seq();
+            }
+            for (auto& w : sk.mysql) w->finish();
+            if (sk.txn) sk.txn->finish();
+            uint64_t pos = 0;
+            if (!sk.out->sync(pos)) { ckpt_failed = true; return; }
+            st.outputs.emplace_back(sk.path, pos);
+        }
+        if (!checkpoint_save(opt.checkpoint, st)) ckpt_failed = true;
+    };
+    std::unique_ptr<CheckpointTimer> ckpt_timer;
+    if (checkpointing) {
+        ckpt_timer.reset(new CheckpointTimer(opt.checkpoint_interval));
+        save_checkpoint(false);
+        if (ckpt_failed) { close_dbs(); xmlFreeTextReader(reader); return 5; }
+    }
+
+    // runs on exactly one thread (the main loop, or the pipeline's writer)
+    auto emit = [&](Record& r) {
+        if (!r.delta_key.empty() && !delta.note(r.delta_key, r.delta_hash)) return;   // unchanged host
+        StatClock::time_point t0;
+        if (stats.enabled) {
+            t0 = StatClock::now();
+            if (!relational) stats.record_size(r.streamed ? r.streamed : r.json.size());
+        }
+        ++stats.records;
+        last_offset = r.resume_offset;      // before the writers take the record
+        last_skip = r.resume_skip;
+        if (Sink* sk = opt.shard ? shard_sink(r.shard_key) : sinks.empty() ? nullptr : &sinks[per_file ? r.route : 0]) {
+            if (sk->writer) sk->writer->queue.push(ShardWrite{sk, std::move(r)});
+            else sk->write(*sk, r);
+        }
+        if (ckpt_timer && ckpt_timer->due()) save_checkpoint(false);
+        if (stats.enabled) stats.add(RunStats::write, t0);
+        if ((opt.chunked || multi) && progress.due()) progress.report(stats.records, 0);
+    };
+
+    // --threads: the loop below only reads and copies; conversion and
+    // writing happen on the pipeline's threads
+    std::unique_ptr<ConvertPipeline> pipeline;
+    if (opt.threads > 1 && !opt.chunked && !multi) pipeline.reset(new ConvertPipeline(opt, convert, emit));
+
+    // several inputs: a file that can't be read or parsed fails the run once
+    // the others are written; so does a --chunked chunk that fails to parse
+    bool in_failed = multi && !inputs_convert(opt, convert, emit);
+    if (opt.chunked && !multi && !chunked_convert(opt, convert, emit, ckpt.offset, ckpt.skip)) in_failed = true;
+
+    NmapHostStreamer nmap_streamer;
+    nmap_streamer.limit(opt.limits);
+
+    // Streaming loop
+    StatClock::time_point t = StatClock::now();
+    uint64_t seen = 0;
+    if (sax) {
+        sax->skip_records(ckpt.skip);
+        auto sax_emit = [&](Record& r) {
+            ++seen;
+            emit(r);
+            if (progress.due()) progress.report(seen, input_consumed());
+        };
+        if (!sax->run(input.read, input.ctx, in_url, sax_emit, stats.enabled ? &stats : nullptr, t)) in_failed = true;
+    }
+    int ret = opt.chunked || multi || sax ? 0 : xmlTextReaderRead(reader);
+    // built at the first node, when the reader's dictionary can be reached
+    std::unique_ptr<RecordMatcher> matcher;
+    uint64_t matched = 0;                   // records so far, skipped or filtered ones included
+    while (ret == 1 && !g_stop_requested) {
+        // elements other than records cost a depth lookup and a pointer compare
+        if (!matcher) {
+            const xmlNodePtr node = xmlTextReaderCurrentNode(reader);
+            matcher.reset(new RecordMatcher(record_paths, node && node->doc ? node->doc->dict : nullptr));
+        }
+        const int route = xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT ? -1
+                        : matcher->match((size_t)std::max(0, xmlTextReaderDepth(reader)),
+                                         xmlTextReaderConstLocalName(reader), xmlTextReaderConstPrefix(reader));
+        if (route < 0) {
+            ret = xmlTextReaderRead(reader);
+            continue;
+        }
+        rec.route = (size_t)route;
+        rec.resume_skip = ++matched;
+        // --resume: the records a checkpoint covers aren't even expanded
+        if (matched <= ckpt.skip) {
+            ret = xmlTextReaderNext(reader);
+            continue;
+        }
+
+        // records whose start tag already fails --where are skipped unexpanded
+        if (opt.query && !opt.query->start_tag.empty() &&
+            !record_start_tag_matches(xmlTextReaderCurrentNode(reader), *opt.query, nmap_mode)) {
+            ret = xmlTextReaderNext(reader);
+            continue;
+        }
+        if (stream_nmap && xmlStrEqual(xmlTextReaderConstLocalName(reader), BAD_CAST "host") &&
+            !doc_declares_attributes(xmlTextReaderCurrentNode(reader)->doc)) {
+            if (stats.enabled) t = stats.add(RunStats::read, t);
+            rec.json.clear();
+            rec.tag = "host";
+            std::string& out = stream_out ? stream_out->buf() : rec.json;
+            const size_t mark = out.size();
+            ret = nmap_streamer.run(reader, out, opt.query ? opt.query->render : FieldTree::everything());
+            nmap_streamer.budget().end(matched);
+            if (stream_out && ret != 1) out.resize(mark);   // a cut-off host isn't written
+            rec.streamed = stream_out ? out.size() - mark : 0;
+            const bool keep = !opt.query || query_filter(*opt.query, rec.json);
+            if (keep && opt.types) apply_types(*opt.types, rec.json);
+            if (keep && opt.shard) shard_key_from_json(*opt.shard, rec.json, rec.shard_key);
+            if (keep) record_encode(bin, rec.json);
+            if (stats.enabled) t = stats.add(RunStats::convert, t);
+            if (ret != 1) break;
+            ++seen;
+            if (keep) emit(rec);
+            if (stats.enabled) t = StatClock::now();
+            if (progress.due()) progress.report(seen, input_consumed());
+            ret = xmlTextReaderRead(reader);
+            continue;
+        }
+
+        if (stats.enabled) t = stats.add(RunStats::read, t);
+        xmlNodePtr node = xmlTextReaderExpand(reader);
+        if (stats.enabled) t = stats.add(RunStats::expand, t);
+        if (node && node->type == XML_ELEMENT_NODE) {
+            ++seen;
+            if (pipeline) {
+                if (xmlNodePtr copy = xmlCopyNode(node, 1)) pipeline->submit(copy, rec.route, matched);
+            } else {
+                const bool keep = convert(node, opt, rec, stats.enabled ? &stats : nullptr, &t);
+                if (stats.enabled) t = stats.add(RunStats::convert, t);
+                if (keep) emit(rec);            // charges its own write time
+                if (stats.enabled) t = StatClock::now();
+            }
+        }
+        if (progress.due()) progress.report(seen, input_consumed());
+        // Skip subtree quickly; Next() already lands on the following
+        // node, so don't Read() past it (that dropped adjacent records)
+        ret = xmlTextReaderNext(reader);
     }
+    // the document broke off (truncated, malformed): the records before the
+    // error are written, but the input wasn't converted to its end
+    if (ret < 0) in_failed = true;
+
+    if (stats.enabled) t = stats.add(RunStats::read, t);
+    stats.input_bytes = reader || sax ? input_consumed() : input_size;
+    if (pipeline) pipeline->finish();
+    t = StatClock::now();
+
+    stop_writers();
+    bool out_failed = shard_failed;
+#ifdef WITH_SQLITE
+    // on SIGINT too: the records emitted so far are committed, not dropped
+    for (Sink& sk : sinks)
+        if (sk.sqlite && !sk.sqlite->flush()) out_failed = true;
+#endif
+    // an interrupted run resumes from here; the postambles below are cut off again
+    if (checkpointing && g_stop_requested) save_checkpoint(false);
+#ifdef WITH_SQLITE
+    for (Sink& sk : sinks)
+        if (sk.sqlite && !sk.sqlite->finish()) out_failed = true;
 #endif
 
-    if (to_mysql) {
-        mysql_write_postamble(*pout);
+    for (Sink& sk : sinks) {
+        if (!sk.out) continue;
+        if (sk.rel) {
+            sk.rel->finish();
+            sk.txn->finish();
+            mysql_relational_postamble(*sk.out);
+        } else if (to_mysql) {
+            for (auto& w : sk.mysql) w->finish();
+            sk.txn->finish();
+            mysql_write_postamble(*sk.out);
+        }
+        if (!sk.out->finish()) out_failed = true;
+    }
+    if (checkpointing && !g_stop_requested && !out_failed && !in_failed) save_checkpoint(true);
+    if (ckpt_failed) out_failed = true;
+
+    // --delta: only a finished run knows which hosts are gone
+    if (opt.delta_index && in_failed && !g_stop_requested)
+        std::cerr << "[!] --delta: the input was not read to its end; " << opt.delta << " and " << opt.tombstones
+                  << " are left as they were\n";
+    if (opt.delta_index && !g_stop_requested && !out_failed && !in_failed) {
+        const int fd = ::open(opt.tombstones.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool delta_ok = fd >= 0;
+        if (delta_ok) {
+            OutBuf tomb(fd, true, 1u << 20);
+            delta.for_each_removed([&](const std::string& addr) {
+                tomb.buf() += "{\"_tag\":\"host_removed\",\"address\":";
+                json_append_escaped(tomb.buf(), addr.data(), addr.size());
+                tomb.buf() += "}\n";
+                tomb.commit();
+            });
+            delta_ok = tomb.finish();
+        }
+        if (!delta_ok) std::cerr << "[!] Failed to write " << opt.tombstones << "\n";
+        if (!delta_ok || !delta.save(opt.delta)) out_failed = true;
+        else std::cerr << "[*] --delta: " << delta.added << " new, " << delta.changed << " changed, " << delta.same
+                       << " unchanged, " << delta.removed << " removed hosts\n";
+    }
+    if (opt.limits) {
+        if (!limits.close()) {
+            std::cerr << "[!] Failed to write " << limits.spill_path << "\n";
+            out_failed = true;
+        }
+        if (limits.records) {
+            std::cerr << "[*] " << limits.records << " records over --max-record-bytes/--max-children: "
+                      << limits.children_dropped << " children dropped, " << limits.values_spilled << " values ("
+                      << limits.bytes_spilled << " bytes) spilled";
+            if (limits.bytes_spilled) std::cerr << " to " << limits.spill_path;
+            std::cerr << "\n";
+        }
+        stats.limits = &limits;
     }
+    if (stats.enabled) stats.add(RunStats::write, t);
+    progress.report(stats.records, opt.chunked || multi ? 0 : stats.input_bytes, true);
 
 #ifdef WITH_SQLITE
-    if (sdb) sqlite3_close(sdb);
+    for (Sink& sk : sinks)
+        if (sk.sqlite) {
+            const std::vector<double>& ms = sk.sqlite->commit_latencies_ms();
+            stats.sqlite_commit_ms.insert(stats.sqlite_commit_ms.end(), ms.begin(), ms.end());
+        }
 #endif
+    close_dbs();
     xmlFreeTextReader(reader);
     xmlCleanupParser();
 
+    if (out_failed) return 5;
+    if (stats.enabled && !write_stats_report(opt.stats_file, stats)) {
+        std::cerr << "[!] Failed to write " << opt.stats_file << "\n";
+        return 5;
+    }
+
     if (g_stop_requested) std::cerr << "\n[!] Interrupted. Exiting cleanly.\n";
-    return 0;
+    return in_failed ? 4 : 0;
 }